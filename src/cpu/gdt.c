@@ -1,4 +1,5 @@
 #include "gdt.h"
+#include "smp.h"
 #include "../libk/debug/log.h"
 #include "../libk/string.h"
 
@@ -38,13 +39,18 @@ extern void load_gdt(gdt_ptr_t *gdt_ptr);
 static void gdt_set_gate(int32_t num, uint64_t base, uint32_t limit, uint8_t access, uint8_t gran);
 static void gdt_set_tss(int32_t num, uint64_t base, uint32_t limit, uint8_t access, uint8_t gran);
 
-gdt_entry_t gdt_entries[7];
+// Five segments, then a two-slot TSS descriptor per CPU
+#define GDT_ENTRIES (5 + 2 * MAX_CPUS)
+
+gdt_entry_t gdt_entries[GDT_ENTRIES];
 gdt_ptr_t gdt_ptr;
-tss_t tss;
+tss_t tss[MAX_CPUS];
 
+/* Called on every CPU: the segments are shared, each CPU loads its own TSS. */
 void init_gdt()
 {
-    gdt_ptr.limit = (sizeof(gdt_entry_t) * 7) - 1;
+    uint32_t cpu = smp_cpu_id();
+    gdt_ptr.limit = (sizeof(gdt_entry_t) * GDT_ENTRIES) - 1;
     gdt_ptr.base = (uint64_t)&gdt_entries;
 
     gdt_set_gate(0, 0, 0, 0, 0);                // 0x00 - Null
@@ -53,12 +59,12 @@ void init_gdt()
     gdt_set_gate(3, 0, 0xFFFFF, 0xF2, 0xCF);    // 0x18 - User Data (SWAPPED!)
     gdt_set_gate(4, 0, 0xFFFFF, 0xFA, 0xAF);    // 0x20 - User Code (SWAPPED!)
 
-    memset(&tss, 0, sizeof(tss_t));
-    tss.iopb_offset = sizeof(tss_t);
-    gdt_set_tss(5, (uint64_t)&tss, sizeof(tss_t), 0x89, 0x00);  // 0x28/0x30 - TSS
+    memset(&tss[cpu], 0, sizeof(tss_t));
+    tss[cpu].iopb_offset = sizeof(tss_t);
+    gdt_set_tss(5 + 2 * cpu, (uint64_t)&tss[cpu], sizeof(tss_t), 0x89, 0x00);  // 0x28 + 16 * cpu - TSS
 
     load_gdt(&gdt_ptr);
-    __asm__ volatile("ltr %0" : : "r"((uint16_t)(5 * 8)));
+    __asm__ volatile("ltr %0" : : "r"((uint16_t)GDT_TSS_SELECTOR(cpu)));
     log("GDT Installed.", 4, 0);
 }
 
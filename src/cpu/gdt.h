@@ -2,6 +2,10 @@
 #define GDT_H
 
 #include <stdint.h>
+#include "smp.h"
+
+// Each CPU's TSS descriptor takes two GDT slots, starting at 0x28
+#define GDT_TSS_SELECTOR(cpu) (0x28 + 16 * (cpu))
 
 struct tss_struct
 {
@@ -23,6 +27,8 @@ struct tss_struct
 } __attribute__((packed));
 typedef struct tss_struct tss_t;
 
+extern tss_t tss[MAX_CPUS];
+
 void init_gdt();
 
 #endif
\ No newline at end of file
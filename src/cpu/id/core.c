@@ -1,10 +1,21 @@
 #include "core.h"
 #include "../../libk/debug/log.h"
 #include "../../drv/local_apic.h"
+#include "../../libk/core/mem.h"
+#include "../../kernel/sched.h"
 
 void ap_main(void)
 {
+    // This context becomes the CPU's idle task; the timer preempts it
+    // whenever the CPU's run queue has work.
+    sched_init_cpu();
+    LocalApicTimerStart(SCHED_TICK_HZ);
     __asm__ __volatile__("sti");
     for (;;)
-        __asm__ __volatile__("hlt");
+    {
+        // Spend idle time pre-zeroing pages for alloc_zeroed_page(), then halt
+        // until the timer or a wakeup brings work
+        if (!zero_pool_refill())
+            __asm__ __volatile__("hlt");
+    }
 }
\ No newline at end of file
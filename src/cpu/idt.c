@@ -67,6 +67,8 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void irq240();
+extern void irq241();
 
 extern void load_idt(idt_ptr_t *);
 static void idt_set_gate(uint8_t num, uint64_t base, uint16_t sel, uint8_t flags);
@@ -131,6 +133,9 @@ void init_idt()
     idt_set_gate(46, (uint64_t)irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint64_t)irq15, 0x08, 0x8E);
 
+    idt_set_gate(240, (uint64_t)irq240, 0x08, 0x8E);
+    idt_set_gate(241, (uint64_t)irq241, 0x08, 0x8E);
+
     load_idt(&idt_ptr);
     log("IDT Installed.", 4, 0);
 }
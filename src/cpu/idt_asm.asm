@@ -129,6 +129,8 @@ irq 12, 44      ; PS2 mouse
 irq 13, 45      ; FPU / coprocessor
 irq 14, 46      ; Primary ATA
 irq 15, 47      ; Secondary ATA
+irq 240, 240    ; TLB shootdown IPI
+irq 241, 241    ; Local APIC timer
 
 extern irq_handler
 irq_stub:
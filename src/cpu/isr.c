@@ -78,9 +78,26 @@ void isr_handler(registers_t* regs)
         case PAGE_FAULT: {
             uint64_t cr2;
             __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+            // Minor faults on user memory: a not-present page inside a reserved area,
+            // or a write to a copy-on-write page shared by fork. Kernel accesses to
+            // user buffers land here too (CR0.WP is set).
+            task_t *task = sched_current_task();
+            if (cr2 < USER_SPACE_END && task && !task->is_kernel_task) {
+                int handled;
+                if (!(regs->err_code & 1))
+                    handled = vma_fault(task->pml4, &task->vmas, cr2) == 0;
+                else
+                    handled = (regs->err_code & 2) && handle_cow_fault(task->pml4, cr2) == 0;
+                if (handled) {
+                    task->minor_faults++;
+                    return;
+                }
+            }
             if (regs->cs & 3) {
+                int overflow = task && !task->is_kernel_task && cr2 < task->user_stack && cr2 >= task->user_stack - PAGE_SIZE;
                 log("\n=== USERSPACE FAULT (Page Fault) ===\n         - Task: %s (PID %d)\n         - Faulting address: 0x%lx\n         - RIP: 0x%lx\n         - %s\n         - Terminating task...", 2, 1,
                     sched_current_task()->name, sched_current_task()->pid, cr2, regs->rip,
+                    overflow ? "Stack overflow (guard page)" :
                     (regs->err_code & 1) ? "Page protection violation" : "Page not present");
                 sched_current_task()->state = TASK_DEAD;
                 sched_yield();
@@ -115,4 +132,6 @@ void irq_handler(registers_t* regs)
         log("Unhandled IRQ: %d", 3, 1, regs->int_no);
     }
     LocalApicSendEOI();
+    // Switch only after the EOI, or the LAPIC holds off this vector meanwhile
+    sched_preempt();
 }
\ No newline at end of file
@@ -44,6 +44,9 @@
 #define IRQ14 46
 #define IRQ15 47
 
+#define IPI_TLB_SHOOTDOWN 0xF0
+#define LAPIC_TIMER_VECTOR 0xF1
+
 typedef struct registers
 {
     uint64_t ds;
@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include "pat.h"
+#include "../libk/debug/log.h"
+
+#define MSR_PAT     0x277
+#define CR0_CD      (1ULL << 30)
+#define CR4_PGE     (1ULL << 7)
+
+#define PAT_UC      0x00ULL
+#define PAT_WC      0x01ULL
+#define PAT_WT      0x04ULL
+#define PAT_WB      0x06ULL
+
+/*
+ * PAT entries 0-3 hold the four types ioremap() hands out (WB, WC, WT, UC),
+ * so PWT/PCD alone pick them and the PAT bit, which sits in a different
+ * place in 4 KiB and 2 MiB entries, is never needed. Entries 4-7 repeat
+ * them, which keeps Limine's framebuffer mapping (entry 5) write-combining.
+ */
+#define PAT_VALUE   ((PAT_WB << 0) | (PAT_WC << 8) | (PAT_WT << 16) | (PAT_UC << 24) | \
+                     (PAT_WB << 32) | (PAT_WC << 40) | (PAT_WT << 48) | (PAT_UC << 56))
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+/*
+ * Load the PAT on this CPU; every CPU has to run it so they all agree on
+ * what a mapping's memory type is. Caches are off and flushed around the
+ * write, and the TLB (global entries too) is flushed after it.
+ */
+void pat_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!((edx >> 16) & 1))
+    {
+        // Without a PAT, PWT/PCD still give WB/WT/UC; WC degrades to WT
+        log("PAT not supported, write-combining unavailable.", 2, 0);
+        return;
+    }
+
+    uint64_t rflags, cr0, cr4;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_CD) : "memory");
+    __asm__ volatile("wbinvd" : : : "memory");
+
+    __asm__ volatile("wrmsr" : : "c"(MSR_PAT), "a"((uint32_t)PAT_VALUE), "d"((uint32_t)(PAT_VALUE >> 32)));
+
+    __asm__ volatile("wbinvd" : : : "memory");
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (cr4 & CR4_PGE)
+    {
+        // Toggling PGE drops every TLB entry, global or not, in every PCID
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE) : "memory");
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    }
+    else
+    {
+        uint64_t cr3;
+        __asm__ volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+    }
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+    if (rflags & 0x200)
+        __asm__ volatile("sti" : : : "memory");
+}
@@ -0,0 +1,6 @@
+#ifndef PAT_H
+#define PAT_H
+
+void pat_init(void);
+
+#endif
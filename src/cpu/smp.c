@@ -3,13 +3,20 @@
 #include "../drv/local_apic.h"
 #include "../libk/string.h"
 #include "sse_fpu.h"
+#include "pat.h"
 #include "../libk/limine.h"
 #include "gdt.h"
 #include "idt.h"
 #include "id/core.h"
 #include "../drv/vga.h"
+#include "../libk/core/mem.h"
+#include "../libk/core/tlb.h"
+#include "../libk/core/syscall.h"
+#include "../kernel/sched.h"
 
-#define STACK_SIZE 4096
+// An AP keeps running on this stack as its idle task, so it needs as much
+// room as any other task's kernel stack.
+#define STACK_SIZE TASK_STACK_SIZE
 
 static volatile struct limine_smp_request smp_request = {
     .id = LIMINE_SMP_REQUEST,
@@ -17,13 +24,103 @@ static volatile struct limine_smp_request smp_request = {
 };
 
 volatile uint32_t g_activeCpuCount = 1;
-static uint8_t ap_stacks[8][STACK_SIZE] __attribute__((aligned(16)));
+static uint8_t ap_stacks[MAX_CPUS][STACK_SIZE] __attribute__((aligned(16)));
+
+// Logical CPU numbers are dense, with the BSP always being CPU 0.
+static uint8_t lapic_to_cpu[256];
+static uint8_t cpu_to_lapic[MAX_CPUS];
+static uint32_t cpu_count = 1;
+
+/*
+ * Where smp_cpu_id() gets the CPU number. Until the APs start only the BSP
+ * runs, so it is simply 0. After that each CPU keeps its number in
+ * IA32_TSC_AUX, read back by RDPID or RDTSCP without leaving a VM; reading
+ * the LAPIC ID over MMIO is the fallback.
+ */
+#define CPU_ID_BSP_ONLY 0
+#define CPU_ID_RDPID    1
+#define CPU_ID_RDTSCP   2
+#define CPU_ID_LAPIC    3
+#define MSR_TSC_AUX     0xC0000103
+
+static volatile uint32_t cpu_id_source = CPU_ID_BSP_ONLY;
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+static void set_tsc_aux(uint32_t cpu)
+{
+    __asm__ volatile("wrmsr" : : "c"(MSR_TSC_AUX), "a"(cpu), "d"(0));
+}
+
+/* Pick the fastest source the BSP supports; the APs must not be running yet */
+static void cpu_id_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t source = CPU_ID_LAPIC;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001)
+    {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        if (edx & (1U << 27))
+            source = CPU_ID_RDTSCP;
+    }
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7)
+    {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        if (ecx & (1U << 22))
+            source = CPU_ID_RDPID;
+    }
+    if (source != CPU_ID_LAPIC)
+        set_tsc_aux(0);
+    cpu_id_source = source;
+}
+
+uint32_t smp_cpu_id(void) {
+    switch (cpu_id_source) {
+        case CPU_ID_BSP_ONLY:
+            return 0;
+        case CPU_ID_RDPID: {
+            uint64_t aux;
+            __asm__ volatile("rdpid %0" : "=r"(aux));
+            return (uint32_t)aux;
+        }
+        case CPU_ID_RDTSCP: {
+            uint32_t lo, hi, aux;
+            __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+            return aux;
+        }
+        default:
+            return lapic_to_cpu[LocalApicGetId() & 0xFF];
+    }
+}
+
+uint32_t smp_cpu_count(void) {
+    return cpu_count;
+}
+
+uint32_t smp_cpu_lapic_id(uint32_t cpu) {
+    return cpu_to_lapic[cpu];
+}
 
 void ap_entry(struct limine_smp_info *info) {
     asm volatile("mov %0, %%rsp" : : "r" (ap_stacks[info->processor_id] + STACK_SIZE) : "memory");
+    // Before anything calls smp_cpu_id()
+    if (cpu_id_source != CPU_ID_LAPIC)
+        set_tsc_aux(lapic_to_cpu[info->lapic_id & 0xFF]);
+    // Limine's tables don't have the kernel heap/vmalloc window
+    switch_page_directory(get_kernel_pml4());
+    tlb_init_cpu();
+    pat_init();
     enable_sse_and_fpu();
     init_gdt();
     init_idt();
+    init_syscalls();
     LocalApicInit();
     __atomic_add_fetch(&g_activeCpuCount, 1, __ATOMIC_SEQ_CST);
     ap_main();
@@ -42,6 +139,16 @@ void init_smp() {
     }
     log("Bootstrap Processor ID: %d, Total CPUs: %d", 1, 0,
         smp->bsp_lapic_id, smp->cpu_count);
+    cpu_to_lapic[0] = smp->bsp_lapic_id;
+    lapic_to_cpu[smp->bsp_lapic_id & 0xFF] = 0;
+    for (size_t i = 0; i < smp->cpu_count && cpu_count < MAX_CPUS; i++) {
+        if (smp->cpus[i]->lapic_id != smp->bsp_lapic_id) {
+            cpu_to_lapic[cpu_count] = smp->cpus[i]->lapic_id;
+            lapic_to_cpu[smp->cpus[i]->lapic_id & 0xFF] = cpu_count;
+            cpu_count++;
+        }
+    }
+    cpu_id_init();
     for (size_t i = 0; i < smp->cpu_count; i++) {
         if (smp->cpus[i]->lapic_id != smp->bsp_lapic_id) {
             log("Starting CPU %lu (LAPIC ID %d)", 1, 0,
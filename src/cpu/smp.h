@@ -3,8 +3,13 @@
 #include "stdint.h"
 #include "acpi/acpi.h"
 
+#define MAX_CPUS 8
+
 extern volatile uint32_t g_activeCpuCount;
 
 void init_smp();
+uint32_t smp_cpu_id(void);
+uint32_t smp_cpu_count(void);
+uint32_t smp_cpu_lapic_id(uint32_t cpu);
 
 #endif
\ No newline at end of file
@@ -2,9 +2,56 @@
 #include "../../libk/ports.h"
 #include "../../libk/string.h"
 #include "../../libk/debug/log.h"
+#include "../../cpu/isr.h"
+#include "../../kernel/mutex.h"
 
 ata_drive_t drives[4];
-static uint32_t timeout_counter;
+// Per channel: set by the completion interrupt, and the tasks sleeping on it
+static volatile int irq_fired[2];
+static wait_queue_t irq_waiters[2];
+// Held from drive select to the end of the data phase; the holder may sleep
+// waiting for the drive, so nobody else may touch the channel's registers
+static mutex_t channel_lock[2];
+
+static int ata_channel(uint16_t base_io)
+{
+    return base_io == ATA_PRIMARY_IO ? 0 : 1;
+}
+
+static void ata_irq_handler(registers_t *regs)
+{
+    int channel = regs->int_no == ATA_SECONDARY_VECTOR;
+    // Reading the status register acknowledges the drive
+    inportb((channel ? ATA_SECONDARY_IO : ATA_PRIMARY_IO) + ATA_REG_STATUS);
+    irq_fired[channel] = 1;
+    wake_up_all(&irq_waiters[channel]);
+}
+
+/* Call before whatever makes the drive interrupt next */
+static void ata_irq_arm(uint16_t base_io)
+{
+    irq_fired[ata_channel(base_io)] = 0;
+}
+
+static int ata_irq_done(void *arg)
+{
+    return irq_fired[*(int *)arg];
+}
+
+/*
+ * Sleep until the drive interrupts, so a task waiting on the disk takes no
+ * CPU time. Boot code can't sleep and polls as before; so does everyone if
+ * the interrupt does not show up in time. The status is checked afterwards
+ * either way. The caller holds the channel lock, so the command in flight
+ * stays its own while it sleeps.
+ */
+static void ata_wait_irq(uint16_t base_io)
+{
+    if (!sched_can_block())
+        return;
+    int channel = ata_channel(base_io);
+    wait_until(&irq_waiters[channel], ata_irq_done, &channel, ATA_IRQ_TIMEOUT_MS);
+}
 
 static void ata_delay(uint16_t base_io)
 {
@@ -21,7 +68,7 @@ static void ata_soft_reset(uint16_t ctrl_io)
 
 static ata_error_t ata_wait_ready(uint16_t base_io)
 {
-    timeout_counter = 0;
+    uint32_t timeout_counter = 0;
 
     while (timeout_counter < ATA_TIMEOUT_MS)
     {
@@ -45,7 +92,7 @@ static ata_error_t ata_wait_ready(uint16_t base_io)
 
 static ata_error_t ata_wait_drq(uint16_t base_io)
 {
-    timeout_counter = 0;
+    uint32_t timeout_counter = 0;
     asm volatile("sti");
 
     while (timeout_counter < ATA_TIMEOUT_MS)
@@ -131,15 +178,18 @@ ata_device_type_t ata_detect_drive(uint8_t drive)
     uint16_t base_io = (drive < 2) ? ATA_PRIMARY_IO : ATA_SECONDARY_IO;
     uint8_t drive_select = drive & 1;
 
+    mutex_lock(&channel_lock[ata_channel(base_io)]);
     ata_select_drive(base_io, drive_select);
 
     if (ata_wait_ready(base_io) != ATA_SUCCESS)
     {
+        mutex_unlock(&channel_lock[ata_channel(base_io)]);
         return ATA_DEVICE_UNKNOWN;
     }
 
     uint8_t cl = inportb(base_io + ATA_REG_LBA1);
     uint8_t ch = inportb(base_io + ATA_REG_LBA2);
+    mutex_unlock(&channel_lock[ata_channel(base_io)]);
 
     if (cl == 0x14 && ch == 0xEB)
         return ATA_DEVICE_PATAPI;
@@ -156,6 +206,13 @@ ata_device_type_t ata_detect_drive(uint8_t drive)
 ata_error_t ata_init(void)
 {
     int found_drives = 0;
+    for (int c = 0; c < 2; c++)
+    {
+        wait_queue_init(&irq_waiters[c]);
+        mutex_init(&channel_lock[c]);
+    }
+    register_interrupt_handler(ATA_PRIMARY_VECTOR, ata_irq_handler, "ATA Primary");
+    register_interrupt_handler(ATA_SECONDARY_VECTOR, ata_irq_handler, "ATA Secondary");
     for (int i = 0; i < 4; i++)
     {
         drives[i].base_io = (i < 2) ? ATA_PRIMARY_IO : ATA_SECONDARY_IO;
@@ -187,18 +244,16 @@ ata_error_t ata_init(void)
     return ATA_SUCCESS;
 }
 
-ata_error_t ata_identify_drive(uint8_t drive, uint16_t *buffer)
+static ata_error_t ata_pio_identify(ata_drive_t *dev, uint16_t *buffer)
 {
-    if (drive >= 4 || !drives[drive].exists || !buffer)
-    {
-        return ATA_ERR_INVALID_PARAM;
-    }
-    uint16_t base_io = drives[drive].base_io;
-    ata_select_drive(base_io, drives[drive].drive_select);
+    uint16_t base_io = dev->base_io;
+    ata_select_drive(base_io, dev->drive_select);
     ata_error_t err = ata_wait_ready(base_io);
     if (err != ATA_SUCCESS)
         return err;
+    ata_irq_arm(base_io);
     outportb(base_io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    ata_wait_irq(base_io);
     err = ata_wait_drq(base_io);
     if (err != ATA_SUCCESS)
         return err;
@@ -209,28 +264,40 @@ ata_error_t ata_identify_drive(uint8_t drive, uint16_t *buffer)
     return ATA_SUCCESS;
 }
 
-ata_error_t ata_read_sectors(uint8_t drive, uint32_t lba, uint8_t count, void *buffer)
+ata_error_t ata_identify_drive(uint8_t drive, uint16_t *buffer)
 {
-    if (drive >= 4 || !drives[drive].exists || !buffer || count == 0 || count > ATA_MAX_SECTORS)
+    if (drive >= 4 || !drives[drive].exists || !buffer)
     {
         return ATA_ERR_INVALID_PARAM;
     }
+    mutex_t *lock = &channel_lock[ata_channel(drives[drive].base_io)];
+    mutex_lock(lock);
+    ata_error_t err = ata_pio_identify(&drives[drive], buffer);
+    mutex_unlock(lock);
+    return err;
+}
 
-    uint16_t base_io = drives[drive].base_io;
+static ata_error_t ata_pio_read(ata_drive_t *dev, uint32_t lba, uint8_t count, void *buffer)
+{
+    uint16_t base_io = dev->base_io;
     uint16_t *buf = (uint16_t *)buffer;
 
-    ata_select_drive(base_io, drives[drive].drive_select);
+    ata_select_drive(base_io, dev->drive_select);
 
     ata_error_t err = ata_wait_ready(base_io);
     if (err != ATA_SUCCESS)
         return err;
 
-    ata_setup_lba28(base_io, lba, count, drives[drive].drive_select);
+    ata_setup_lba28(base_io, lba, count, dev->drive_select);
 
+    ata_irq_arm(base_io);
     outportb(base_io + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
 
     for (int sector = 0; sector < count; sector++)
     {
+        // One interrupt per sector, once it is ready to be read
+        ata_wait_irq(base_io);
+        ata_irq_arm(base_io);
         err = ata_wait_drq(base_io);
         if (err != ATA_SUCCESS)
             return err;
@@ -244,47 +311,75 @@ ata_error_t ata_read_sectors(uint8_t drive, uint32_t lba, uint8_t count, void *b
     return ATA_SUCCESS;
 }
 
-ata_error_t ata_write_sectors(uint8_t drive, uint32_t lba, uint8_t count, const void *buffer)
+ata_error_t ata_read_sectors(uint8_t drive, uint32_t lba, uint8_t count, void *buffer)
 {
     if (drive >= 4 || !drives[drive].exists || !buffer || count == 0 || count > ATA_MAX_SECTORS)
     {
         return ATA_ERR_INVALID_PARAM;
     }
+    mutex_t *lock = &channel_lock[ata_channel(drives[drive].base_io)];
+    mutex_lock(lock);
+    ata_error_t err = ata_pio_read(&drives[drive], lba, count, buffer);
+    mutex_unlock(lock);
+    return err;
+}
 
-    uint16_t base_io = drives[drive].base_io;
+static ata_error_t ata_pio_write(ata_drive_t *dev, uint32_t lba, uint8_t count, const void *buffer)
+{
+    uint16_t base_io = dev->base_io;
     const uint16_t *buf = (const uint16_t *)buffer;
 
-    ata_select_drive(base_io, drives[drive].drive_select);
+    ata_select_drive(base_io, dev->drive_select);
 
     ata_error_t err = ata_wait_ready(base_io);
     if (err != ATA_SUCCESS)
         return err;
 
-    ata_setup_lba28(base_io, lba, count, drives[drive].drive_select);
+    ata_setup_lba28(base_io, lba, count, dev->drive_select);
 
     outportb(base_io + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
 
     for (int sector = 0; sector < count; sector++)
     {
+        // The first sector is asked for without an interrupt, the rest each after the previous one
+        if (sector)
+            ata_wait_irq(base_io);
         err = ata_wait_drq(base_io);
         if (err != ATA_SUCCESS)
             return err;
 
+        ata_irq_arm(base_io);
         for (int word = 0; word < 256; word++)
         {
             outportw(base_io + ATA_REG_DATA, buf[sector * 256 + word]);
         }
     }
 
+    ata_wait_irq(base_io);
     err = ata_wait_ready(base_io);
     if (err != ATA_SUCCESS)
         return err;
 
+    ata_irq_arm(base_io);
     outportb(base_io + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+    ata_wait_irq(base_io);
 
     return ata_wait_ready(base_io);
 }
 
+ata_error_t ata_write_sectors(uint8_t drive, uint32_t lba, uint8_t count, const void *buffer)
+{
+    if (drive >= 4 || !drives[drive].exists || !buffer || count == 0 || count > ATA_MAX_SECTORS)
+    {
+        return ATA_ERR_INVALID_PARAM;
+    }
+    mutex_t *lock = &channel_lock[ata_channel(drives[drive].base_io)];
+    mutex_lock(lock);
+    ata_error_t err = ata_pio_write(&drives[drive], lba, count, buffer);
+    mutex_unlock(lock);
+    return err;
+}
+
 ata_error_t ata_drive_exists(int pdrv)
 {
     if (pdrv > 4 || pdrv < 0)
@@ -40,6 +40,9 @@
 #define ATA_SECTOR_SIZE         512
 #define ATA_MAX_SECTORS         254 //not 256 as PIO is 0 - 255
 #define ATA_TIMEOUT_MS          101010
+#define ATA_IRQ_TIMEOUT_MS      100     // then fall back to polling
+#define ATA_PRIMARY_VECTOR      0x2E    // IRQ 14
+#define ATA_SECONDARY_VECTOR    0x2F    // IRQ 15
 
 typedef enum {
     ATA_SUCCESS = 0,
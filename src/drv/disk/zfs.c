@@ -1,14 +1,40 @@
 #include "zfs.h"
 #include "../disk/ata.h"
 #include "../../libk/core/mem.h"
+#include "../../libk/core/pagecache.h"
 #include "../../libk/string.h"
 #include "../../libk/debug/log.h"
+#include "../../kernel/mutex.h"
 
+// Room for the deepest cwd get_cwd_locked() builds, 16 names deep
+#define ZFS_MAX_PATH 512
+
+// Guards the superblock, the entry table and the current directory. Block
+// I/O for the page cache takes it too, so a delete can't free the blocks
+// under a read or write-back. Never held while calling into the page cache
+// with write-back, which would come back in through zfs_write_page().
+static mutex_t zfs_lock;
 static zfs_superblock_t superblock;
 static zfs_entry_t entry_table[ZFS_MAX_ENTRIES];
+// Bumped whenever an entry stops naming its file, so a mapping or handle
+// still holding the index can tell the slot was reused
+static uint32_t entry_generation[ZFS_MAX_ENTRIES];
 static uint8_t initialized = 0;
 static uint8_t current_dir = ZFS_ROOT_DIR_INDEX;
 
+/*
+ * Paths and handles often live in user memory, and touching that may fault
+ * a page in from a file, through the page cache, back into ZenFS. So they
+ * are copied in and out with zfs_lock dropped.
+ */
+static int copy_path(char *dst, const char *src)
+{
+    if (!src || strlen(src) >= ZFS_MAX_PATH)
+        return -1;
+    strcpy(dst, src);
+    return 0;
+}
+
 static uint32_t block_to_lba(uint32_t block)
 {
     return ZFS_DATA_START_LBA + (block * 8);
@@ -34,6 +60,13 @@ static zfs_error_t write_entry_table(void)
     return ZFS_OK;
 }
 
+static int is_file_block(int entry, uint32_t index)
+{
+    return entry >= 0 && entry < ZFS_MAX_ENTRIES &&
+           entry_table[entry].type == ZFS_TYPE_FILE &&
+           index < entry_table[entry].block_count;
+}
+
 static int find_entry(const char *name, uint8_t parent, uint8_t type)
 {
     for (int i = 0; i < ZFS_MAX_ENTRIES; i++)
@@ -132,7 +165,23 @@ static int resolve_path(const char *path, uint8_t *out_parent, char *out_name)
     return 0;
 }
 
-zfs_error_t zfs_format(uint8_t drive)
+/* Retire an entry index (or all of them if entry < 0) along with its cached pages. */
+static void retire_entry(int entry)
+{
+    for (int i = 0; i < ZFS_MAX_ENTRIES; i++)
+        if (entry < 0 || i == entry)
+            __atomic_add_fetch(&entry_generation[i], 1, __ATOMIC_SEQ_CST);
+    pcache_invalidate(entry);
+}
+
+uint32_t zfs_entry_generation(int entry)
+{
+    if (entry < 0 || entry >= ZFS_MAX_ENTRIES)
+        return 0;
+    return __atomic_load_n(&entry_generation[entry], __ATOMIC_SEQ_CST);
+}
+
+static zfs_error_t format_locked(uint8_t drive)
 {
     if (drive >= 4)
     {
@@ -145,6 +194,7 @@ zfs_error_t zfs_format(uint8_t drive)
     }
 
     log("ZenFS: Formatting drive %d...", 1, 0, drive);
+    retire_entry(-1);
 
     memset(&superblock, 0, sizeof(zfs_superblock_t));
     superblock.magic = ZFS_MAGIC;
@@ -178,7 +228,15 @@ zfs_error_t zfs_format(uint8_t drive)
     return ZFS_OK;
 }
 
-zfs_error_t zfs_init(uint8_t drive)
+zfs_error_t zfs_format(uint8_t drive)
+{
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = format_locked(drive);
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
+static zfs_error_t init_locked(uint8_t drive)
 {
     if (drive >= 4)
     {
@@ -210,6 +268,7 @@ zfs_error_t zfs_init(uint8_t drive)
         return ZFS_ERR_READ_FAILED;
     }
 
+    retire_entry(-1);
     initialized = 1;
     current_dir = ZFS_ROOT_DIR_INDEX;
 
@@ -217,7 +276,15 @@ zfs_error_t zfs_init(uint8_t drive)
     return ZFS_OK;
 }
 
-zfs_error_t zfs_mkdir(const char *dirname)
+zfs_error_t zfs_init(uint8_t drive)
+{
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = init_locked(drive);
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
+static zfs_error_t mkdir_locked(const char *dirname)
 {
     if (!initialized)
         return ZFS_ERR_NOT_INITIALIZED;
@@ -265,7 +332,18 @@ zfs_error_t zfs_mkdir(const char *dirname)
     return ZFS_OK;
 }
 
-zfs_error_t zfs_rmdir(const char *dirname)
+zfs_error_t zfs_mkdir(const char *dirname)
+{
+    char path[ZFS_MAX_PATH];
+    if (copy_path(path, dirname))
+        return ZFS_ERR_INVALID_PARAM;
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = mkdir_locked(path);
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
+static zfs_error_t rmdir_locked(const char *dirname)
 {
     if (!initialized)
         return ZFS_ERR_NOT_INITIALIZED;
@@ -315,7 +393,18 @@ zfs_error_t zfs_rmdir(const char *dirname)
     return ZFS_OK;
 }
 
-zfs_error_t zfs_chdir(const char *dirname)
+zfs_error_t zfs_rmdir(const char *dirname)
+{
+    char path[ZFS_MAX_PATH];
+    if (copy_path(path, dirname))
+        return ZFS_ERR_INVALID_PARAM;
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = rmdir_locked(path);
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
+static zfs_error_t chdir_locked(const char *dirname)
 {
     if (!initialized)
         return ZFS_ERR_NOT_INITIALIZED;
@@ -353,7 +442,18 @@ zfs_error_t zfs_chdir(const char *dirname)
     return ZFS_OK;
 }
 
-void zfs_get_cwd(char *buffer, size_t size)
+zfs_error_t zfs_chdir(const char *dirname)
+{
+    char path[ZFS_MAX_PATH];
+    if (copy_path(path, dirname))
+        return ZFS_ERR_INVALID_PARAM;
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = chdir_locked(path);
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
+static void get_cwd_locked(char *buffer, size_t size)
 {
     if (!initialized || !buffer || size == 0)
     {
@@ -396,7 +496,19 @@ void zfs_get_cwd(char *buffer, size_t size)
     }
 }
 
-zfs_error_t zfs_create(const char *filename, uint32_t size)
+void zfs_get_cwd(char *buffer, size_t size)
+{
+    char cwd[ZFS_MAX_PATH];
+    if (!buffer || size == 0)
+        return;
+    mutex_lock(&zfs_lock);
+    get_cwd_locked(cwd, sizeof(cwd));
+    mutex_unlock(&zfs_lock);
+    strncpy(buffer, cwd, size - 1);
+    buffer[size - 1] = '\0';
+}
+
+static zfs_error_t create_locked(const char *filename, uint32_t size)
 {
     if (!initialized)
         return ZFS_ERR_NOT_INITIALIZED;
@@ -484,6 +596,8 @@ zfs_error_t zfs_create(const char *filename, uint32_t size)
         return ZFS_ERR_NO_SPACE;
     }
 
+    // A fault that raced the old file's delete may have cached its blocks here
+    pcache_invalidate(free_idx);
     strcpy(entry_table[free_idx].name, name);
     entry_table[free_idx].size = size;
     entry_table[free_idx].start_block = start_block;
@@ -503,17 +617,23 @@ zfs_error_t zfs_create(const char *filename, uint32_t size)
     return ZFS_OK;
 }
 
-zfs_error_t zfs_open(const char *filename, zfs_file_t *file)
+zfs_error_t zfs_create(const char *filename, uint32_t size)
+{
+    char path[ZFS_MAX_PATH];
+    if (copy_path(path, filename))
+        return ZFS_ERR_INVALID_PARAM;
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = create_locked(path, size);
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
+static zfs_error_t open_locked(const char *filename, zfs_file_t *file)
 {
-    __asm__ volatile("cli"); 
-    if (!initialized) {
-        __asm__ volatile("sti"); 
+    if (!initialized)
         return ZFS_ERR_NOT_INITIALIZED;
-    }
-    if (!filename || !file) {
-        __asm__ volatile("sti");
+    if (!filename || !file)
         return ZFS_ERR_INVALID_PARAM;
-    }
     uint8_t parent;
     char name[ZFS_MAX_FILENAME];
 
@@ -534,11 +654,25 @@ zfs_error_t zfs_open(const char *filename, zfs_file_t *file)
     file->start_block = entry_table[file_idx].start_block;
     file->position = 0;
     file->entry_index = file_idx;
+    file->generation = entry_generation[file_idx];
     file->is_open = 1;
-    __asm__ volatile("sti");
     return ZFS_OK;
 }
 
+zfs_error_t zfs_open(const char *filename, zfs_file_t *file)
+{
+    char path[ZFS_MAX_PATH];
+    zfs_file_t opened;
+    if (!file || copy_path(path, filename))
+        return ZFS_ERR_INVALID_PARAM;
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = open_locked(path, &opened);
+    mutex_unlock(&zfs_lock);
+    if (err == ZFS_OK)
+        *file = opened;
+    return err;
+}
+
 zfs_error_t zfs_read(zfs_file_t *file, void *buffer, uint32_t size, uint32_t *bytes_read)
 {
     if (!initialized)
@@ -547,6 +681,9 @@ zfs_error_t zfs_read(zfs_file_t *file, void *buffer, uint32_t size, uint32_t *by
     if (!file || !file->is_open)
         return ZFS_ERR_NOT_OPEN;
 
+    if (file->generation != zfs_entry_generation(file->entry_index))
+        return ZFS_ERR_FILE_NOT_FOUND;
+
     if (!buffer || size == 0)
     {
         if (bytes_read)
@@ -568,11 +705,11 @@ zfs_error_t zfs_read(zfs_file_t *file, void *buffer, uint32_t size, uint32_t *by
 
     uint32_t total_read = 0;
     uint8_t *dest = (uint8_t *)buffer;
-    uint8_t block_buffer[ZFS_BLOCK_SIZE];
 
+    // Blocks come from the page cache; only a miss goes to the disk
     while (total_read < size)
     {
-        uint32_t current_block = file->start_block + (file->position / ZFS_BLOCK_SIZE);
+        uint32_t page_index = file->position / ZFS_BLOCK_SIZE;
         uint32_t offset_in_block = file->position % ZFS_BLOCK_SIZE;
         uint32_t bytes_to_read = ZFS_BLOCK_SIZE - offset_in_block;
 
@@ -581,15 +718,16 @@ zfs_error_t zfs_read(zfs_file_t *file, void *buffer, uint32_t size, uint32_t *by
             bytes_to_read = size - total_read;
         }
 
-        uint32_t lba = block_to_lba(current_block);
-        if (ata_read_sectors(superblock.drive_number, lba, 8, block_buffer) != ATA_SUCCESS)
+        uint64_t phys = pcache_get(file->entry_index, page_index);
+        if (!phys)
         {
             if (bytes_read)
                 *bytes_read = total_read;
             return ZFS_ERR_READ_FAILED;
         }
 
-        memcpy(dest + total_read, block_buffer + offset_in_block, bytes_to_read);
+        memcpy(dest + total_read, (uint8_t *)(phys + KERNEL_VIRT_OFFSET) + offset_in_block, bytes_to_read);
+        put_page(phys);
 
         total_read += bytes_to_read;
         file->position += bytes_to_read;
@@ -611,6 +749,9 @@ zfs_error_t zfs_write(zfs_file_t *file, const void *buffer, uint32_t size)
     if (!file || !file->is_open)
         return ZFS_ERR_NOT_OPEN;
 
+    if (file->generation != zfs_entry_generation(file->entry_index))
+        return ZFS_ERR_FILE_NOT_FOUND;
+
     if (!buffer || size == 0)
         return ZFS_OK;
 
@@ -622,11 +763,11 @@ zfs_error_t zfs_write(zfs_file_t *file, const void *buffer, uint32_t size)
 
     uint32_t total_written = 0;
     const uint8_t *src = (const uint8_t *)buffer;
-    uint8_t block_buffer[ZFS_BLOCK_SIZE];
 
+    // Write-through: the cached block is updated, then sent to the disk whole
     while (total_written < size)
     {
-        uint32_t current_block = file->start_block + (file->position / ZFS_BLOCK_SIZE);
+        uint32_t page_index = file->position / ZFS_BLOCK_SIZE;
         uint32_t offset_in_block = file->position % ZFS_BLOCK_SIZE;
         uint32_t bytes_to_write = ZFS_BLOCK_SIZE - offset_in_block;
 
@@ -635,21 +776,19 @@ zfs_error_t zfs_write(zfs_file_t *file, const void *buffer, uint32_t size)
             bytes_to_write = size - total_written;
         }
 
-        uint32_t lba = block_to_lba(current_block);
-
-        if (offset_in_block != 0 || bytes_to_write < ZFS_BLOCK_SIZE)
+        uint64_t phys = pcache_get(file->entry_index, page_index);
+        if (!phys)
         {
-            if (ata_read_sectors(superblock.drive_number, lba, 8, block_buffer) != ATA_SUCCESS)
-            {
-                return ZFS_ERR_READ_FAILED;
-            }
+            return ZFS_ERR_READ_FAILED;
         }
 
-        memcpy(block_buffer + offset_in_block, src + total_written, bytes_to_write);
-
-        if (ata_write_sectors(superblock.drive_number, lba, 8, block_buffer) != ATA_SUCCESS)
+        uint8_t *block = (uint8_t *)(phys + KERNEL_VIRT_OFFSET);
+        memcpy(block + offset_in_block, src + total_written, bytes_to_write);
+        zfs_error_t err = zfs_write_page(file->entry_index, page_index, block);
+        put_page(phys);
+        if (err != ZFS_OK)
         {
-            return ZFS_ERR_WRITE_FAILED;
+            return err;
         }
 
         total_written += bytes_to_write;
@@ -664,13 +803,16 @@ zfs_error_t zfs_close(zfs_file_t *file)
     if (!file)
         return ZFS_OK;
 
+    // Flush what shared mappings of the file wrote, unless it is gone
+    if (file->is_open && file->generation == zfs_entry_generation(file->entry_index))
+        pcache_sync(file->entry_index);
     file->is_open = 0;
     file->position = 0;
 
     return ZFS_OK;
 }
 
-zfs_error_t zfs_delete(const char *filename)
+static zfs_error_t delete_locked(const char *filename)
 {
     if (!initialized)
         return ZFS_ERR_NOT_INITIALIZED;
@@ -692,6 +834,7 @@ zfs_error_t zfs_delete(const char *filename)
         return ZFS_ERR_FILE_NOT_FOUND;
     }
 
+    retire_entry(file_idx);
     uint32_t freed_blocks = entry_table[file_idx].block_count;
     memset(&entry_table[file_idx], 0, sizeof(zfs_entry_t));
 
@@ -707,6 +850,17 @@ zfs_error_t zfs_delete(const char *filename)
     return ZFS_OK;
 }
 
+zfs_error_t zfs_delete(const char *filename)
+{
+    char path[ZFS_MAX_PATH];
+    if (copy_path(path, filename))
+        return ZFS_ERR_INVALID_PARAM;
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = delete_locked(path);
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
 zfs_error_t zfs_seek(zfs_file_t *file, uint32_t position)
 {
     if (!file || !file->is_open)
@@ -721,13 +875,66 @@ zfs_error_t zfs_seek(zfs_file_t *file, uint32_t position)
     return ZFS_OK;
 }
 
-zfs_error_t zfs_list(void)
+static zfs_error_t read_page_locked(int entry, uint32_t index, void *buffer)
+{
+    if (!initialized)
+        return ZFS_ERR_NOT_INITIALIZED;
+
+    if (!is_file_block(entry, index))
+        return ZFS_ERR_INVALID_PARAM;
+
+    uint32_t lba = block_to_lba(entry_table[entry].start_block + index);
+    if (ata_read_sectors(superblock.drive_number, lba, 8, buffer) != ATA_SUCCESS)
+        return ZFS_ERR_READ_FAILED;
+
+    // Whatever the disk holds past the end of the file reads as zeroes
+    uint32_t offset = index * ZFS_BLOCK_SIZE;
+    if (entry_table[entry].size < offset + ZFS_BLOCK_SIZE)
+    {
+        uint32_t valid = entry_table[entry].size > offset ? entry_table[entry].size - offset : 0;
+        memset((uint8_t *)buffer + valid, 0, ZFS_BLOCK_SIZE - valid);
+    }
+    return ZFS_OK;
+}
+
+zfs_error_t zfs_read_page(int entry, uint32_t index, void *buffer)
+{
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = read_page_locked(entry, index, buffer);
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
+static zfs_error_t write_page_locked(int entry, uint32_t index, const void *buffer)
+{
+    if (!initialized)
+        return ZFS_ERR_NOT_INITIALIZED;
+
+    if (!is_file_block(entry, index))
+        return ZFS_ERR_INVALID_PARAM;
+
+    uint32_t lba = block_to_lba(entry_table[entry].start_block + index);
+    if (ata_write_sectors(superblock.drive_number, lba, 8, buffer) != ATA_SUCCESS)
+        return ZFS_ERR_WRITE_FAILED;
+
+    return ZFS_OK;
+}
+
+zfs_error_t zfs_write_page(int entry, uint32_t index, const void *buffer)
+{
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = write_page_locked(entry, index, buffer);
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
+static zfs_error_t list_locked(void)
 {
     if (!initialized)
         return ZFS_ERR_NOT_INITIALIZED;
 
     char cwd[256];
-    zfs_get_cwd(cwd, sizeof(cwd));
+    get_cwd_locked(cwd, sizeof(cwd));
     log("Directory listing for: %s", 1, 1, cwd);
     log("", 1, 1);
 
@@ -765,7 +972,15 @@ zfs_error_t zfs_list(void)
     return ZFS_OK;
 }
 
-void zfs_print_stats(void)
+zfs_error_t zfs_list(void)
+{
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = list_locked();
+    mutex_unlock(&zfs_lock);
+    return err;
+}
+
+static void print_stats_locked(void)
 {
     if (!initialized)
     {
@@ -794,13 +1009,22 @@ void zfs_print_stats(void)
     log("  Files: %d", 1, 1, file_count);
 }
 
-zfs_error_t zfs_unmount(void)
+void zfs_print_stats(void)
+{
+    mutex_lock(&zfs_lock);
+    print_stats_locked();
+    mutex_unlock(&zfs_lock);
+}
+
+static zfs_error_t unmount_locked(void)
 {
     if (!initialized)
     {
         return ZFS_ERR_NOT_INITIALIZED;
     }
 
+    retire_entry(-1);
+
     if (write_entry_table() != ZFS_OK)
     {
         return ZFS_ERR_WRITE_FAILED;
@@ -818,4 +1042,14 @@ zfs_error_t zfs_unmount(void)
     current_dir = ZFS_ROOT_DIR_INDEX;
     log("ZenFS: Unmounted successfully", 4, 0);
     return ZFS_OK;
+}
+
+zfs_error_t zfs_unmount(void)
+{
+    // Write back what shared mappings dirtied; that comes back in through zfs_write_page()
+    pcache_sync(-1);
+    mutex_lock(&zfs_lock);
+    zfs_error_t err = unmount_locked();
+    mutex_unlock(&zfs_lock);
+    return err;
 }
\ No newline at end of file
@@ -49,6 +49,7 @@ typedef struct {
     uint32_t position;                  
     uint8_t entry_index;                
     uint8_t is_open;
+    uint32_t generation;                // entry generation at open
 } zfs_file_t;
 
 
@@ -91,6 +92,12 @@ zfs_error_t zfs_delete(const char* filename);
 zfs_error_t zfs_seek(zfs_file_t* file, uint32_t position);
 
 
+// Block I/O for the page cache; index counts blocks from the start of the file
+zfs_error_t zfs_read_page(int entry, uint32_t index, void* buffer);
+zfs_error_t zfs_write_page(int entry, uint32_t index, const void* buffer);
+uint32_t zfs_entry_generation(int entry);
+
+
 zfs_error_t zfs_list(void);  
 void zfs_print_stats(void);
 
@@ -27,6 +27,7 @@ static volatile hpet_regs_t *hpet = NULL;
 static volatile hpet_timer_t *t0 = NULL;
 
 static uint64_t ticks_per_irq;
+static uint64_t period_fs;
 
 static void hpet_handler(registers_t *r)
 {
@@ -50,7 +51,7 @@ void hpet_init(uint32_t frequency_hz)
     hpet->config = 0;
     hpet->counter = 0;
 
-    uint64_t period_fs = hpet->cap_id >> 32;
+    period_fs = hpet->cap_id >> 32;
     if (!period_fs)
         return;
 
@@ -66,4 +67,13 @@ void hpet_init(uint32_t frequency_hz)
     register_interrupt_handler(HPET_IRQ_VECTOR, hpet_handler, "HPET Timer");
     hpet->config = 1;
     log("HPET Initialized.", 4, 0);
-}
\ No newline at end of file
+}
+
+// Nanoseconds since hpet_init(), split so the multiply can't overflow
+uint64_t hpet_read_ns(void)
+{
+    if (!hpet || !period_fs)
+        return 0;
+    uint64_t ticks = hpet->counter;
+    return (ticks / 1000000) * period_fs + (ticks % 1000000) * period_fs / 1000000;
+}
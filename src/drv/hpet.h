@@ -8,5 +8,6 @@ extern volatile uint64_t hpet_ticks;
 
 void hpet_init(uint32_t frequency_hz);
 void SetHpetAddress(uint64_t addr);
+uint64_t hpet_read_ns(void);
 
 #endif
@@ -4,6 +4,7 @@
 #include "../libk/ports.h"
 #include "../libk/spinlock.h"
 #include "../libk/debug/log.h"
+#include "../kernel/wait.h"
 #include <stdbool.h>
 
 #define PS2_DATA_PORT 0x60
@@ -152,6 +153,7 @@ static input_buffer_t key_buffer = {0};
 static bool key_states[256] = {0};
 static bool waiting_for_release_code = false;
 static spinlock_t kbdlock;
+static wait_queue_t key_waiters;
 
 static void ps2_wait_input(void)
 {
@@ -321,6 +323,7 @@ static void kbd_interrupt_handler(registers_t *regs)
         if (c != 0)
         {
             buffer_put_char(c);
+            wake_up(&key_waiters);
         }
     }
     else if (released)
@@ -333,6 +336,7 @@ static void kbd_interrupt_handler(registers_t *regs)
 void init_keyboard(void)
 {
     spinlock_init(&kbdlock);
+    wait_queue_init(&key_waiters);
     ps2_write_command(PS2_CMD_DISABLE_PORT1);
     ps2_write_command(PS2_CMD_DISABLE_PORT2);
 
@@ -372,10 +376,16 @@ char get_key(void)
     return c;
 }
 
+static int key_ready(void *arg)
+{
+    (void)arg;
+    return buffer_has_data();
+}
+
+/* Sleep until a key arrives; another reader may still beat us to it, giving 0 */
 char wait_for_key(void)
 {
-    while (!buffer_has_data())
-        ;
+    wait_until(&key_waiters, key_ready, NULL, 0);
     return get_key();
 }
 
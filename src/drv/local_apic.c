@@ -2,6 +2,8 @@
 #include "../cpu/idt.h"
 #include "../cpu/acpi/acpi.h"
 #include "../libk/debug/log.h"
+#include "../kernel/sched.h"
+#include "hpet.h"
 
 uint8_t *g_localApicAddr = (uint8_t*)0xFEE00000;
 
@@ -58,6 +60,13 @@ uint8_t *g_localApicAddr = (uint8_t*)0xFEE00000;
 
 #define ICR_DESTINATION_SHIFT           24
 
+#define TIMER_MASKED                    0x00010000
+#define TIMER_PERIODIC                  0x00020000
+#define TIMER_DIVIDE_16                 0x3
+
+// Timer counts per millisecond at divide-by-16, the same on every CPU
+static uint32_t g_timerTicksPerMs;
+
 
 static uint32_t LocalApicIn(int reg)
 {
@@ -110,6 +119,53 @@ void LocalApicSendStartup(int apic_id, int vector)
         ;
 }
 
+void LocalApicSendIpi(int apic_id, int vector)
+{
+    LocalApicOut(LAPIC_ICRHI, apic_id << ICR_DESTINATION_SHIFT);
+    LocalApicOut(LAPIC_ICRLO, vector | ICR_FIXED
+        | ICR_PHYSICAL | ICR_ASSERT | ICR_EDGE | ICR_NO_SHORTHAND);
+
+    while (LocalApicIn(LAPIC_ICRLO) & ICR_SEND_PENDING)
+        ;
+}
+
 void LocalApicSendEOI() {
     *((volatile uint32_t*)(g_localApicAddr + 0xB0)) = 0;
-}
\ No newline at end of file
+}
+
+static void LocalApicTimerHandler(registers_t *regs)
+{
+    (void)regs;
+    sched_tick();
+}
+
+// Count the timer down against the HPET for 10 ms. Needs hpet_init().
+void LocalApicTimerCalibrate()
+{
+    uint64_t start = hpet_read_ns();
+    if (!start)
+    {
+        log("No HPET to calibrate the Local APIC timer against.", 2, 0);
+        return;
+    }
+    LocalApicOut(LAPIC_TDCR, TIMER_DIVIDE_16);
+    LocalApicOut(LAPIC_TIMER, TIMER_MASKED);
+    LocalApicOut(LAPIC_TICR, 0xffffffff);
+    while (hpet_read_ns() - start < 10000000)
+        __asm__ volatile("pause");
+    uint32_t elapsed = 0xffffffff - LocalApicIn(LAPIC_TCCR);
+    LocalApicOut(LAPIC_TICR, 0);
+    g_timerTicksPerMs = elapsed / 10;
+    log("Local APIC timer: %u ticks/ms.", 1, 0, g_timerTicksPerMs);
+}
+
+// Periodic scheduler tick on the calling CPU
+void LocalApicTimerStart(uint32_t frequency_hz)
+{
+    if (!g_timerTicksPerMs || !frequency_hz)
+        return;
+    register_interrupt_handler(LAPIC_TIMER_VECTOR, LocalApicTimerHandler, "Local APIC Timer");
+    LocalApicOut(LAPIC_TDCR, TIMER_DIVIDE_16);
+    LocalApicOut(LAPIC_TIMER, LAPIC_TIMER_VECTOR | TIMER_PERIODIC);
+    LocalApicOut(LAPIC_TICR, g_timerTicksPerMs * 1000 / frequency_hz);
+}
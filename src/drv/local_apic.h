@@ -13,3 +13,6 @@ void LocalApicSendEOI();
 int LocalApicGetId();
 void LocalApicSendInit(int apic_id);
 void LocalApicSendStartup(int apic_id, int vector);
+void LocalApicSendIpi(int apic_id, int vector);
+void LocalApicTimerCalibrate();
+void LocalApicTimerStart(uint32_t frequency_hz);
@@ -200,8 +200,14 @@ void e1000_init(void)
     dev.func = pci_dev->func;
     dev.device_id = pci_dev->device_id;
     dev.bar0 = pci_dev->bars[0];
-    dev.mem_base = dev.bar0 & ~0xF;
+    dev.mem_base = (uint64_t)ioremap(dev.bar0 & ~0xF, E1000_MMIO_SIZE, CACHE_UC);
     dev.irq = pci_dev->interrupt_line;
+    if (!dev.mem_base)
+    {
+        log("E1000: Failed to map registers", 3, 1);
+        pci_dev = NULL;
+        return;
+    }
 
     pci_enable_bus_mastering(pci_dev);
     pci_enable_memory_space(pci_dev);
@@ -13,6 +13,8 @@
 #define E1000_DEVICE_ID_2   0x153A
 #define E1000_DEVICE_ID_3   0x10EA
 
+#define E1000_MMIO_SIZE     0x20000     // register BAR
+
 #define E1000_REG_CTRL      0x0000
 #define E1000_REG_STATUS    0x0008
 #define E1000_REG_EEPROM    0x0014
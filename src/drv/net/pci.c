@@ -1,11 +1,13 @@
 #include "pci.h"
 #include "../../libk/core/mem.h"
+#include "../../libk/core/slab.h"
 #include "../../libk/debug/log.h"
 #include "../../libk/ports.h"
 #include "../local_apic.h"
 
 static pci_device_t *device_list = NULL;
 static uint32_t device_count = 0;
+static kmem_cache_t *pci_device_cache = NULL;
 
 uint32_t pci_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
     uint32_t address = 0x80000000 | (bus << 16) | (slot << 11) | (func << 8) | (offset & 0xFC);
@@ -138,7 +140,7 @@ void pci_enable_io_space(pci_device_t *dev) {
 }
 
 pci_device_t* pci_create_device(uint8_t bus, uint8_t slot, uint8_t func) {
-    pci_device_t *dev = kmalloc(sizeof(pci_device_t));
+    pci_device_t *dev = kmem_cache_alloc(pci_device_cache);
     if (!dev) return NULL;
     
     dev->bus = bus;
@@ -208,6 +210,7 @@ void pci_scan_bus(uint8_t bus) {
 }
 
 void pci_init(void) {
+    pci_device_cache = kmem_cache_create("pci_device_t", sizeof(pci_device_t));
     if ((pci_read8(0, 0, 0, 0x0E) & 0x80) == 0) {
         pci_scan_bus(0);
     } else {
@@ -3,16 +3,52 @@
 #include "../libk/debug/log.h"
 #include "../cpu/isr.h"
 #include "../kernel/sched.h"
+#include "../kernel/wait.h"
+#include "../libk/spinlock.h"
 #include <stdint.h>
 #define CMOS_ADDRESS 0x70
 #define CMOS_DATA 0x71
 static volatile uint64_t tick = 0;
 static rtc_time_t boot_time;
+// Armed timers, earliest deadline first
+static rtc_timer_t *timers = NULL;
+static spinlock_t timer_lock;
 
 uint64_t rtc_get_ticks(void) {
     return tick;
 }
 
+uint64_t rtc_ms_to_ticks(uint32_t ms) {
+    return ((uint64_t)ms * RTC_HZ + 999) / 1000;
+}
+
+/* Wake timer->task once the tick count reaches deadline */
+void rtc_timer_start(rtc_timer_t *timer, uint64_t deadline)
+{
+    timer->deadline = deadline;
+    uint64_t rflags = spinlock_acquire_irqsave(&timer_lock);
+    rtc_timer_t **link = &timers;
+    while (*link && (*link)->deadline <= deadline)
+        link = &(*link)->next;
+    timer->next = *link;
+    *link = timer;
+    spinlock_release_irqrestore(&timer_lock, rflags);
+}
+
+void rtc_timer_cancel(rtc_timer_t *timer)
+{
+    uint64_t rflags = spinlock_acquire_irqsave(&timer_lock);
+    for (rtc_timer_t **link = &timers; *link; link = &(*link)->next)
+    {
+        if (*link == timer)
+        {
+            *link = timer->next;
+            break;
+        }
+    }
+    spinlock_release_irqrestore(&timer_lock, rflags);
+}
+
 static uint8_t read_cmos_register(uint8_t reg)
 {
     outportb(CMOS_ADDRESS, reg);
@@ -39,10 +75,20 @@ void rtc_interrupt_handler(registers_t *regs)
     (void)regs;
     tick++;
     read_cmos_register(0x0C);
+
+    spinlock_acquire(&timer_lock);
+    while (timers && timers->deadline <= tick)
+    {
+        rtc_timer_t *timer = timers;
+        timers = timer->next;
+        sched_wake(timer->task);
+    }
+    spinlock_release(&timer_lock);
 }
 
 void rtc_initialize(void)
 {
+    spinlock_init(&timer_lock);
     boot_time = rtc_get_time();
     rtc_enable_periodic_updates();
     log("Real Time Clock Timesystem initialized.", 4, 0);
@@ -78,13 +124,14 @@ rtc_time_t rtc_boottime(void)
     return boot_time;
 }
 
+static int never(void *arg)
+{
+    (void)arg;
+    return 0;
+}
+
 void sleep(uint32_t ms)
 {
-    uint64_t start_tick = tick;
-    uint64_t ticks_to_wait = (ms * 1000) / 1024;
-    
-    while ((tick - start_tick) < ticks_to_wait)
-    {
-        sched_yield();
-    }
+    if (ms)
+        wait_until(NULL, never, NULL, ms);
 }
\ No newline at end of file
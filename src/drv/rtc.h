@@ -1,6 +1,20 @@
 #ifndef RTC_H
 #define RTC_H
 #include <stdint.h>
+
+/// @brief Periodic interrupt rate set up by rtc_initialize().
+#define RTC_HZ 1024
+
+struct task;
+
+/// @brief A one-shot wakeup for a sleeping task, see rtc_timer_start().
+typedef struct rtc_timer
+{
+    uint64_t deadline;          // in RTC ticks
+    struct task *task;
+    struct rtc_timer *next;
+} rtc_timer_t;
+
 /// @brief The structure storing the format of the RTC Time.
 typedef struct
 {
@@ -19,5 +33,8 @@ uint32_t rtc_calculate_uptime(const rtc_time_t *start, const rtc_time_t *end);
 rtc_time_t rtc_boottime(void);
 void sleep(uint32_t time);
 uint64_t rtc_get_ticks(void);
+uint64_t rtc_ms_to_ticks(uint32_t ms);
+void rtc_timer_start(rtc_timer_t *timer, uint64_t deadline);
+void rtc_timer_cancel(rtc_timer_t *timer);
 
 #endif
\ No newline at end of file
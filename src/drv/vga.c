@@ -93,10 +93,14 @@ void vga_init(void)
     }
 
     fb = framebuffer_request.response->framebuffers[0];
-    framebuffer_addr = (uint8_t *)fb->address;
     framebuffer_width = fb->width;
     framebuffer_height = fb->height;
     framebuffer_pitch = fb->pitch;
+    // Write-combining turns the console's scroll and redraw stores into burst writes
+    framebuffer_addr = (uint8_t *)ioremap((uint64_t)fb->address - KERNEL_VIRT_OFFSET,
+                                          framebuffer_pitch * framebuffer_height, CACHE_WC);
+    if (!framebuffer_addr)
+        framebuffer_addr = (uint8_t *)fb->address;
     framebuffer_bpp = fb->bpp;
 
     if (framebuffer_bpp != 16 && framebuffer_bpp != 24 && framebuffer_bpp != 32)
@@ -4,7 +4,11 @@
 
 #include "../libk/debug/serial.h"
 #include "../libk/debug/log.h"
+#include "../libk/debug/vmbench.h"
 #include "../libk/core/mem.h"
+#include "../libk/core/tlb.h"
+#include "../libk/core/vma.h"
+#include "../libk/core/pagecache.h"
 #include "../libk/core/socket.h"
 #include "../libk/core/syscall.h"
 #include "../libk/string.h"
@@ -12,6 +16,7 @@
 #include "../cpu/gdt.h"
 #include "../cpu/idt.h"
 #include "../cpu/sse_fpu.h"
+#include "../cpu/pat.h"
 #include "../cpu/isr.h"
 #include "../libk/spinlock.h"
 #include "../cpu/smp.h"
@@ -56,16 +61,17 @@
 //     for(;;)__asm__ __volatile__("hlt");
 // }
 
-void idle(void){
-    for(;;)sched_yield();
-}
-
 void _start(void)
 {
     serial_init();
     init_pmm();
     init_vmm();
     init_kernel_heap();
+    log_init();
+    vma_init();
+    pcache_init();
+    tlb_init_cpu();
+    pat_init();
     enable_sse_and_fpu();
     vga_init();
     init_gdt();
@@ -78,9 +84,12 @@ void _start(void)
     rtc_initialize();
     sched_init();
     IoApicSetIrqMapped(0, 0x22); //HPET
-    hpet_init(100);
+    hpet_init(SCHED_TICK_HZ);
+    LocalApicTimerCalibrate();
     IoApicSetIrqMapped(1, 0x21); //Keyboard
     init_keyboard();
+    IoApicSetIrqMapped(14, 0x2E); //ATA primary
+    IoApicSetIrqMapped(15, 0x2F); //ATA secondary
     ata_init();
     uint8_t boot_drive = 0;
     for (int i = 0; i < 4; i++) {
@@ -112,13 +121,15 @@ void _start(void)
     log("Running In Debug Mode.", 2, 1);
     detect_cpu_info(0);
     print_mem_info(1);
+    vmm_benchmark(1);
     zfs_list();
 #endif
-    task_create(idle, "Idle");
+    sched_init_cpu();
     if(elf_exec("init", 0, NULL) != ZFS_OK)
         log("No init program found.", 0, 1);
     asm volatile("sti");
     sched_start();
+    // Idle: sleep until an interrupt brings work
     for (;;)
-        ;
+        __asm__ __volatile__("hlt");
 }
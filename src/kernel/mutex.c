@@ -0,0 +1,30 @@
+#include "mutex.h"
+
+void mutex_init(mutex_t *mutex)
+{
+    mutex->locked = 0;
+    mutex->owner = NULL;
+    wait_queue_init(&mutex->waiters);
+}
+
+static int mutex_try(void *arg)
+{
+    mutex_t *mutex = arg;
+    int expected = 0;
+    return __atomic_compare_exchange_n(&mutex->locked, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* Before the scheduler runs there is no one to sleep; wait_until() spins then */
+void mutex_lock(mutex_t *mutex)
+{
+    wait_until(&mutex->waiters, mutex_try, mutex, 0);
+    mutex->owner = sched_current_task();
+}
+
+void mutex_unlock(mutex_t *mutex)
+{
+    mutex->owner = NULL;
+    __atomic_store_n(&mutex->locked, 0, __ATOMIC_RELEASE);
+    // A woken waiter that loses the race to a newcomer goes back to sleep
+    wake_up(&mutex->waiters);
+}
@@ -0,0 +1,23 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+#include "wait.h"
+
+/*
+ * Sleeping locks, for holders that block on a device or may run for long.
+ * A task that finds the mutex taken sleeps on its queue until the owner lets
+ * it go. Never take one from an interrupt handler or under a spinlock.
+ * A zeroed mutex_t is a valid, unlocked mutex.
+ */
+typedef struct
+{
+    volatile int locked;
+    task_t *owner;
+    wait_queue_t waiters;
+} mutex_t;
+
+void mutex_init(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+
+#endif
@@ -1,40 +1,85 @@
 #include "sched.h"
+#include "sched_class.h"
+#include "wait.h"
 #include "../libk/core/mem.h"
+#include "../libk/core/slab.h"
 #include "../libk/string.h"
 #include "../libk/debug/log.h"
 #include "../libk/spinlock.h"
 #include "../cpu/gdt.h"
+#include "../cpu/smp.h"
 
-extern struct tss_struct tss;
+// Ticks between balance passes on a busy CPU; an idle one tries every tick
+#define BALANCE_INTERVAL 8
 
-static task_t *task_list_head = NULL;
-static task_t *current_task = NULL;
-static uint64_t next_pid = 0;
-static spinlock_t sched_lock = {0};
+/*
+ * One queue per CPU. The scheduling class orders its runnable tasks; the
+ * running task is never queued. Idle CPUs pull work from the busiest queue.
+ */
+typedef struct
+{
+    spinlock_t lock;
+    task_t *current;
+    task_t *idle;               // the CPU's boot context, never queued
+    task_t *tasks;              // every other task placed on this CPU
+    task_t *dead;               // exited, freed once switched away from
+    uint32_t nr_tasks;          // queued plus running, idle excluded
+    uint32_t llc;               // CPUs with the same value share a last-level cache
+    uint32_t balance_ticks;
+    volatile int need_resched;
+    uint64_t nr_steals;
+    uint64_t nr_migrations;
+} runqueue_t;
+
+static runqueue_t runqueues[MAX_CPUS];
+static uint64_t next_pid = 1;
 static volatile int scheduler_enabled = 0;
+static kmem_cache_t *task_cache = NULL;
+static const sched_class_t *sched_class = NULL;
+
+// Exited tasks off every CPU, waiting for the reaper to free them
+static spinlock_t reap_lock;
+static task_t *volatile reap_list = NULL;
+static wait_queue_t reap_wq;
+static task_t *reaper = NULL;
 
 extern void user_task_entry(void);
+static void reaper_main(void);
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+static inline runqueue_t *this_rq(void)
+{
+    return &runqueues[smp_cpu_id()];
+}
 
 void task_exit(void)
 {
+    task_t *current = sched_current_task();
     asm volatile("cli");
-    current_task->state = TASK_DEAD;
+    current->state = TASK_DEAD;
     asm volatile("sti");
-    log("Task %s exited.", 1, 0, current_task->name);
+    log("Task %s exited.", 1, 0, current->name);
     sched_yield();
     log("A Task exit function returned.", 0, 1);
 }
 
 static void task_entry_wrapper(void)
 {
-    if (!current_task)
+    task_t *current = sched_current_task();
+    if (!current)
     {
         asm volatile("cli; hlt");
         while (1);
     }
     asm volatile("sti");
 
-    void (*entry)(void) = (void (*)(void))current_task->regs.rbx;
+    void (*entry)(void) = (void (*)(void))current->regs.rbx;
     if (!entry)
     {
         asm volatile("cli; hlt");
@@ -46,76 +91,207 @@ static void task_entry_wrapper(void)
 
 void sched_init(void)
 {
-    spinlock_init(&sched_lock);
-    task_list_head = NULL;
-    current_task = NULL;
+    for (int i = 0; i < MAX_CPUS; i++)
+    {
+        memset(&runqueues[i], 0, sizeof(runqueue_t));
+        spinlock_init(&runqueues[i].lock);
+        prio_sched_class.init(i);
+        fair_sched_class.init(i);
+    }
+    task_cache = kmem_cache_create("task_t", sizeof(task_t));
+    spinlock_init(&reap_lock);
+    wait_queue_init(&reap_wq);
+    sched_class = SCHED_DEFAULT_POLICY == SCHED_POLICY_FAIR ? &fair_sched_class : &prio_sched_class;
     scheduler_enabled = 0;
-    extern struct tss_struct tss;
-    tss.rsp0 = 0;
-    log("Scheduler initialized.", 4, 0);
+    log("Scheduler initialized (%s).", 4, 0, sched_class->name);
+}
+
+/*
+ * The last-level cache the calling CPU sits behind: its APIC ID with the
+ * bits for the logical CPUs sharing that cache dropped. Deterministic cache
+ * parameters are leaf 4 on Intel and 0x8000001D on AMD. Without either,
+ * every CPU reports 0 and stealing has no preference.
+ */
+static uint32_t cpu_llc_id(uint32_t cpu)
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t leaves[2] = {4, 0x8000001D};
+    uint32_t level = 0, sharing = 1;
+
+    for (int l = 0; l < 2 && !level; l++)
+    {
+        cpuid(leaves[l] & 0x80000000, 0, &eax, &ebx, &ecx, &edx);
+        if (eax < leaves[l])
+            continue;
+        for (uint32_t i = 0; i < 16; i++)
+        {
+            cpuid(leaves[l], i, &eax, &ebx, &ecx, &edx);
+            if (!(eax & 0x1F))
+                break;
+            if (((eax >> 5) & 7) >= level)
+            {
+                level = (eax >> 5) & 7;
+                sharing = ((eax >> 14) & 0xFFF) + 1;
+            }
+        }
+    }
+    if (!level)
+        return 0;
+
+    uint32_t shift = 0;
+    while ((1U << shift) < sharing)
+        shift++;
+    return smp_cpu_lapic_id(cpu) >> shift;
+}
+
+/*
+ * Adopt the calling CPU's boot context as its idle task and open its run
+ * queue to new tasks. Runs once on every CPU, after sched_init().
+ */
+void sched_init_cpu(void)
+{
+    uint32_t cpu = smp_cpu_id();
+    runqueue_t *rq = &runqueues[cpu];
+    task_t *idle = (task_t *)kmem_cache_alloc(task_cache);
+    if (!idle)
+    {
+        log("CPU %d: no memory for an idle task.", 3, 1, cpu);
+        return;
+    }
+    memset(idle, 0, sizeof(task_t));
+    idle->pid = 0;
+    strncpy(idle->name, "Idle", 63);
+    idle->state = TASK_RUNNING;
+    idle->priority = SCHED_PRIORITIES - 1;
+    idle->is_kernel_task = 1;
+    idle->pml4 = get_kernel_pml4();
+    idle->cpu = cpu;
+    idle->on_cpu = 1;
+
+    uint64_t rflags = spinlock_acquire_irqsave(&rq->lock);
+    rq->llc = cpu_llc_id(cpu);
+    rq->idle = idle;
+    rq->current = idle;
+    spinlock_release_irqrestore(&rq->lock, rflags);
 }
 
 void sched_start(void)
 {
-    if (!current_task) return;
+    if (!this_rq()->current) return;
+    reaper = task_create(reaper_main, "Reaper");
+    if (!reaper)
+        log("No reaper task: exited tasks will not be freed.", 2, 1);
     log("Scheduler enabled.", 4, 0);
     scheduler_enabled = 1;
 }
 
-task_t *task_create_user(void (*entry)(void), const char *name, page_table_t *pml4)
+/* The online CPU with the fewest tasks queued */
+static uint32_t pick_cpu(void)
 {
-    spinlock_acquire(&sched_lock);
-    task_t *task = (task_t *)kmalloc(sizeof(task_t));
-    if (!task)
+    uint32_t best = 0;
+    uint32_t best_load = 0xFFFFFFFF;
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++)
     {
-        spinlock_release(&sched_lock);
-        return NULL;
+        runqueue_t *rq = &runqueues[cpu];
+        if (!rq->idle)
+            continue;
+        if (rq->nr_tasks < best_load)
+        {
+            best = cpu;
+            best_load = rq->nr_tasks;
+        }
     }
+    return best;
+}
+
+static void rq_add_task(runqueue_t *rq, task_t *task)
+{
+    task->rq_prev = NULL;
+    task->rq_next = rq->tasks;
+    if (rq->tasks)
+        rq->tasks->rq_prev = task;
+    rq->tasks = task;
+}
+
+static void rq_remove_task(runqueue_t *rq, task_t *task)
+{
+    if (task->rq_prev)
+        task->rq_prev->rq_next = task->rq_next;
+    else
+        rq->tasks = task->rq_next;
+    if (task->rq_next)
+        task->rq_next->rq_prev = task->rq_prev;
+    task->rq_next = task->rq_prev = NULL;
+}
+
+/* A queued task that should take over flags a switch at the next interrupt */
+static void check_preempt(runqueue_t *rq, uint32_t cpu, task_t *task)
+{
+    if (rq->current == rq->idle || sched_class->preempts(cpu, task, rq->current))
+        rq->need_resched = 1;
+}
+
+static void enqueue_task(task_t *task)
+{
+    uint32_t cpu = pick_cpu();
+    runqueue_t *rq = &runqueues[cpu];
+    uint64_t rflags = spinlock_acquire_irqsave(&rq->lock);
+    task->cpu = cpu;
+    rq_add_task(rq, task);
+    sched_class->enqueue(cpu, task, ENQUEUE_NEW);
+    task->on_rq = 1;
+    rq->nr_tasks++;
+    check_preempt(rq, cpu, task);
+    spinlock_release_irqrestore(&rq->lock, rflags);
+}
+
+/*
+ * Create a user task in pml4. [image_start, image_end) is the program image
+ * already mapped there; it is recorded before the task can run, so mmap
+ * placement and munmap know about it from the first instruction on.
+ */
+task_t *task_create_user(void (*entry)(void), const char *name, page_table_t *pml4, uint64_t image_start, uint64_t image_end)
+{
+    task_t *task = (task_t *)kmem_cache_alloc(task_cache);
+    if (!task)
+        return NULL;
     memset(task, 0, sizeof(task_t));
-    task->pid = next_pid++;
+    task->pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
     strncpy(task->name, name, 63);
     task->name[63] = '\0';
     task->state = TASK_READY;
-    task->time_slice_remaining = TIME_SLICE;
-    task->stack_size = TASK_STACK_SIZE;
+    task->priority = SCHED_DEFAULT_PRIORITY;
+    task->stack_size = USER_STACK_SIZE;
     task->is_kernel_task = 0;
     task->pml4 = pml4;
     
     task->kernel_stack = (uint64_t)kmalloc(TASK_STACK_SIZE);
     if (!task->kernel_stack)
     {
-        kfree(task);
-        spinlock_release(&sched_lock);
+        kmem_cache_free(task_cache, task);
         return NULL;
     }
-    memset((void *)task->kernel_stack, 0, TASK_STACK_SIZE);
-    
-    uint64_t user_stack_base = 0x700000000000;
-    size_t stack_pages = (TASK_STACK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
     
-    for (size_t i = 0; i < stack_pages; i++)
+    // The stack area starts small and grows down on faults, as far as
+    // USER_STACK_SIZE below the top; the page under that stays unmapped.
+    uint64_t user_stack_base = USER_STACK_TOP - USER_STACK_INITIAL;
+    if ((image_end > image_start &&
+         vma_add(&task->vmas, image_start, image_end, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE)) ||
+        vma_add(&task->vmas, user_stack_base, USER_STACK_TOP, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN))
     {
-        uint64_t phys = alloc_page();
-        if (!phys)
-        {
-            for (size_t j = 0; j < i; j++)
-            {
-                uint64_t p = virt_to_phys(task->pml4, user_stack_base + j * PAGE_SIZE);
-                if (p) free_page(p);
-                unmap_page(task->pml4, user_stack_base + j * PAGE_SIZE);
-            }
-            kfree((void*)task->kernel_stack);
-            kfree(task);
-            spinlock_release(&sched_lock);
-            return NULL;
-        }
-        map_page(task->pml4, user_stack_base + i * PAGE_SIZE, phys, PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER);
+        vma_free_all(&task->vmas);
+        kfree((void*)task->kernel_stack);
+        kmem_cache_free(task_cache, task);
+        return NULL;
     }
+    // Only the top pages are backed now; if that fails they fault in later
+    map_anon_range(pml4, user_stack_base, USER_STACK_INITIAL, PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE, 1);
     
-    task->user_stack = user_stack_base;
+    task->user_stack = USER_STACK_TOP - USER_STACK_SIZE + PAGE_SIZE;
+    task->brk = USER_HEAP_START;
     
     memset(&task->regs, 0, sizeof(registers_t));
-    uint64_t user_stack_top = user_stack_base + TASK_STACK_SIZE;
+    uint64_t user_stack_top = USER_STACK_TOP;
     user_stack_top &= ~0xFULL;
     user_stack_top -= 8;
     
@@ -129,45 +305,63 @@ task_t *task_create_user(void (*entry)(void), const char *name, page_table_t *pm
     task->regs.ss = 0x10;
     task->regs.ds = 0x10;
     
-    if (!task_list_head)
-    {
-        task_list_head = task;
-        task->next = task;
-        task->state = TASK_RUNNING;
-        current_task = task;
-    }
-    else if (task_list_head->next == task_list_head)
+    enqueue_task(task);
+    log("Created user task: %s (PID %d, CPU %d)", 1, 0, name, task->pid, task->cpu);
+    return task;
+}
+
+/*
+ * Create the child of a fork: a user task in the given (copy-on-write)
+ * address space that resumes in user mode with the given registers.
+ * The user stack lives at the same address as the parent's.
+ */
+task_t *task_fork(task_t *parent, page_table_t *pml4, const registers_t *regs)
+{
+    task_t *task = (task_t *)kmem_cache_alloc(task_cache);
+    if (!task)
+        return NULL;
+    memset(task, 0, sizeof(task_t));
+    task->pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
+    strncpy(task->name, parent->name, 63);
+    task->name[63] = '\0';
+    task->state = TASK_READY;
+    task->priority = parent->priority;
+    task->stack_size = parent->stack_size;
+    task->is_kernel_task = 0;
+    task->pml4 = pml4;
+    task->user_stack = parent->user_stack;
+    task->brk = parent->brk;
+
+    task->kernel_stack = (uint64_t)kmalloc(TASK_STACK_SIZE);
+    if (!task->kernel_stack)
     {
-        task_list_head->next = task;
-        task->next = task_list_head;
+        kmem_cache_free(task_cache, task);
+        return NULL;
     }
-    else
+    if (vma_copy(&task->vmas, &parent->vmas))
     {
-        task_t *old_next = task_list_head->next;
-        task_list_head->next = task;
-        task->next = old_next;
+        kfree((void*)task->kernel_stack);
+        kmem_cache_free(task_cache, task);
+        return NULL;
     }
-    log("Created user task: %s (PID %d)", 1, 0, name, task->pid);
-    
-    spinlock_release(&sched_lock);
+    task->regs = *regs;
+
+    enqueue_task(task);
+    log("Forked task: %s (PID %d -> %d, CPU %d)", 1, 0, task->name, parent->pid, task->pid, task->cpu);
     return task;
 }
 
 task_t *task_create(void (*entry)(void), const char *name) //TODO: Get rid of user_entry.asm
 {
-    spinlock_acquire(&sched_lock);
-    task_t *task = (task_t *)kmalloc(sizeof(task_t));
+    task_t *task = (task_t *)kmem_cache_alloc(task_cache);
     if (!task)
-    {
-        spinlock_release(&sched_lock);
         return NULL;
-    }
     memset(task, 0, sizeof(task_t));
-    task->pid = next_pid++;
+    task->pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
     strncpy(task->name, name, 63);
     task->name[63] = '\0';
     task->state = TASK_READY;
-    task->time_slice_remaining = TIME_SLICE;
+    task->priority = SCHED_DEFAULT_PRIORITY;
     task->stack_size = TASK_STACK_SIZE;
     task->is_kernel_task = 1;
     task->pml4 = get_kernel_pml4();
@@ -175,11 +369,9 @@ task_t *task_create(void (*entry)(void), const char *name) //TODO: Get rid of us
     task->kernel_stack = (uint64_t)kmalloc(TASK_STACK_SIZE);
     if (!task->kernel_stack)
     {
-        kfree(task);
-        spinlock_release(&sched_lock);
+        kmem_cache_free(task_cache, task);
         return NULL;
     }
-    memset((void *)task->kernel_stack, 0, TASK_STACK_SIZE);
     task->user_stack = 0;
     
     memset(&task->regs, 0, sizeof(registers_t));
@@ -207,174 +399,495 @@ task_t *task_create(void (*entry)(void), const char *name) //TODO: Get rid of us
     task->regs.r14 = 0;
     task->regs.r15 = 0;
     
-    if (!task_list_head)
+    enqueue_task(task);
+    log("Created kernel task: %s (PID %d, CPU %d)", 1, 0, name, task->pid, task->cpu);
+    return task;
+}
+
+/* Detach the exited tasks this CPU has finished switching away from */
+static task_t *take_dead_tasks(runqueue_t *rq)
+{
+    task_t *dead = NULL;
+    task_t **link = &rq->dead;
+    while (*link)
     {
-        task_list_head = task;
-        task->next = task;
-        task->state = TASK_RUNNING;
-        current_task = task;
+        task_t *task = *link;
+        if (task->on_cpu)
+        {
+            link = &task->rq_next;
+            continue;
+        }
+        *link = task->rq_next;
+        task->rq_next = dead;
+        dead = task;
     }
-    else if (task_list_head->next == task_list_head)
+    return dead;
+}
+
+/* Tearing down an address space shoots down TLBs, so only with interrupts on */
+static void free_tasks(task_t *list)
+{
+    while (list)
     {
-        task_list_head->next = task;
-        task->next = task_list_head;
+        task_t *next = list->rq_next;
+        if (list->kernel_stack)
+        {
+            kfree((void*)list->kernel_stack);
+        }
+
+        vma_free_all(&list->vmas);
+
+        // Image, heap, mmap and stack pages all go with the page tables
+        if (!list->is_kernel_task && list->pml4 && list->pml4 != get_kernel_pml4())
+        {
+            free_task_address_space(list->pml4);
+        }
+        kmem_cache_free(task_cache, list);
+        list = next;
     }
-    else
+}
+
+/* Hand exited tasks to the reaper; schedule() can't free them with interrupts off */
+static void reap_later(task_t *list)
+{
+    if (!list)
+        return;
+    uint64_t rflags = spinlock_acquire_irqsave(&reap_lock);
+    task_t *tail = list;
+    while (tail->rq_next)
+        tail = tail->rq_next;
+    tail->rq_next = reap_list;
+    reap_list = list;
+    spinlock_release_irqrestore(&reap_lock, rflags);
+    wake_up(&reap_wq);
+}
+
+static int reap_pending(void *arg)
+{
+    (void)arg;
+    return reap_list != NULL;
+}
+
+static void reaper_main(void)
+{
+    for (;;)
     {
-        task_t *old_next = task_list_head->next;
-        task_list_head->next = task;
-        task->next = old_next;
+        wait_until(&reap_wq, reap_pending, NULL, 0);
+        uint64_t rflags = spinlock_acquire_irqsave(&reap_lock);
+        task_t *list = reap_list;
+        reap_list = NULL;
+        spinlock_release_irqrestore(&reap_lock, rflags);
+        free_tasks(list);
     }
-    log("Created kernel task: %s (PID %d)", 1, 0, name, task->pid);
-    spinlock_release(&sched_lock);
-    return task;
 }
 
-static void reap_dead_tasks(void)
+/*
+ * Hand the outgoing task back to the class, take it off the queue if it
+ * blocked, or park it on the dead list. A blocked task that is preempted
+ * before it gets to switch out stays queued, or a wakeup it already
+ * missed could leave it asleep for good.
+ */
+static void put_prev_task(runqueue_t *rq, uint32_t cpu, task_t *task, int preempt)
 {
-    if (!task_list_head) return;
-    
-    task_t *iter = task_list_head;
-    task_t *prev = NULL;
-    task_t *start = task_list_head;
-    
-    do
+    if (task == rq->idle)
+        return;
+    if (task->state == TASK_BLOCKED && !preempt)
     {
-        task_t *next = iter->next;
-        
-        if (iter->state == TASK_DEAD && iter != current_task)
-        {
-            if (iter->kernel_stack)
-            {
-                kfree((void*)iter->kernel_stack);
-            }
-            
-            if (iter->user_stack && !iter->is_kernel_task)
-            {
-                size_t stack_pages = (TASK_STACK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
-                for (size_t i = 0; i < stack_pages; i++)
-                {
-                    uint64_t phys = virt_to_phys(iter->pml4, iter->user_stack + i * PAGE_SIZE);
-                    if (phys)
-                    {
-                        free_page(phys);
-                        unmap_page(iter->pml4, iter->user_stack + i * PAGE_SIZE);
-                    }
-                }
-            }
-            
-            if (!iter->is_kernel_task && iter->pml4 && iter->pml4 != get_kernel_pml4())
-            {
-                free_page_directory(iter->pml4);
-            }
-            
-            if (iter == task_list_head)
-            {
-                if (task_list_head->next == task_list_head)
-                {
-                    task_list_head = NULL;
-                    kfree(iter);
-                    return;
-                }
-                task_list_head = next;
-                
-                task_t *last = task_list_head;
-                while (last->next != iter)
-                    last = last->next;
-                last->next = task_list_head;
-                
-                kfree(iter);
-                iter = task_list_head;
-                start = task_list_head;
-                continue;
-            }
-            
-            if (prev)
-                prev->next = next;
-            
-            kfree(iter);
-            iter = next;
-            continue;
-        }
-        
-        prev = iter;
-        iter = next;
-    } while (iter != start);
+        sched_class->put_prev(cpu, task, 0);
+        rq->nr_tasks--;
+        return;
+    }
+    if (task->state == TASK_DEAD)
+    {
+        sched_class->put_prev(cpu, task, 0);
+        rq_remove_task(rq, task);
+        task->rq_next = rq->dead;
+        rq->dead = task;
+        rq->nr_tasks--;
+        return;
+    }
+    sched_class->put_prev(cpu, task, 1);
+    task->on_rq = 1;
 }
 
-static task_t *get_next_task(void)
+static task_t *pick_next_task(runqueue_t *rq, uint32_t cpu)
 {
-    if (!current_task || !current_task->next)
-        return NULL;
-    
-    task_t *start = current_task->next;
-    task_t *iter = start;
-    
-    do
-    {
-        if (iter->state == TASK_READY || iter->state == TASK_RUNNING)
-            return iter;
-        iter = iter->next;
-    } while (iter != start);
-    
-    return current_task;
+    task_t *task = sched_class->pick_next(cpu);
+    if (!task)
+        return rq->idle;
+    task->on_rq = 0;
+    return task;
 }
 
-void sched_yield(void)
+static void schedule(int preempt)
 {
     if (!scheduler_enabled) return;
-    
+
+    runqueue_t *rq;
     uint64_t rflags;
-    asm volatile("pushfq; pop %0; cli" : "=r"(rflags));
-    
-    reap_dead_tasks();
-    
-    if (!current_task)
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    uint32_t cpu = smp_cpu_id();
+    rq = &runqueues[cpu];
+
+    if (!rq->current)
     {
         if (rflags & 0x200) asm volatile("sti");
         return;
     }
-    
-    task_t *old_task = current_task;
-    task_t *new_task = get_next_task();
-    
+
+    spinlock_acquire(&rq->lock);
+    task_t *dead = take_dead_tasks(rq);
+    task_t *old_task = rq->current;
+    put_prev_task(rq, cpu, old_task, preempt);
+    task_t *new_task = pick_next_task(rq, cpu);
+    rq->need_resched = 0;
+
+    if (new_task != old_task)
+    {
+        if (old_task->state == TASK_RUNNING)
+            old_task->state = TASK_READY;
+        new_task->state = TASK_RUNNING;
+        new_task->on_cpu = 1;
+        rq->current = new_task;
+    }
+    spinlock_release(&rq->lock);
+
+    // Interrupts stay off until the switch, so the reaper frees them later
+    reap_later(dead);
+
     if (new_task == old_task)
     {
         if (rflags & 0x200) asm volatile("sti");
         return;
     }
-    
-    if (old_task->state == TASK_RUNNING)
-        old_task->state = TASK_READY;
-    
-    old_task->time_slice_remaining = TIME_SLICE;
-    new_task->state = TASK_RUNNING;
-    new_task->time_slice_remaining = TIME_SLICE;
-    
-    tss.rsp0 = new_task->kernel_stack + TASK_STACK_SIZE;
-    
+
+    if (new_task->kernel_stack)
+        tss[cpu].rsp0 = new_task->kernel_stack + TASK_STACK_SIZE;
+
     if (new_task->pml4 != old_task->pml4)
     {
         switch_page_directory(new_task->pml4);
     }
-    
-    task_t *prev_task = current_task;
-    current_task = new_task;
-    task_switch(&prev_task->regs, &new_task->regs);
+
+    task_switch(&old_task->regs, &new_task->regs, &old_task->on_cpu);
+
+    // Back on this task, possibly much later
+    if (rflags & 0x200) asm volatile("sti");
 }
 
+void sched_yield(void)
+{
+    schedule(0);
+}
+
+/*
+ * Make a blocked task runnable again, on the CPU it blocked on. If it has
+ * not switched out yet it simply keeps running. Returns 1 if it was blocked.
+ */
+int sched_wake(task_t *task)
+{
+    runqueue_t *rq;
+    uint64_t rflags;
+    // Only queued tasks migrate, but this one may be queued and running
+    for (;;)
+    {
+        rq = &runqueues[task->cpu];
+        rflags = spinlock_acquire_irqsave(&rq->lock);
+        if (rq == &runqueues[task->cpu])
+            break;
+        spinlock_release_irqrestore(&rq->lock, rflags);
+    }
+
+    int woken = task->state == TASK_BLOCKED;
+    if (woken)
+    {
+        uint32_t cpu = rq - runqueues;
+        if (task == rq->current)
+        {
+            task->state = TASK_RUNNING;
+        }
+        else
+        {
+            task->state = TASK_READY;
+            if (!task->on_rq)
+            {
+                sched_class->enqueue(cpu, task, ENQUEUE_WAKEUP);
+                task->on_rq = 1;
+                rq->nr_tasks++;
+                check_preempt(rq, cpu, task);
+            }
+        }
+    }
+    spinlock_release_irqrestore(&rq->lock, rflags);
+    return woken;
+}
+
+/* Whether the caller is a task that can sleep, rather than a boot or idle context */
+int sched_can_block(void)
+{
+    if (!scheduler_enabled)
+        return 0;
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    runqueue_t *rq = this_rq();
+    int can = rq->current && rq->current != rq->idle;
+    if (rflags & 0x200) asm volatile("sti");
+    return can;
+}
+
+/* Lock two queues, lower address first so concurrent balancers can't deadlock */
+static uint64_t double_rq_lock(runqueue_t *a, runqueue_t *b)
+{
+    if (a > b)
+    {
+        runqueue_t *t = a;
+        a = b;
+        b = t;
+    }
+    uint64_t rflags = spinlock_acquire_irqsave(&a->lock);
+    spinlock_acquire(&b->lock);
+    return rflags;
+}
+
+static void double_rq_unlock(runqueue_t *a, runqueue_t *b, uint64_t rflags)
+{
+    spinlock_release(&b->lock);
+    spinlock_release_irqrestore(&a->lock, rflags);
+}
+
+/*
+ * The queue to pull from: at least two tasks longer than ours, the longest
+ * one behind our last-level cache if there is one, else the longest anywhere.
+ */
+static runqueue_t *find_busiest(uint32_t cpu)
+{
+    runqueue_t *rq = &runqueues[cpu];
+    runqueue_t *near = NULL, *far = NULL;
+
+    for (uint32_t i = 0; i < smp_cpu_count(); i++)
+    {
+        runqueue_t *other = &runqueues[i];
+        if (i == cpu || !other->idle || other->nr_tasks < rq->nr_tasks + 2)
+            continue;
+        runqueue_t **best = other->llc == rq->llc ? &near : &far;
+        if (!*best || other->nr_tasks > (*best)->nr_tasks)
+            *best = other;
+    }
+    return near ? near : far;
+}
+
+/* Move up to max queued tasks from src to dst, as the class picks them. Both locked. */
+static uint32_t move_tasks(runqueue_t *dst, uint32_t dst_cpu, runqueue_t *src, uint32_t src_cpu, uint32_t max)
+{
+    uint32_t moved = 0;
+    task_t *task;
+    while (moved < max && (task = sched_class->movable(src_cpu)))
+    {
+        sched_class->dequeue(src_cpu, task, DEQUEUE_MIGRATE);
+        rq_remove_task(src, task);
+        src->nr_tasks--;
+
+        task->cpu = dst_cpu;
+        rq_add_task(dst, task);
+        sched_class->enqueue(dst_cpu, task, ENQUEUE_MIGRATE);
+        dst->nr_tasks++;
+        check_preempt(dst, dst_cpu, task);
+        moved++;
+    }
+    return moved;
+}
+
+/* Pull half the difference from the busiest queue; an idle CPU takes half its tasks */
+static void load_balance(uint32_t cpu)
+{
+    runqueue_t *rq = &runqueues[cpu];
+    runqueue_t *busiest = find_busiest(cpu);
+    if (!busiest) return;
+
+    uint64_t rflags = double_rq_lock(rq, busiest);
+    uint32_t moved = 0;
+    // Lengths were read unlocked, check again
+    if (busiest->nr_tasks >= rq->nr_tasks + 2)
+        moved = move_tasks(rq, cpu, busiest, busiest - runqueues, (busiest->nr_tasks - rq->nr_tasks) / 2);
+    if (moved)
+    {
+        rq->nr_steals++;
+        rq->nr_migrations += moved;
+    }
+    double_rq_unlock(rq, busiest, rflags);
+}
+
+/*
+ * Timer tick on the calling CPU. Only flags the reschedule; irq_handler()
+ * acts on it once the interrupt has been acknowledged.
+ */
 void sched_tick(void)
 {
-    if (!scheduler_enabled || !current_task) return;
-    
-    if (current_task->time_slice_remaining > 0)
-        current_task->time_slice_remaining--;
-    
-    if (current_task->time_slice_remaining == 0)
-        sched_yield();
+    if (!scheduler_enabled) return;
+    uint32_t cpu = smp_cpu_id();
+    runqueue_t *rq = &runqueues[cpu];
+    if (!rq->current) return;
+
+    if (!rq->nr_tasks || ++rq->balance_ticks >= BALANCE_INTERVAL)
+    {
+        rq->balance_ticks = 0;
+        load_balance(cpu);
+    }
+
+    uint64_t rflags = spinlock_acquire_irqsave(&rq->lock);
+    // A CPU whose last task exited may not switch again for a long time
+    task_t *dead = take_dead_tasks(rq);
+    task_t *current = rq->current;
+    if (current == rq->idle)
+    {
+        if (rq->nr_tasks)
+            rq->need_resched = 1;
+    }
+    else if (sched_class->tick(cpu, current))
+    {
+        rq->need_resched = 1;
+    }
+    spinlock_release_irqrestore(&rq->lock, rflags);
+    reap_later(dead);
+}
+
+void sched_preempt(void)
+{
+    if (this_rq()->need_resched)
+        schedule(1);
+}
+
+/* Look a task up by PID. On success its queue is left locked. */
+static task_t *find_task_lock(uint64_t pid, runqueue_t **rq_out, uint64_t *rflags)
+{
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++)
+    {
+        runqueue_t *rq = &runqueues[cpu];
+        *rflags = spinlock_acquire_irqsave(&rq->lock);
+        *rq_out = rq;
+        for (task_t *task = rq->tasks; task; task = task->rq_next)
+            if (task->pid == pid)
+                return task;
+        spinlock_release_irqrestore(&rq->lock, *rflags);
+    }
+    return NULL;
+}
+
+int sched_set_priority(uint64_t pid, int priority)
+{
+    if (priority < 0 || priority >= SCHED_PRIORITIES)
+        return -1;
+    runqueue_t *rq;
+    uint64_t rflags;
+    task_t *task = find_task_lock(pid, &rq, &rflags);
+    if (!task)
+        return -1;
+
+    uint32_t cpu = rq - runqueues;
+    if (task->on_rq)
+    {
+        sched_class->dequeue(cpu, task, 0);
+        task->priority = priority;
+        sched_class->enqueue(cpu, task, 0);
+        check_preempt(rq, cpu, task);
+    }
+    else
+    {
+        // Running (the class may have it mid-slice): let it re-pick
+        task->priority = priority;
+        if (task == rq->current)
+            rq->need_resched = 1;
+    }
+    spinlock_release_irqrestore(&rq->lock, rflags);
+    return 0;
+}
+
+int sched_get_priority(uint64_t pid)
+{
+    runqueue_t *rq;
+    uint64_t rflags;
+    task_t *task = find_task_lock(pid, &rq, &rflags);
+    if (!task)
+        return -1;
+    int priority = task->priority;
+    spinlock_release_irqrestore(&rq->lock, rflags);
+    return priority;
+}
+
+/*
+ * Switch every CPU to another scheduling class. All queues are locked (in
+ * order) while their queued tasks are moved over; running tasks finish
+ * their turn and are queued with the new class when they next switch out.
+ */
+int sched_set_policy(int policy)
+{
+    const sched_class_t *class;
+    if (policy == SCHED_POLICY_PRIO)
+        class = &prio_sched_class;
+    else if (policy == SCHED_POLICY_FAIR)
+        class = &fair_sched_class;
+    else
+        return -1;
+
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++)
+        spinlock_acquire(&runqueues[cpu].lock);
+
+    const sched_class_t *old = sched_class;
+    if (class != old)
+    {
+        for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++)
+        {
+            runqueue_t *rq = &runqueues[cpu];
+            // The running task leaves the old class without being queued
+            if (rq->current && rq->current != rq->idle)
+                old->put_prev(cpu, rq->current, 0);
+            for (task_t *task = rq->tasks; task; task = task->rq_next)
+            {
+                if (!task->on_rq)
+                    continue;
+                old->dequeue(cpu, task, 0);
+                class->enqueue(cpu, task, ENQUEUE_NEW);
+            }
+            // Account the running task to the new class from here on
+            if (rq->current && rq->current != rq->idle)
+                class->set_curr(cpu, rq->current);
+            rq->need_resched = 1;
+        }
+        sched_class = class;
+    }
+
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++)
+        spinlock_release(&runqueues[cpu].lock);
+    if (rflags & 0x200)
+        __asm__ volatile("sti" : : : "memory");
+    if (class != old)
+        log("Scheduler switched to %s.", 1, 0, class->name);
+    return 0;
+}
+
+int sched_get_policy(void)
+{
+    return sched_class == &fair_sched_class ? SCHED_POLICY_FAIR : SCHED_POLICY_PRIO;
+}
+
+int sched_get_stat(uint32_t cpu, sched_stat_t *stat)
+{
+    if (cpu >= smp_cpu_count() || !stat)
+        return -1;
+    runqueue_t *rq = &runqueues[cpu];
+    stat->nr_tasks = rq->nr_tasks;
+    stat->steals = rq->nr_steals;
+    stat->migrations = rq->nr_migrations;
+    return 0;
 }
 
 task_t *sched_current_task(void)
 {
-    return current_task;
-}
\ No newline at end of file
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    task_t *current = this_rq()->current;
+    if (rflags & 0x200) asm volatile("sti");
+    return current;
+}
@@ -4,8 +4,24 @@
 #include <stdint.h>
 #include "../cpu/isr.h"
 #include "../libk/core/mem.h"
+#include "../libk/core/vma.h"
 
 #define TASK_STACK_SIZE 8192
+
+// Timer ticks per second on every CPU (HPET on the BSP, LAPIC timer on the APs)
+#define SCHED_TICK_HZ 100
+
+// Scheduling classes, one active for the whole system at a time
+#define SCHED_POLICY_PRIO 0     // O(1) priority arrays with fixed slices
+#define SCHED_POLICY_FAIR 1     // CFS-style virtual runtime
+#ifndef SCHED_DEFAULT_POLICY
+#define SCHED_DEFAULT_POLICY SCHED_POLICY_FAIR
+#endif
+
+// Priority levels, 0 runs first
+#define SCHED_PRIORITIES 64
+#define SCHED_DEFAULT_PRIORITY 32
+// Priority class: ticks per slice at the default priority; higher levels get longer slices
 #define TIME_SLICE 4
 
 typedef enum
@@ -25,19 +41,46 @@ typedef struct task
     uint64_t kernel_stack;
     uint64_t user_stack;
     uint64_t stack_size;
-    uint64_t time_slice_remaining;
+    int priority;               // 0 to SCHED_PRIORITIES - 1
     int is_kernel_task;
     page_table_t *pml4;
-    struct task *next;
+    vma_tree_t vmas;
+    uint64_t brk;
+    uint64_t minor_faults;
+    uint32_t cpu;               // run queue the task lives on
+    volatile int on_cpu;        // running, or not yet fully switched out
+    int on_rq;                  // queued with the scheduling class
+    struct task *rq_next, *rq_prev;     // the CPU's task list
+    // Priority class
+    uint64_t time_slice_remaining;
+    struct prio_array *array;   // priority array the task is queued on, if any
+    struct task *next, *prev;
+    // Fair class
+    uint64_t vruntime;          // weighted ns on the CPU
+    uint64_t sum_exec_runtime;  // ns on the CPU
+    uint64_t exec_start;        // clock at the last accounting
+    uint64_t slice_start;       // sum_exec_runtime when last picked
+    struct task *rb_parent, *rb_left, *rb_right;
+    int rb_red;
 } task_t;
 
 void sched_init(void);
+void sched_init_cpu(void);
 void sched_start(void);
 task_t *task_create(void (*entry)(void), const char *name);
-task_t *task_create_user(void (*entry)(void), const char *name, page_table_t *pml4);
+task_t *task_create_user(void (*entry)(void), const char *name, page_table_t *pml4, uint64_t image_start, uint64_t image_end);
+task_t *task_fork(task_t *parent, page_table_t *pml4, const registers_t *regs);
 void sched_yield(void);
 void sched_tick(void);
+void sched_preempt(void);
+int sched_wake(task_t *task);
+int sched_can_block(void);
+int sched_set_priority(uint64_t pid, int priority);
+int sched_get_priority(uint64_t pid);
+int sched_set_policy(int policy);
+int sched_get_policy(void);
+int sched_get_stat(uint32_t cpu, sched_stat_t *stat);
 task_t *sched_current_task(void);
-extern void task_switch(registers_t *old_regs, registers_t *new_regs);
+extern void task_switch(registers_t *old_regs, registers_t *new_regs, volatile int *old_on_cpu);
 
 #endif
\ No newline at end of file
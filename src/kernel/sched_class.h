@@ -0,0 +1,43 @@
+#ifndef SCHED_CLASS_H
+#define SCHED_CLASS_H
+
+#include "sched.h"
+
+// enqueue() flags
+#define ENQUEUE_NEW     1       // freshly created or forked
+#define ENQUEUE_MIGRATE 2       // pulled over from another CPU
+#define ENQUEUE_WAKEUP  4       // back from TASK_BLOCKED
+
+// dequeue() flags
+#define DEQUEUE_MIGRATE 1       // about to be queued on another CPU
+
+/*
+ * A scheduling policy. The core keeps the per-CPU run queue (lock, running
+ * and idle task, balancing); a class only orders the runnable tasks of each
+ * CPU. Every hook runs with that CPU's run queue locked. The running task is
+ * never queued, and the idle task never goes through a class at all.
+ */
+typedef struct sched_class
+{
+    const char *name;
+    void (*init)(uint32_t cpu);
+    void (*enqueue)(uint32_t cpu, task_t *task, int flags);
+    void (*dequeue)(uint32_t cpu, task_t *task, int flags);
+    // The running task leaves the CPU; queue it again if requeue is set
+    void (*put_prev)(uint32_t cpu, task_t *task, int requeue);
+    // Dequeue and return the task to run next, NULL if none is queued
+    task_t *(*pick_next)(uint32_t cpu);
+    // Take over the running task from another class, as if just picked
+    void (*set_curr)(uint32_t cpu, task_t *task);
+    // Timer tick for the running task; nonzero when it should give way
+    int (*tick)(uint32_t cpu, task_t *curr);
+    // Should the queued task take over from the running one?
+    int (*preempts)(uint32_t cpu, task_t *task, task_t *curr);
+    // A queued task that is safe to migrate (not on_cpu), the least urgent first
+    task_t *(*movable)(uint32_t cpu);
+} sched_class_t;
+
+extern const sched_class_t prio_sched_class;
+extern const sched_class_t fair_sched_class;
+
+#endif
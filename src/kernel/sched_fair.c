@@ -0,0 +1,464 @@
+#include "sched_class.h"
+#include "../cpu/smp.h"
+#include "../drv/hpet.h"
+
+/*
+ * Fair-share scheduling, after Linux's CFS. Each task accumulates virtual
+ * runtime: nanoseconds on the CPU scaled down by its weight, so a heavier
+ * (higher priority) task ages more slowly. The runnable task with the least
+ * vruntime runs next. Within one SCHED_LATENCY_NS period every runnable
+ * task gets a slice in proportion to its weight.
+ */
+
+#define SCHED_LATENCY_NS    20000000ULL     // period all runnable tasks share
+#define SCHED_MIN_GRAN_NS   4000000ULL      // shortest slice; stretches the period
+#define SCHED_WAKEUP_GRAN_NS 1000000ULL     // vruntime lead a queued task needs to preempt
+#define SCHED_SLEEPER_CREDIT (SCHED_LATENCY_NS / 2)  // most a sleeper may trail min_vruntime
+#define NICE_0_WEIGHT       1024
+
+// Weight per nice level -20..19, each step about 10% of CPU time apart (from Linux)
+static const uint32_t nice_to_weight[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+};
+
+typedef struct
+{
+    task_t *root;               // queued tasks by vruntime
+    task_t *leftmost;           // the one to run next
+    task_t *curr;               // running task, not in the tree
+    uint64_t min_vruntime;      // never goes backwards
+    uint64_t load;              // sum of the queued tasks' weights
+    uint32_t nr_queued;
+} cfs_rq_t;
+
+static cfs_rq_t cfs_rqs[MAX_CPUS];
+// Tick-driven stand-in for the clock on machines without an HPET
+static uint64_t tick_clock[MAX_CPUS];
+
+static inline int64_t vdiff(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b);
+}
+
+/* Priorities 0..63 spread over nice -20..19, with the default at nice 0 */
+static uint32_t task_weight(task_t *task)
+{
+    int nice = (task->priority - SCHED_DEFAULT_PRIORITY) * 20 / (SCHED_PRIORITIES - SCHED_DEFAULT_PRIORITY);
+    return nice_to_weight[nice + 20];
+}
+
+/* Nanosecond clock for runtime accounting */
+static uint64_t sched_clock(uint32_t cpu)
+{
+    uint64_t ns = hpet_read_ns();
+    return ns ? ns : tick_clock[cpu];
+}
+
+static void replace_child(cfs_rq_t *cfs, task_t *parent, task_t *old, task_t *new)
+{
+    if (!parent)
+        cfs->root = new;
+    else if (parent->rb_left == old)
+        parent->rb_left = new;
+    else
+        parent->rb_right = new;
+    if (new)
+        new->rb_parent = parent;
+}
+
+static void rotate_left(cfs_rq_t *cfs, task_t *x)
+{
+    task_t *y = x->rb_right;
+    x->rb_right = y->rb_left;
+    if (y->rb_left)
+        y->rb_left->rb_parent = x;
+    replace_child(cfs, x->rb_parent, x, y);
+    y->rb_left = x;
+    x->rb_parent = y;
+}
+
+static void rotate_right(cfs_rq_t *cfs, task_t *x)
+{
+    task_t *y = x->rb_left;
+    x->rb_left = y->rb_right;
+    if (y->rb_right)
+        y->rb_right->rb_parent = x;
+    replace_child(cfs, x->rb_parent, x, y);
+    y->rb_right = x;
+    x->rb_parent = y;
+}
+
+static task_t *tree_next(task_t *node)
+{
+    if (node->rb_right)
+    {
+        node = node->rb_right;
+        while (node->rb_left)
+            node = node->rb_left;
+        return node;
+    }
+    while (node->rb_parent && node == node->rb_parent->rb_right)
+        node = node->rb_parent;
+    return node->rb_parent;
+}
+
+static task_t *tree_prev(task_t *node)
+{
+    if (node->rb_left)
+    {
+        node = node->rb_left;
+        while (node->rb_right)
+            node = node->rb_right;
+        return node;
+    }
+    while (node->rb_parent && node == node->rb_parent->rb_left)
+        node = node->rb_parent;
+    return node->rb_parent;
+}
+
+static void insert_fixup(cfs_rq_t *cfs, task_t *node)
+{
+    task_t *parent;
+    while ((parent = node->rb_parent) && parent->rb_red)
+    {
+        task_t *grand = parent->rb_parent;     // a red node is never the root
+        if (parent == grand->rb_left)
+        {
+            task_t *uncle = grand->rb_right;
+            if (uncle && uncle->rb_red)
+            {
+                parent->rb_red = uncle->rb_red = 0;
+                grand->rb_red = 1;
+                node = grand;
+                continue;
+            }
+            if (node == parent->rb_right)
+            {
+                rotate_left(cfs, parent);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_red = 0;
+            grand->rb_red = 1;
+            rotate_right(cfs, grand);
+        }
+        else
+        {
+            task_t *uncle = grand->rb_left;
+            if (uncle && uncle->rb_red)
+            {
+                parent->rb_red = uncle->rb_red = 0;
+                grand->rb_red = 1;
+                node = grand;
+                continue;
+            }
+            if (node == parent->rb_left)
+            {
+                rotate_right(cfs, parent);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_red = 0;
+            grand->rb_red = 1;
+            rotate_left(cfs, grand);
+        }
+    }
+    cfs->root->rb_red = 0;
+}
+
+/* Equal vruntimes go right, so ties run in queueing order */
+static void tree_insert(cfs_rq_t *cfs, task_t *task)
+{
+    task_t *parent = NULL;
+    task_t **link = &cfs->root;
+    int leftmost = 1;
+    while (*link)
+    {
+        parent = *link;
+        if (vdiff(task->vruntime, parent->vruntime) < 0)
+        {
+            link = &parent->rb_left;
+        }
+        else
+        {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+    task->rb_parent = parent;
+    task->rb_left = task->rb_right = NULL;
+    task->rb_red = 1;
+    *link = task;
+    if (leftmost)
+        cfs->leftmost = task;
+    insert_fixup(cfs, task);
+}
+
+static void erase_fixup(cfs_rq_t *cfs, task_t *x, task_t *parent)
+{
+    while (x != cfs->root && (!x || !x->rb_red))
+    {
+        if (x == parent->rb_left)
+        {
+            task_t *w = parent->rb_right;
+            if (w->rb_red)
+            {
+                w->rb_red = 0;
+                parent->rb_red = 1;
+                rotate_left(cfs, parent);
+                w = parent->rb_right;
+            }
+            if ((!w->rb_left || !w->rb_left->rb_red) && (!w->rb_right || !w->rb_right->rb_red))
+            {
+                w->rb_red = 1;
+                x = parent;
+                parent = x->rb_parent;
+                continue;
+            }
+            if (!w->rb_right || !w->rb_right->rb_red)
+            {
+                w->rb_left->rb_red = 0;
+                w->rb_red = 1;
+                rotate_right(cfs, w);
+                w = parent->rb_right;
+            }
+            w->rb_red = parent->rb_red;
+            parent->rb_red = 0;
+            w->rb_right->rb_red = 0;
+            rotate_left(cfs, parent);
+            x = cfs->root;
+        }
+        else
+        {
+            task_t *w = parent->rb_left;
+            if (w->rb_red)
+            {
+                w->rb_red = 0;
+                parent->rb_red = 1;
+                rotate_right(cfs, parent);
+                w = parent->rb_left;
+            }
+            if ((!w->rb_left || !w->rb_left->rb_red) && (!w->rb_right || !w->rb_right->rb_red))
+            {
+                w->rb_red = 1;
+                x = parent;
+                parent = x->rb_parent;
+                continue;
+            }
+            if (!w->rb_left || !w->rb_left->rb_red)
+            {
+                w->rb_right->rb_red = 0;
+                w->rb_red = 1;
+                rotate_left(cfs, w);
+                w = parent->rb_left;
+            }
+            w->rb_red = parent->rb_red;
+            parent->rb_red = 0;
+            w->rb_left->rb_red = 0;
+            rotate_right(cfs, parent);
+            x = cfs->root;
+        }
+    }
+    if (x)
+        x->rb_red = 0;
+}
+
+static void tree_erase(cfs_rq_t *cfs, task_t *z)
+{
+    task_t *x, *x_parent;
+    int removed_red;
+    if (cfs->leftmost == z)
+        cfs->leftmost = tree_next(z);
+    if (!z->rb_left || !z->rb_right)
+    {
+        x = z->rb_left ? z->rb_left : z->rb_right;
+        x_parent = z->rb_parent;
+        removed_red = z->rb_red;
+        replace_child(cfs, z->rb_parent, z, x);
+    }
+    else
+    {
+        // Two children: the successor takes z's place in the tree
+        task_t *y = z->rb_right;
+        while (y->rb_left)
+            y = y->rb_left;
+        removed_red = y->rb_red;
+        x = y->rb_right;
+        if (y->rb_parent == z)
+        {
+            x_parent = y;
+        }
+        else
+        {
+            x_parent = y->rb_parent;
+            replace_child(cfs, y->rb_parent, y, x);
+            y->rb_right = z->rb_right;
+            y->rb_right->rb_parent = y;
+        }
+        replace_child(cfs, z->rb_parent, z, y);
+        y->rb_left = z->rb_left;
+        y->rb_left->rb_parent = y;
+        y->rb_red = z->rb_red;
+    }
+    if (!removed_red)
+        erase_fixup(cfs, x, x_parent);
+    z->rb_parent = z->rb_left = z->rb_right = NULL;
+}
+
+/* Advance min_vruntime to the smaller of the running and the leftmost task */
+static void update_min_vruntime(cfs_rq_t *cfs)
+{
+    uint64_t vruntime = cfs->min_vruntime;
+    if (cfs->curr)
+        vruntime = cfs->curr->vruntime;
+    if (cfs->leftmost && (!cfs->curr || vdiff(cfs->leftmost->vruntime, vruntime) < 0))
+        vruntime = cfs->leftmost->vruntime;
+    if (vdiff(vruntime, cfs->min_vruntime) > 0)
+        cfs->min_vruntime = vruntime;
+}
+
+/* Charge the running task for the time since it was last accounted */
+static void update_curr(uint32_t cpu, cfs_rq_t *cfs)
+{
+    task_t *curr = cfs->curr;
+    if (!curr)
+        return;
+    uint64_t now = sched_clock(cpu);
+    uint64_t delta = now - curr->exec_start;
+    if ((int64_t)delta <= 0)
+        return;
+    curr->exec_start = now;
+    curr->sum_exec_runtime += delta;
+    curr->vruntime += delta * NICE_0_WEIGHT / task_weight(curr);
+    update_min_vruntime(cfs);
+}
+
+/* The running task's share of the latency period */
+static uint64_t sched_slice(cfs_rq_t *cfs, task_t *curr)
+{
+    uint32_t nr = cfs->nr_queued + 1;
+    uint64_t period = SCHED_LATENCY_NS;
+    if (nr > SCHED_LATENCY_NS / SCHED_MIN_GRAN_NS)
+        period = nr * SCHED_MIN_GRAN_NS;
+    uint64_t weight = task_weight(curr);
+    return period * weight / (cfs->load + weight);
+}
+
+static void fair_init(uint32_t cpu)
+{
+    (void)cpu;
+}
+
+static void fair_enqueue(uint32_t cpu, task_t *task, int flags)
+{
+    cfs_rq_t *cfs = &cfs_rqs[cpu];
+    if (flags & ENQUEUE_NEW)
+        task->vruntime = cfs->min_vruntime;
+    else if (flags & ENQUEUE_MIGRATE)
+        task->vruntime += cfs->min_vruntime;
+    else if ((flags & ENQUEUE_WAKEUP) && vdiff(task->vruntime, cfs->min_vruntime - SCHED_SLEEPER_CREDIT) < 0)
+        task->vruntime = cfs->min_vruntime - SCHED_SLEEPER_CREDIT;   // a long sleep earns no more than this
+    tree_insert(cfs, task);
+    cfs->load += task_weight(task);
+    cfs->nr_queued++;
+}
+
+static void fair_dequeue(uint32_t cpu, task_t *task, int flags)
+{
+    cfs_rq_t *cfs = &cfs_rqs[cpu];
+    tree_erase(cfs, task);
+    cfs->load -= task_weight(task);
+    cfs->nr_queued--;
+    // Keep only the lead over this CPU's clock; the next one adds its own
+    if (flags & DEQUEUE_MIGRATE)
+        task->vruntime -= cfs->min_vruntime;
+}
+
+static void fair_put_prev(uint32_t cpu, task_t *task, int requeue)
+{
+    cfs_rq_t *cfs = &cfs_rqs[cpu];
+    update_curr(cpu, cfs);
+    cfs->curr = NULL;
+    if (requeue)
+        fair_enqueue(cpu, task, 0);
+}
+
+static task_t *fair_pick_next(uint32_t cpu)
+{
+    cfs_rq_t *cfs = &cfs_rqs[cpu];
+    task_t *task = cfs->leftmost;
+    if (!task)
+        return NULL;
+    fair_dequeue(cpu, task, 0);
+    cfs->curr = task;
+    task->exec_start = sched_clock(cpu);
+    task->slice_start = task->sum_exec_runtime;
+    update_min_vruntime(cfs);
+    return task;
+}
+
+/* Start accounting the running task from here, placed like a new one */
+static void fair_set_curr(uint32_t cpu, task_t *task)
+{
+    cfs_rq_t *cfs = &cfs_rqs[cpu];
+    task->vruntime = cfs->min_vruntime;
+    cfs->curr = task;
+    task->exec_start = sched_clock(cpu);
+    task->slice_start = task->sum_exec_runtime;
+}
+
+/* Give way once the slice is used up, or once the next task trails by more than a slice */
+static int fair_tick(uint32_t cpu, task_t *curr)
+{
+    cfs_rq_t *cfs = &cfs_rqs[cpu];
+    tick_clock[cpu] += 1000000000ULL / SCHED_TICK_HZ;
+    update_curr(cpu, cfs);
+    if (!cfs->leftmost)
+        return 0;
+    uint64_t slice = sched_slice(cfs, curr);
+    if (curr->sum_exec_runtime - curr->slice_start >= slice)
+        return 1;
+    return vdiff(curr->vruntime, cfs->leftmost->vruntime) > (int64_t)slice;
+}
+
+static int fair_preempts(uint32_t cpu, task_t *task, task_t *curr)
+{
+    cfs_rq_t *cfs = &cfs_rqs[cpu];
+    if (cfs->curr == curr)
+        update_curr(cpu, cfs);
+    return vdiff(curr->vruntime, task->vruntime) > (int64_t)SCHED_WAKEUP_GRAN_NS;
+}
+
+/* From the right of the tree: the most vruntime, the longest until it would run */
+static task_t *fair_movable(uint32_t cpu)
+{
+    task_t *task = cfs_rqs[cpu].root;
+    if (!task)
+        return NULL;
+    while (task->rb_right)
+        task = task->rb_right;
+    for (; task; task = tree_prev(task))
+        if (!task->on_cpu)
+            return task;
+    return NULL;
+}
+
+const sched_class_t fair_sched_class = {
+    .name = "fair",
+    .init = fair_init,
+    .enqueue = fair_enqueue,
+    .dequeue = fair_dequeue,
+    .put_prev = fair_put_prev,
+    .pick_next = fair_pick_next,
+    .set_curr = fair_set_curr,
+    .tick = fair_tick,
+    .preempts = fair_preempts,
+    .movable = fair_movable,
+};
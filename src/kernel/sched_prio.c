@@ -0,0 +1,172 @@
+#include "sched_class.h"
+#include "../cpu/smp.h"
+
+/*
+ * O(1) priority scheduling: tasks run from the active array in priority
+ * order and move to the expired one when their slice runs out. Once active
+ * is empty the two swap, so low priorities still get a turn.
+ */
+
+// Ready tasks by priority, each level a FIFO
+typedef struct prio_array
+{
+    uint64_t bitmap;            // bit p set while level p has tasks
+    task_t *head[SCHED_PRIORITIES];
+    task_t *tail[SCHED_PRIORITIES];
+} prio_array_t;
+
+typedef struct
+{
+    prio_array_t arrays[2];
+    prio_array_t *active, *expired;
+} prio_rq_t;
+
+static prio_rq_t prio_rqs[MAX_CPUS];
+
+/* Ticks per slice: TIME_SLICE at the default priority, twice that at 0, 1 at the bottom */
+static uint64_t task_timeslice(task_t *task)
+{
+    uint64_t ticks = (uint64_t)(SCHED_PRIORITIES - task->priority) * TIME_SLICE
+                   / (SCHED_PRIORITIES - SCHED_DEFAULT_PRIORITY);
+    return ticks ? ticks : 1;
+}
+
+static void array_enqueue(prio_array_t *array, task_t *task)
+{
+    int p = task->priority;
+    task->next = NULL;
+    task->prev = array->tail[p];
+    if (array->tail[p])
+        array->tail[p]->next = task;
+    else
+        array->head[p] = task;
+    array->tail[p] = task;
+    array->bitmap |= 1ULL << p;
+    task->array = array;
+}
+
+static void array_dequeue(prio_array_t *array, task_t *task)
+{
+    int p = task->priority;
+    if (task->prev)
+        task->prev->next = task->next;
+    else
+        array->head[p] = task->next;
+    if (task->next)
+        task->next->prev = task->prev;
+    else
+        array->tail[p] = task->prev;
+    if (!array->head[p])
+        array->bitmap &= ~(1ULL << p);
+    task->next = task->prev = NULL;
+    task->array = NULL;
+}
+
+static void prio_init(uint32_t cpu)
+{
+    prio_rq_t *prq = &prio_rqs[cpu];
+    prq->active = &prq->arrays[0];
+    prq->expired = &prq->arrays[1];
+}
+
+static void prio_enqueue(uint32_t cpu, task_t *task, int flags)
+{
+    if (flags & ENQUEUE_NEW)
+        task->time_slice_remaining = task_timeslice(task);
+    array_enqueue(prio_rqs[cpu].active, task);
+}
+
+static void prio_dequeue(uint32_t cpu, task_t *task, int flags)
+{
+    (void)cpu;
+    (void)flags;
+    array_dequeue(task->array, task);
+}
+
+/* Expired once its slice is spent, else back to the tail of its active level */
+static void prio_put_prev(uint32_t cpu, task_t *task, int requeue)
+{
+    prio_rq_t *prq = &prio_rqs[cpu];
+    if (!requeue)
+        return;
+    if (task->time_slice_remaining == 0)
+    {
+        task->time_slice_remaining = task_timeslice(task);
+        array_enqueue(prq->expired, task);
+    }
+    else
+    {
+        array_enqueue(prq->active, task);
+    }
+}
+
+/* Head of the highest non-empty level */
+static task_t *prio_pick_next(uint32_t cpu)
+{
+    prio_rq_t *prq = &prio_rqs[cpu];
+    if (!prq->active->bitmap)
+    {
+        prio_array_t *t = prq->active;
+        prq->active = prq->expired;
+        prq->expired = t;
+    }
+    if (!prq->active->bitmap)
+        return NULL;
+    task_t *task = prq->active->head[__builtin_ctzll(prq->active->bitmap)];
+    array_dequeue(prq->active, task);
+    return task;
+}
+
+static void prio_set_curr(uint32_t cpu, task_t *task)
+{
+    (void)cpu;
+    task->time_slice_remaining = task_timeslice(task);
+}
+
+static int prio_tick(uint32_t cpu, task_t *curr)
+{
+    (void)cpu;
+    if (curr->time_slice_remaining > 0)
+        curr->time_slice_remaining--;
+    return curr->time_slice_remaining == 0;
+}
+
+static int prio_preempts(uint32_t cpu, task_t *task, task_t *curr)
+{
+    (void)cpu;
+    return task->priority < curr->priority;
+}
+
+/* Expired and lowest priority first, as they are the least likely to be cache-hot */
+static task_t *prio_movable(uint32_t cpu)
+{
+    prio_rq_t *prq = &prio_rqs[cpu];
+    prio_array_t *arrays[2] = {prq->expired, prq->active};
+
+    for (int a = 0; a < 2; a++)
+    {
+        uint64_t levels = arrays[a]->bitmap;
+        while (levels)
+        {
+            int p = 63 - __builtin_clzll(levels);
+            levels &= ~(1ULL << p);
+            for (task_t *task = arrays[a]->head[p]; task; task = task->next)
+                if (!task->on_cpu)
+                    return task;
+        }
+    }
+    return NULL;
+}
+
+const sched_class_t prio_sched_class = {
+    .name = "prio",
+    .init = prio_init,
+    .enqueue = prio_enqueue,
+    .dequeue = prio_dequeue,
+    .put_prev = prio_put_prev,
+    .pick_next = prio_pick_next,
+    .set_curr = prio_set_curr,
+    .tick = prio_tick,
+    .preempts = prio_preempts,
+    .movable = prio_movable,
+};
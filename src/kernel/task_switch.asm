@@ -2,6 +2,9 @@
 section .text
 global task_switch
 
+; task_switch(old_regs, new_regs, old_on_cpu): *old_on_cpu is cleared once
+; nothing of the old task (registers or stack) is touched any more, after
+; which another CPU may pick it up.
 task_switch:
     mov [rdi + 0], ds
     mov [rdi + 8], r15
@@ -35,6 +38,8 @@ task_switch:
     jnz .user_mode
     
 .kernel_mode:
+    mov rsp, [rsi + 168]
+    mov dword [rdx], 0
     mov ax, [rsi + 0]
     mov ds, ax
     mov es, ax
@@ -52,7 +57,6 @@ task_switch:
     mov rcx, [rsi + 104]
     mov rbx, [rsi + 112]
     mov rax, [rsi + 120]
-    mov rsp, [rsi + 168]
     push qword [rsi + 160]
     popfq
     mov rdi, [rsi + 80]
@@ -63,6 +67,9 @@ task_switch:
     jmp rax
 
 .user_mode:
+    ; Build the iretq frame in place: rip..ss end registers_t
+    lea rsp, [rsi + 184]
+    mov dword [rdx], 0
     push qword [rsi + 176]
     push qword [rsi + 168]
     push qword [rsi + 160]
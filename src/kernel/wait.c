@@ -0,0 +1,140 @@
+#include "wait.h"
+#include "../drv/rtc.h"
+
+void wait_queue_init(wait_queue_t *wq)
+{
+    spinlock_init(&wq->lock);
+    wq->head = wq->tail = NULL;
+}
+
+static void wq_remove(wait_queue_t *wq, wait_entry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        wq->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        wq->tail = entry->prev;
+    entry->next = entry->prev = NULL;
+    entry->queued = 0;
+}
+
+/*
+ * Mark the caller blocked, on the queue if there is one, before it looks at
+ * its condition again. A wakeup from then on puts it back to running, so
+ * none is lost between the check and the switch.
+ */
+static void prepare_to_wait(wait_queue_t *wq, wait_entry_t *entry)
+{
+    if (!wq)
+    {
+        entry->task->state = TASK_BLOCKED;
+        // The timer reads the state after bumping the tick; order it before our tick check
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return;
+    }
+    uint64_t rflags = spinlock_acquire_irqsave(&wq->lock);
+    if (!entry->queued)
+    {
+        entry->next = NULL;
+        entry->prev = wq->tail;
+        if (wq->tail)
+            wq->tail->next = entry;
+        else
+            wq->head = entry;
+        wq->tail = entry;
+        entry->queued = 1;
+    }
+    entry->task->state = TASK_BLOCKED;
+    spinlock_release_irqrestore(&wq->lock, rflags);
+}
+
+static void finish_wait(wait_queue_t *wq, wait_entry_t *entry)
+{
+    entry->task->state = TASK_RUNNING;
+    if (!wq)
+        return;
+    // Taken even if a waker already unlinked us: it may still be using entry->task
+    uint64_t rflags = spinlock_acquire_irqsave(&wq->lock);
+    if (entry->queued)
+        wq_remove(wq, entry);
+    spinlock_release_irqrestore(&wq->lock, rflags);
+}
+
+/* Nothing to switch to: wait for the next interrupt */
+static void halt_once(void)
+{
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0" : "=r"(rflags));
+    if (rflags & 0x200)
+        __asm__ volatile("hlt");
+    else
+        __asm__ volatile("pause");
+}
+
+int wait_until(wait_queue_t *wq, int (*cond)(void *arg), void *arg, uint32_t timeout_ms)
+{
+    if (cond(arg))
+        return 0;
+    uint64_t deadline = timeout_ms ? rtc_get_ticks() + rtc_ms_to_ticks(timeout_ms) : 0;
+
+    if (!sched_can_block())
+    {
+        while (!cond(arg))
+        {
+            if (deadline && rtc_get_ticks() >= deadline)
+                return -1;
+            halt_once();
+        }
+        return 0;
+    }
+
+    wait_entry_t entry = {.task = sched_current_task()};
+    rtc_timer_t timer = {.task = entry.task};
+    if (deadline)
+        rtc_timer_start(&timer, deadline);
+
+    int ret = 0;
+    for (;;)
+    {
+        prepare_to_wait(wq, &entry);
+        if (cond(arg))
+            break;
+        if (deadline && rtc_get_ticks() >= deadline)
+        {
+            ret = -1;
+            break;
+        }
+        sched_yield();
+    }
+    finish_wait(wq, &entry);
+    if (deadline)
+        rtc_timer_cancel(&timer);
+    return ret;
+}
+
+void wake_up(wait_queue_t *wq)
+{
+    uint64_t rflags = spinlock_acquire_irqsave(&wq->lock);
+    wait_entry_t *entry = wq->head;
+    if (entry)
+    {
+        wq_remove(wq, entry);
+        sched_wake(entry->task);
+    }
+    spinlock_release_irqrestore(&wq->lock, rflags);
+}
+
+void wake_up_all(wait_queue_t *wq)
+{
+    uint64_t rflags = spinlock_acquire_irqsave(&wq->lock);
+    while (wq->head)
+    {
+        wait_entry_t *entry = wq->head;
+        wq_remove(wq, entry);
+        sched_wake(entry->task);
+    }
+    spinlock_release_irqrestore(&wq->lock, rflags);
+}
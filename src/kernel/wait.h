@@ -0,0 +1,39 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stdint.h>
+#include "sched.h"
+#include "../libk/spinlock.h"
+
+/*
+ * Wait queues: a task that has nothing to do until some condition holds
+ * sleeps as TASK_BLOCKED on the queue and takes no CPU time. Whoever makes
+ * the condition true calls wake_up()/wake_up_all() on the queue afterwards.
+ */
+
+// One sleeping task; lives on the sleeper's stack
+typedef struct wait_entry
+{
+    task_t *task;
+    int queued;
+    struct wait_entry *next, *prev;
+} wait_entry_t;
+
+typedef struct
+{
+    spinlock_t lock;
+    wait_entry_t *head, *tail;
+} wait_queue_t;
+
+void wait_queue_init(wait_queue_t *wq);
+
+// Sleep until cond(arg) holds, or timeout_ms passes (0 waits forever).
+// Returns 0 once the condition holds, -1 on timeout. wq may be NULL to
+// sleep on the timeout alone. Outside a task (boot, idle) it halts instead.
+int wait_until(wait_queue_t *wq, int (*cond)(void *arg), void *arg, uint32_t timeout_ms);
+
+// Wake the longest sleeper, or every sleeper. Safe from interrupt handlers.
+void wake_up(wait_queue_t *wq);
+void wake_up_all(wait_queue_t *wq);
+
+#endif
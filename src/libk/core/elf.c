@@ -3,6 +3,77 @@
 #include "../debug/log.h"
 #include "../../drv/vga.h"
 #include "mem.h"
+#include "pagecache.h"
+
+/*
+ * Program images are mapped out of the page cache. A page of the image
+ * that is a whole file page of its segments (same page offset in the file
+ * and in memory, no bss in it) is the cached page itself: read-only for
+ * text, copy-on-write for data. Every instance of a program shares those
+ * pages with the cache, so a relaunch costs neither a disk read nor a copy.
+ * Pages that straddle a segment's file end or a misaligned segment get a
+ * private copy.
+ */
+
+/*
+ * How the image page at virt is backed: returns the page-cache index of the
+ * file page that can be mapped as is, or -1 if it needs a private copy.
+ * writable is set if any segment touching the page is.
+ */
+static int64_t image_page(elf64_phdr_t *phdrs, int count, uint64_t virt, int *writable)
+{
+    int64_t index = -1;
+    int touched = 0;
+    *writable = 0;
+    for (int i = 0; i < count; i++)
+    {
+        elf64_phdr_t *ph = &phdrs[i];
+        if (ph->p_type != PT_LOAD)
+            continue;
+        uint64_t start = virt > ph->p_vaddr ? virt : ph->p_vaddr;
+        uint64_t end = virt + PAGE_SIZE < ph->p_vaddr + ph->p_memsz ? virt + PAGE_SIZE : ph->p_vaddr + ph->p_memsz;
+        if (start >= end)
+            continue;
+        if (ph->p_flags & PF_W)
+            *writable = 1;
+
+        // Congruent offsets put the page's bytes at the same spot of one file page
+        int64_t page = (ph->p_offset - ph->p_vaddr) % PAGE_SIZE ? -1 : (int64_t)((virt + ph->p_offset - ph->p_vaddr) / PAGE_SIZE);
+        if (end > ph->p_vaddr + ph->p_filesz || page < 0 || (touched && page != index))
+            index = -2;
+        else if (index != -2)
+            index = page;
+        touched = 1;
+    }
+    return index < 0 ? -1 : index;
+}
+
+/* Copy the file bytes of every segment overlapping the page at virt into dest. */
+static int fill_image_page(int entry, elf64_phdr_t *phdrs, int count, uint64_t virt, uint8_t *dest)
+{
+    for (int i = 0; i < count; i++)
+    {
+        elf64_phdr_t *ph = &phdrs[i];
+        if (ph->p_type != PT_LOAD)
+            continue;
+        uint64_t from = virt > ph->p_vaddr ? virt : ph->p_vaddr;
+        uint64_t to = virt + PAGE_SIZE < ph->p_vaddr + ph->p_filesz ? virt + PAGE_SIZE : ph->p_vaddr + ph->p_filesz;
+        while (from < to)
+        {
+            uint64_t file_off = ph->p_offset + (from - ph->p_vaddr);
+            uint64_t chunk = PAGE_SIZE - file_off % PAGE_SIZE;
+            if (chunk > to - from)
+                chunk = to - from;
+            uint64_t phys = pcache_get(entry, file_off / PAGE_SIZE);
+            if (!phys)
+                return -1;
+            memcpy(dest + (from - virt), (uint8_t *)(phys + KERNEL_VIRT_OFFSET) + file_off % PAGE_SIZE, chunk);
+            put_page(phys);
+            from += chunk;
+        }
+    }
+    return 0;
+}
 
 int elf_exec(const char *filename, int argc, char **argv)
 {
@@ -12,112 +83,126 @@ int elf_exec(const char *filename, int argc, char **argv)
     if (zfs_open(filename, &file) != ZFS_OK)
         return -1;
     
-    uint8_t *elf_data = (uint8_t *)kmalloc(file.size);
-    if (!elf_data)
+    // Only the headers are read here; the segments come straight from the page cache
+    elf64_ehdr_t ehdr;
+    uint32_t bytes_read;
+    if (zfs_read(&file, &ehdr, sizeof(ehdr), &bytes_read) != ZFS_OK || bytes_read != sizeof(ehdr))
     {
         zfs_close(&file);
         return -1;
     }
     
-    uint32_t bytes_read;
-    if (zfs_read(&file, elf_data, file.size, &bytes_read) != ZFS_OK)
+    if (ehdr.e_ident[0] != 0x7F || ehdr.e_ident[1] != 'E' ||
+        ehdr.e_ident[2] != 'L' || ehdr.e_ident[3] != 'F')
     {
-        kfree(elf_data);
         zfs_close(&file);
         return -1;
     }
-    zfs_close(&file);
     
-    elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elf_data;
-    if (ehdr->e_ident[0] != 0x7F || ehdr->e_ident[1] != 'E' ||
-        ehdr->e_ident[2] != 'L' || ehdr->e_ident[3] != 'F')
+    if (ehdr.e_ident[4] != ELF_CLASS_64 || ehdr.e_phentsize != sizeof(elf64_phdr_t) || !ehdr.e_phnum)
     {
-        kfree(elf_data);
+        zfs_close(&file);
         return -1;
     }
     
-    if (ehdr->e_ident[4] != ELF_CLASS_64)
+    uint32_t phdrs_size = ehdr.e_phnum * sizeof(elf64_phdr_t);
+    elf64_phdr_t *phdrs = (elf64_phdr_t *)kmalloc(phdrs_size);
+    if (!phdrs)
     {
-        kfree(elf_data);
+        zfs_close(&file);
         return -1;
     }
-    
-    page_table_t *pml4 = clone_page_directory(get_kernel_pml4());
-    if (!pml4)
+    if (zfs_seek(&file, ehdr.e_phoff) != ZFS_OK ||
+        zfs_read(&file, phdrs, phdrs_size, &bytes_read) != ZFS_OK || bytes_read != phdrs_size)
     {
-        kfree(elf_data);
+        kfree(phdrs);
+        zfs_close(&file);
         return -1;
     }
+    int entry = file.entry_index;
+    uint32_t generation = file.generation;
+    uint32_t file_size = file.size;
+    zfs_close(&file);
     
     uint64_t min_addr = 0xFFFFFFFFFFFFFFFF;
     uint64_t max_addr = 0;
-    for (int i = 0; i < ehdr->e_phnum; i++)
+    for (int i = 0; i < ehdr.e_phnum; i++)
     {
-        elf64_phdr_t *phdr = (elf64_phdr_t *)(elf_data + ehdr->e_phoff + i * ehdr->e_phentsize);
+        elf64_phdr_t *phdr = &phdrs[i];
         if (phdr->p_type == PT_LOAD)
         {
+            if (phdr->p_offset + phdr->p_filesz > file_size || phdr->p_filesz > phdr->p_memsz)
+            {
+                kfree(phdrs);
+                return -1;
+            }
             if (phdr->p_vaddr < min_addr) min_addr = phdr->p_vaddr;
             if (phdr->p_vaddr + phdr->p_memsz > max_addr) max_addr = phdr->p_vaddr + phdr->p_memsz;
         }
     }
+    if (max_addr <= min_addr)
+    {
+        kfree(phdrs);
+        return -1;
+    }
     
-    uint64_t total_size = max_addr - min_addr;
-    size_t pages = (total_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    uint64_t user_virt = min_addr;
+    page_table_t *pml4 = clone_page_directory(get_kernel_pml4());
+    if (!pml4)
+    {
+        kfree(phdrs);
+        return -1;
+    }
     
-    for (size_t i = 0; i < pages; i++)
+    uint64_t image_start = min_addr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t image_end = (max_addr + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    for (uint64_t virt = image_start; virt < image_end; virt += PAGE_SIZE)
     {
-        uint64_t phys = alloc_page();
-        if (!phys)
+        int writable;
+        int64_t index = image_page(phdrs, ehdr.e_phnum, virt, &writable);
+        uint64_t phys;
+        uint64_t flags = PAGE_PRESENT | PAGE_USER;
+        if (index >= 0)
+        {
+            // The mapping keeps the reference pcache_get() took
+            phys = pcache_get(entry, index);
+            if (writable)
+                flags |= PAGE_COW;
+        }
+        else
         {
-            for (size_t j = 0; j < i; j++)
+            phys = alloc_zeroed_page();
+            if (phys && fill_image_page(entry, phdrs, ehdr.e_phnum, virt, (uint8_t *)(phys + KERNEL_VIRT_OFFSET)))
             {
-                uint64_t p = virt_to_phys(pml4, user_virt + j * PAGE_SIZE);
-                if (p) free_page(p);
-                unmap_page(pml4, user_virt + j * PAGE_SIZE);
+                free_page(phys);
+                phys = 0;
             }
-            free_page_directory(pml4);
-            kfree(elf_data);
+            if (writable)
+                flags |= PAGE_WRITABLE;
+        }
+        if (!phys)
+        {
+            free_task_address_space(pml4);
+            kfree(phdrs);
             return -1;
         }
-        map_page(pml4, user_virt + i * PAGE_SIZE, phys, PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE);
-        uint64_t kern_addr = phys + KERNEL_VIRT_OFFSET;
-        memset((void*)kern_addr, 0, PAGE_SIZE);
+        map_page(pml4, virt, phys, flags);
     }
-    
-    for (int i = 0; i < ehdr->e_phnum; i++)
+    // Deleted under us: the entry's pages may already be another file's
+    if (zfs_entry_generation(entry) != generation)
     {
-        elf64_phdr_t *phdr = (elf64_phdr_t *)(elf_data + ehdr->e_phoff + i * ehdr->e_phentsize);
-        if (phdr->p_type == PT_LOAD)
-        {
-            for (size_t offset = 0; offset < phdr->p_filesz; offset++)
-            {
-                uint64_t vaddr = phdr->p_vaddr + offset;
-                uint64_t phys = virt_to_phys(pml4, vaddr);
-                if (!phys) continue;
-                
-                uint8_t *dest = (uint8_t*)(phys + KERNEL_VIRT_OFFSET);
-                uint8_t byte = elf_data[phdr->p_offset + offset];
-                *dest = byte;
-            }
-        }
+        free_task_address_space(pml4);
+        kfree(phdrs);
+        return -1;
     }
     
-    __asm__ volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
-    uint64_t entry_point = ehdr->e_entry;
-    kfree(elf_data);
+    uint64_t entry_point = ehdr.e_entry;
+    kfree(phdrs);
     
-    task_t *task = task_create_user((void(*)(void))entry_point, filename, pml4);
+    task_t *task = task_create_user((void(*)(void))entry_point, filename, pml4, image_start, image_end);
     if (!task)
     {
-        for (size_t i = 0; i < pages; i++)
-        {
-            uint64_t phys = virt_to_phys(pml4, user_virt + i * PAGE_SIZE);
-            if (phys) free_page(phys);
-            unmap_page(pml4, user_virt + i * PAGE_SIZE);
-        }
-        free_page_directory(pml4);
+        free_task_address_space(pml4);
         return -1;
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,165 +1,420 @@
 #include "mem.h"
+#include "slab.h"
+#include "tlb.h"
 #include "../debug/log.h"
+#include "../debug/memprof.h"
 #include "../debug/serial.h"
 #include "../string.h"
 #include "../limine.h"
 #include "../spinlock.h"
+#include "../../cpu/smp.h"
 
 static spinlock_t heap_lock;
-static spinlock_t pmm_lock;
 
-static uint8_t *pmm_bitmap = NULL;
+/*
+ * Physical memory is managed by binary buddy allocators, one per usable
+ * Limine memory map region. Blocks of order n span 2^n pages and are
+ * naturally aligned on their physical frame number, so the buddy of a block
+ * is found by flipping bit n of its frame number. Free blocks are threaded
+ * onto per-order doubly linked lists through the HHDM mapping of the block
+ * itself; the only side metadata is one byte per page of the region, which
+ * is non-zero only for the first page of a free block, and a 16-bit share
+ * count per page for copy-on-write. That metadata is carved from the start
+ * of the region it describes, so holes in the memory map cost nothing.
+ *
+ * Regions are grouped into zones: DMA32 for memory below 4 GiB, NORMAL for
+ * everything above. Each zone has its own lock.
+ */
+#define PMM_MAX_ORDER   14
+#define PMM_FREE_HEAD   0x80
+#define PMM_MAX_REGIONS 64
+#define ZONE_DMA32_LIMIT 0x100000000ULL
+#define HUGE_PAGE_ORDER 9
+
+typedef struct free_block
+{
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+typedef struct
+{
+    uint64_t base_pfn;
+    uint64_t end_pfn;
+    uint8_t *meta;
+    uint16_t *refs;     // extra mappings of each page beyond the first
+    free_block_t *free_lists[PMM_MAX_ORDER + 1];
+    uint64_t free_block_count[PMM_MAX_ORDER + 1];
+    uint64_t free_pages;
+    mem_zone_t zone;
+} pmm_region_t;
+
+typedef struct
+{
+    spinlock_t lock;
+    const char *name;
+    uint32_t first_region;
+    uint32_t region_count;
+    uint64_t total_pages;
+    uint64_t free_pages;
+} pmm_zone_t;
+
+static pmm_region_t pmm_regions[PMM_MAX_REGIONS];
+static uint32_t pmm_region_count = 0;
+static pmm_zone_t pmm_zones[ZONE_COUNT] = {
+    [ZONE_DMA32] = {.name = "DMA32"},
+    [ZONE_NORMAL] = {.name = "Normal"},
+};
+static int pmm_ready = 0;
 static uint64_t total_pages = 0;
-static uint64_t used_pages = 0;
-static uint64_t bitmap_size = 0;
 
-static uint64_t memory_base = 0;
-static uint64_t memory_top = 0;
+/*
+ * Kernel heap for requests the slabs don't take. Every block carries a
+ * boundary tag at both ends: a 16 byte header (size with the free bit, and a
+ * magic) and an 8 byte footer repeating the size word, so both neighbours of
+ * a block can be found in constant time when it is freed. Free blocks are
+ * kept on segregated, doubly linked lists binned by power-of-two size, and a
+ * bitmap of non-empty bins lets kmalloc skip straight to a list that can
+ * satisfy the request. An allocated prologue and a zero-sized epilogue bound
+ * the heap so coalescing never has to check for its edges.
+ */
+#define HEAP_HDR_SIZE   16
+#define HEAP_FTR_SIZE   8
+#define HEAP_ALIGN      16
+#define HEAP_MIN_BLOCK  48
+#define HEAP_BINS       32
+#define HEAP_FREE       1ULL
+#define HEAP_MAGIC      0x4B48454150544147ULL
+
+/*
+ * The heap lives in its own window at the bottom of the vmalloc area and is
+ * backed by discontiguous pages. It starts at 4 MiB, grows in 1 MiB chunks
+ * when no free block fits, and gives chunks back once the free block at its
+ * tail exceeds 4 MiB.
+ */
+#define KHEAP_INITIAL_SIZE  (4 * 1024 * 1024)
+#define KHEAP_CHUNK         (1024 * 1024)
+#define KHEAP_TRIM_SIZE     (4 * 1024 * 1024)
 
-typedef struct header
+typedef struct heap_block
 {
-    size_t size;
-    int free;
-    struct header *next;
-} header_t;
+    size_t size;                    // whole block including tags, low bit set when free
+    uint64_t magic;
+    struct heap_block *next_free;   // only valid while the block is free
+    struct heap_block *prev_free;
+} heap_block_t;
 
-#define HEADER_SIZE sizeof(header_t)
-static header_t *heap_start = NULL;
+static heap_block_t *heap_bins[HEAP_BINS];
+static uint32_t heap_bin_map = 0;
+static uint8_t *heap_start = NULL;
+static uint8_t *heap_end = NULL;
 
 static page_table_t *kernel_pml4 = NULL;
 
+/*
+ * Per-CPU page caches sit in front of the buddy allocators for single pages.
+ * Each cache is a ring: recently freed (cache-hot) pages are pushed and
+ * popped at the head, while refills from the buddy allocators and cold frees
+ * go to the tail, which is also where batches are drained from. Caches are
+ * only touched with interrupts disabled on the owning CPU, so they need no
+ * lock; zone locks are taken once per batch.
+ */
+#define PCP_CAPACITY 64
+#define PCP_HIGH     48     // drain a batch once this full
+#define PCP_LOW      8      // refill a batch once this empty, keeping hot pages at the head
+#define PCP_BATCH    16
+
+typedef struct
+{
+    uint64_t pages[PCP_CAPACITY];
+    uint32_t head;
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t drains;
+} pcp_cache_t;
+
+static pcp_cache_t pcp_caches[MAX_CPUS];
+static volatile uint64_t pcp_cached_pages = 0;
+
+/*
+ * Pool of pre-zeroed pages. Idle APs keep it topped up from ap_main() so
+ * exec and page-table allocation don't have to clear pages synchronously.
+ * Refilling starts once the pool drops below the low watermark and runs
+ * until it is full again.
+ */
+#define ZERO_POOL_SIZE 256
+#define ZERO_POOL_LOW  64
+
+static uint64_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+static volatile int zero_pool_refilling = 1;
+static spinlock_t zero_pool_lock;
+static uint64_t zero_pool_hits = 0;
+static uint64_t zero_pool_misses = 0;
+
 static volatile struct limine_memmap_request memmap_request = {
     .id = LIMINE_MEMMAP_REQUEST,
     .revision = 0};
 
-static void set_bit(uint64_t bit)
+static free_block_t *pfn_to_block(uint64_t pfn)
 {
-    pmm_bitmap[bit / 8] |= (1 << (bit % 8));
+    return (free_block_t *)((pfn * PAGE_SIZE) + KERNEL_VIRT_OFFSET);
 }
 
-static void clear_bit(uint64_t bit)
+static uint64_t block_to_pfn(free_block_t *block)
 {
-    pmm_bitmap[bit / 8] &= ~(1 << (bit % 8));
+    return ((uint64_t)block - KERNEL_VIRT_OFFSET) / PAGE_SIZE;
 }
 
-static int test_bit(uint64_t bit)
+static pmm_region_t *pfn_to_region(uint64_t pfn)
 {
-    return pmm_bitmap[bit / 8] & (1 << (bit % 8));
+    uint32_t lo = 0, hi = pmm_region_count;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        pmm_region_t *region = &pmm_regions[mid];
+        if (pfn < region->base_pfn)
+            hi = mid;
+        else if (pfn >= region->end_pfn)
+            lo = mid + 1;
+        else
+            return region;
+    }
+    return NULL;
 }
 
-static uint64_t find_free_pages(size_t count)
+static void free_list_push(pmm_region_t *region, uint64_t pfn, unsigned order)
 {
-    if (count == 1)
+    free_block_t *block = pfn_to_block(pfn);
+    block->prev = NULL;
+    block->next = region->free_lists[order];
+    if (region->free_lists[order])
+        region->free_lists[order]->prev = block;
+    region->free_lists[order] = block;
+    region->free_block_count[order]++;
+    region->meta[pfn - region->base_pfn] = PMM_FREE_HEAD | order;
+}
+
+static void free_list_remove(pmm_region_t *region, uint64_t pfn, unsigned order)
+{
+    free_block_t *block = pfn_to_block(pfn);
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        region->free_lists[order] = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    region->free_block_count[order]--;
+    region->meta[pfn - region->base_pfn] = 0;
+}
+
+static int is_free_head(pmm_region_t *region, uint64_t pfn, unsigned order)
+{
+    if (pfn < region->base_pfn || pfn + (1ULL << order) > region->end_pfn)
+        return 0;
+    return region->meta[pfn - region->base_pfn] == (PMM_FREE_HEAD | order);
+}
+
+static unsigned order_for_count(size_t count)
+{
+    unsigned order = 0;
+    while ((1ULL << order) < count)
+        order++;
+    return order;
+}
+
+/* Insert a naturally aligned block and merge it with its buddies. */
+static void buddy_free_block(pmm_region_t *region, uint64_t pfn, unsigned order)
+{
+    region->free_pages += 1ULL << order;
+    while (order < PMM_MAX_ORDER)
     {
-        for (uint64_t i = 0; i < total_pages; i++)
-        {
-            if (!test_bit(i))
-            {
-                return i;
-            }
-        }
+        uint64_t buddy = pfn ^ (1ULL << order);
+        if (!is_free_head(region, buddy, order))
+            break;
+        free_list_remove(region, buddy, order);
+        pfn &= ~(1ULL << order);
+        order++;
     }
-    else
+    free_list_push(region, pfn, order);
+}
+
+/* Pop the smallest block that satisfies order, splitting off the upper halves. */
+static uint64_t buddy_alloc_block(pmm_region_t *region, unsigned order)
+{
+    unsigned o = order;
+    while (o <= PMM_MAX_ORDER && !region->free_lists[o])
+        o++;
+    if (o > PMM_MAX_ORDER)
+        return UINT64_MAX;
+
+    uint64_t pfn = block_to_pfn(region->free_lists[o]);
+    free_list_remove(region, pfn, o);
+    while (o > order)
     {
-        for (uint64_t i = 0; i <= total_pages - count; i++)
-        {
-            int found = 1;
-            for (size_t j = 0; j < count; j++)
-            {
-                if (test_bit(i + j))
-                {
-                    found = 0;
-                    break;
-                }
-            }
-            if (found)
-            {
-                return i;
-            }
-        }
+        o--;
+        free_list_push(region, pfn + (1ULL << o), o);
     }
-    return UINT64_MAX;
+    region->free_pages -= 1ULL << order;
+    return pfn;
 }
 
-void init_pmm(void)
+/* Return an arbitrary page range to the free lists as maximal aligned blocks. */
+static void buddy_free_range(pmm_region_t *region, uint64_t pfn, uint64_t count)
 {
-    struct limine_memmap_response *memmap = memmap_request.response;
-    if (!memmap)
+    while (count)
     {
-        serial_write_string("\x1b[38;2;255;50;50m[0ms][mem.c:???]- Failed to get memory map!\n");
-        return;
+        unsigned order = 0;
+        while (order < PMM_MAX_ORDER &&
+               !(pfn & ((2ULL << order) - 1)) &&
+               (2ULL << order) <= count)
+            order++;
+        buddy_free_block(region, pfn, order);
+        pfn += 1ULL << order;
+        count -= 1ULL << order;
     }
-    memory_base = UINT64_MAX;
-    memory_top = 0;
+}
 
-    for (size_t i = 0; i < memmap->entry_count; i++)
+/*
+ * Fallback for runs larger than the biggest block, or when no naturally
+ * aligned block is left: walk the free blocks in address order looking for
+ * count contiguous free pages, then carve the run out of them.
+ */
+static uint64_t buddy_alloc_contig(pmm_region_t *region, size_t count)
+{
+    if (region->free_pages < count)
+        return UINT64_MAX;
+
+    uint64_t run_start = region->base_pfn;
+    uint64_t pfn = region->base_pfn;
+    while (pfn < region->end_pfn)
     {
-        struct limine_memmap_entry *entry = memmap->entries[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE)
+        uint8_t meta = region->meta[pfn - region->base_pfn];
+        if (!(meta & PMM_FREE_HEAD))
         {
-            if (entry->base < memory_base)
-            {
-                memory_base = entry->base;
-            }
-            if (entry->base + entry->length > memory_top)
-            {
-                memory_top = entry->base + entry->length;
-            }
+            pfn++;
+            run_start = pfn;
+            continue;
         }
+        pfn += 1ULL << (meta & ~PMM_FREE_HEAD);
+        if (pfn - run_start >= count)
+            break;
     }
-    total_pages = (memory_top - memory_base) / PAGE_SIZE;
-    bitmap_size = (total_pages + 7) / 8;
-    uint64_t bitmap_phys = 0;
-    for (size_t i = 0; i < memmap->entry_count; i++)
+    if (pfn - run_start < count || run_start + count > region->end_pfn)
+        return UINT64_MAX;
+
+    uint64_t run_end = run_start + count;
+    pfn = run_start;
+    while (pfn < run_end)
     {
-        struct limine_memmap_entry *entry = memmap->entries[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= bitmap_size)
+        unsigned order = region->meta[pfn - region->base_pfn] & ~PMM_FREE_HEAD;
+        uint64_t block_end = pfn + (1ULL << order);
+        free_list_remove(region, pfn, order);
+        region->free_pages -= 1ULL << order;
+        if (block_end > run_end)
+            buddy_free_range(region, run_end, block_end - run_end);
+        pfn = block_end;
+    }
+    return run_start;
+}
+
+/* Allocate count contiguous pages from one zone. Caller holds the zone lock. */
+static uint64_t zone_alloc(pmm_zone_t *zone, size_t count)
+{
+    if (zone->free_pages < count)
+        return UINT64_MAX;
+
+    unsigned order = order_for_count(count);
+    uint64_t pfn = UINT64_MAX;
+    pmm_region_t *region = NULL;
+    if (order <= PMM_MAX_ORDER)
+    {
+        for (uint32_t i = 0; i < zone->region_count && pfn == UINT64_MAX; i++)
         {
-            bitmap_phys = entry->base;
-            break;
+            region = &pmm_regions[zone->first_region + i];
+            pfn = buddy_alloc_block(region, order);
         }
+        if (pfn != UINT64_MAX && (1ULL << order) > count)
+            buddy_free_range(region, pfn + count, (1ULL << order) - count);
+    }
+    for (uint32_t i = 0; i < zone->region_count && pfn == UINT64_MAX; i++)
+        pfn = buddy_alloc_contig(&pmm_regions[zone->first_region + i], count);
+    if (pfn != UINT64_MAX)
+        zone->free_pages -= count;
+    return pfn;
+}
+
+static void pmm_add_region(uint64_t base, uint64_t end)
+{
+    base = (base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    end &= ~(uint64_t)(PAGE_SIZE - 1);
+    if (end <= base)
+        return;
+    if (base < ZONE_DMA32_LIMIT && end > ZONE_DMA32_LIMIT)
+    {
+        pmm_add_region(base, ZONE_DMA32_LIMIT);
+        pmm_add_region(ZONE_DMA32_LIMIT, end);
+        return;
     }
-    if (!bitmap_phys)
+    if (pmm_region_count == PMM_MAX_REGIONS)
     {
-        serial_write_string("\x1b[38;2;255;50;50m[0ms][mem.c:???]- Can't find space for bitmap!\n");
+        serial_write_string("\x1b[38;2;255;50;50m[0ms][mem.c:???]- Too many memory regions, ignoring the rest.\n");
         return;
     }
-    pmm_bitmap = (uint8_t *)(bitmap_phys + KERNEL_VIRT_OFFSET);
-    for (uint64_t i = 0; i < bitmap_size; i++)
+
+    uint64_t pages = (end - base) / PAGE_SIZE;
+    uint64_t refs_offset = (pages + 1) & ~1ULL;
+    uint64_t meta_pages = (refs_offset + pages * sizeof(uint16_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages <= meta_pages)
+        return;
+
+    pmm_region_t *region = &pmm_regions[pmm_region_count++];
+    memset(region, 0, sizeof(pmm_region_t));
+    region->base_pfn = base / PAGE_SIZE;
+    region->end_pfn = end / PAGE_SIZE;
+    region->meta = (uint8_t *)(base + KERNEL_VIRT_OFFSET);
+    region->zone = base < ZONE_DMA32_LIMIT ? ZONE_DMA32 : ZONE_NORMAL;
+    region->refs = (uint16_t *)(region->meta + refs_offset);
+    memset(region->meta, 0, meta_pages * PAGE_SIZE);
+    buddy_free_range(region, region->base_pfn + meta_pages, pages - meta_pages);
+
+    pmm_zone_t *zone = &pmm_zones[region->zone];
+    if (!zone->region_count)
+        zone->first_region = pmm_region_count - 1;
+    zone->region_count++;
+    zone->total_pages += pages;
+    zone->free_pages += region->free_pages;
+    total_pages += pages;
+}
+
+void init_pmm(void)
+{
+    struct limine_memmap_response *memmap = memmap_request.response;
+    if (!memmap)
     {
-        pmm_bitmap[i] = 0xFF;
+        serial_write_string("\x1b[38;2;255;50;50m[0ms][mem.c:???]- Failed to get memory map!\n");
+        return;
     }
-    used_pages = total_pages;
+
+    // Limine sorts the map by base address, so regions (and zones) come out sorted.
     for (size_t i = 0; i < memmap->entry_count; i++)
     {
         struct limine_memmap_entry *entry = memmap->entries[i];
         if (entry->type == LIMINE_MEMMAP_USABLE)
         {
-            uint64_t start_page = (entry->base - memory_base) / PAGE_SIZE;
-            uint64_t page_count = entry->length / PAGE_SIZE;
-
-            for (uint64_t j = 0; j < page_count; j++)
-            {
-                if (start_page + j < total_pages)
-                {
-                    clear_bit(start_page + j);
-                    used_pages--;
-                }
-            }
+            pmm_add_region(entry->base, entry->base + entry->length);
         }
     }
-    uint64_t bitmap_start_page = (bitmap_phys - memory_base) / PAGE_SIZE;
-    uint64_t bitmap_pages = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-
-    for (uint64_t i = 0; i < bitmap_pages; i++)
+    if (!pmm_region_count)
     {
-        if (bitmap_start_page + i < total_pages && !test_bit(bitmap_start_page + i))
-        {
-            set_bit(bitmap_start_page + i);
-            used_pages++;
-        }
+        serial_write_string("\x1b[38;2;255;50;50m[0ms][mem.c:???]- No usable memory found!\n");
+        return;
     }
-    spinlock_init(&pmm_lock);
+    for (int z = 0; z < ZONE_COUNT; z++)
+        spinlock_init(&pmm_zones[z].lock);
+    spinlock_init(&zero_pool_lock);
+    pmm_ready = 1;
     
     uint64_t total_mem = get_total_memory();
     total_mem += 1024*1024; // account for the minor difference
@@ -172,354 +427,1656 @@ void init_pmm(void)
         __asm__ __volatile__("cli");
         for (;;) __asm__ __volatile__("hlt");
     }
-    
-    serial_write_string("[0ms][mem.c:???]- PMM Initialized successfully\n");
+    
+    serial_write_string("[0ms][mem.c:???]- PMM Initialized successfully\n");
+}
+
+static uint64_t local_irq_save(void)
+{
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    return rflags;
+}
+
+static void local_irq_restore(uint64_t rflags)
+{
+    if (rflags & 0x200)
+        __asm__ volatile("sti" : : : "memory");
+}
+
+static void pcp_push_hot(pcp_cache_t *pcp, uint64_t pfn)
+{
+    pcp->head = (pcp->head + PCP_CAPACITY - 1) % PCP_CAPACITY;
+    pcp->pages[pcp->head] = pfn;
+    pcp->count++;
+}
+
+static void pcp_push_cold(pcp_cache_t *pcp, uint64_t pfn)
+{
+    pcp->pages[(pcp->head + pcp->count) % PCP_CAPACITY] = pfn;
+    pcp->count++;
+}
+
+static uint64_t pcp_pop_hot(pcp_cache_t *pcp)
+{
+    uint64_t pfn = pcp->pages[pcp->head];
+    pcp->head = (pcp->head + 1) % PCP_CAPACITY;
+    pcp->count--;
+    return pfn;
+}
+
+static uint64_t pcp_pop_cold(pcp_cache_t *pcp)
+{
+    pcp->count--;
+    return pcp->pages[(pcp->head + pcp->count) % PCP_CAPACITY];
+}
+
+static void pcp_refill(pcp_cache_t *pcp)
+{
+    uint32_t added = 0;
+    for (int z = ZONE_NORMAL; z >= ZONE_DMA32 && added < PCP_BATCH; z--)
+    {
+        pmm_zone_t *zone = &pmm_zones[z];
+        spinlock_acquire(&zone->lock);
+        while (added < PCP_BATCH && pcp->count < PCP_CAPACITY)
+        {
+            uint64_t pfn = zone_alloc(zone, 1);
+            if (pfn == UINT64_MAX)
+                break;
+            pcp_push_cold(pcp, pfn);
+            added++;
+        }
+        spinlock_release(&zone->lock);
+    }
+    __atomic_add_fetch(&pcp_cached_pages, added, __ATOMIC_RELAXED);
+}
+
+static void pcp_drain(pcp_cache_t *pcp, uint32_t batch)
+{
+    uint32_t removed = 0;
+    pmm_zone_t *locked = NULL;
+    while (removed < batch && pcp->count)
+    {
+        uint64_t pfn = pcp_pop_cold(pcp);
+        pmm_region_t *region = pfn_to_region(pfn);
+        pmm_zone_t *zone = &pmm_zones[region->zone];
+        if (zone != locked)
+        {
+            if (locked)
+                spinlock_release(&locked->lock);
+            spinlock_acquire(&zone->lock);
+            locked = zone;
+        }
+        buddy_free_block(region, pfn, 0);
+        zone->free_pages++;
+        removed++;
+    }
+    if (locked)
+        spinlock_release(&locked->lock);
+    __atomic_sub_fetch(&pcp_cached_pages, removed, __ATOMIC_RELAXED);
+    pcp->drains++;
+}
+
+static void pcp_free(uint64_t addr, int cold)
+{
+    if (!pmm_ready || !pfn_to_region(addr / PAGE_SIZE))
+        return;
+
+    uint64_t rflags = local_irq_save();
+    pcp_cache_t *pcp = &pcp_caches[smp_cpu_id()];
+    if (pcp->count == PCP_CAPACITY)
+        pcp_drain(pcp, PCP_BATCH);
+    if (cold)
+        pcp_push_cold(pcp, addr / PAGE_SIZE);
+    else
+        pcp_push_hot(pcp, addr / PAGE_SIZE);
+    __atomic_add_fetch(&pcp_cached_pages, 1, __ATOMIC_RELAXED);
+    if (pcp->count >= PCP_HIGH)
+        pcp_drain(pcp, PCP_BATCH);
+    local_irq_restore(rflags);
+}
+
+/*
+ * The unhooked allocators. The public entry points below each report to
+ * the profiler exactly once, so pages taken and given back through
+ * different entry points still pair up.
+ */
+static uint64_t pcp_alloc(void)
+{
+    if (!pmm_ready)
+        return 0;
+
+    uint64_t rflags = local_irq_save();
+    pcp_cache_t *pcp = &pcp_caches[smp_cpu_id()];
+    if (pcp->count <= PCP_LOW)
+    {
+        pcp->misses++;
+        pcp_refill(pcp);
+        if (!pcp->count)
+        {
+            local_irq_restore(rflags);
+            return 0;
+        }
+    }
+    else
+    {
+        pcp->hits++;
+    }
+    // Refills go to the tail, so this is still the most recently freed page
+    uint64_t pfn = pcp_pop_hot(pcp);
+    __atomic_sub_fetch(&pcp_cached_pages, 1, __ATOMIC_RELAXED);
+    local_irq_restore(rflags);
+    return pfn * PAGE_SIZE;
+}
+
+static uint64_t zone_alloc_pages(size_t count, mem_zone_t zone)
+{
+    if (!pmm_ready || count == 0 || zone >= ZONE_COUNT)
+        return 0;
+
+    // Normal allocations fall back to DMA32; DMA32 allocations never leave it.
+    for (int z = zone; z >= ZONE_DMA32; z--)
+    {
+        uint64_t rflags = spinlock_acquire_irqsave(&pmm_zones[z].lock);
+        uint64_t pfn = zone_alloc(&pmm_zones[z], count);
+        spinlock_release_irqrestore(&pmm_zones[z].lock, rflags);
+        if (pfn != UINT64_MAX)
+            return pfn * PAGE_SIZE;
+    }
+    return 0;
+}
+
+uint64_t alloc_page(void)
+{
+    uint64_t addr = pcp_alloc();
+    MEMPROF_ALLOC(addr, PAGE_SIZE, MEMPROF_PAGES);
+    return addr;
+}
+
+uint64_t alloc_pages_zone(size_t count, mem_zone_t zone)
+{
+    uint64_t addr = zone_alloc_pages(count, zone);
+    MEMPROF_ALLOC(addr, count * PAGE_SIZE, MEMPROF_PAGES);
+    return addr;
+}
+
+uint64_t alloc_pages(size_t count)
+{
+    uint64_t addr = (count == 1) ? pcp_alloc() : zone_alloc_pages(count, ZONE_NORMAL);
+    MEMPROF_ALLOC(addr, count * PAGE_SIZE, MEMPROF_PAGES);
+    return addr;
+}
+
+/*
+ * Allocate a naturally aligned block of 2^order pages. Only whole buddy
+ * blocks are used, never the unaligned contiguous fallback, so the result
+ * is aligned to its own size.
+ */
+static uint64_t page_block_alloc(unsigned order)
+{
+    if (!pmm_ready || order > PMM_MAX_ORDER)
+        return 0;
+
+    for (int z = ZONE_NORMAL; z >= ZONE_DMA32; z--)
+    {
+        pmm_zone_t *zone = &pmm_zones[z];
+        uint64_t pfn = UINT64_MAX;
+        uint64_t rflags = spinlock_acquire_irqsave(&zone->lock);
+        for (uint32_t i = 0; i < zone->region_count && pfn == UINT64_MAX; i++)
+            pfn = buddy_alloc_block(&pmm_regions[zone->first_region + i], order);
+        if (pfn != UINT64_MAX)
+            zone->free_pages -= 1ULL << order;
+        spinlock_release_irqrestore(&zone->lock, rflags);
+        if (pfn != UINT64_MAX)
+            return pfn * PAGE_SIZE;
+    }
+    return 0;
+}
+
+static void pages_free(uint64_t addr, size_t count);
+
+uint64_t alloc_page_block(unsigned order)
+{
+    uint64_t addr = page_block_alloc(order);
+    MEMPROF_ALLOC(addr, PAGE_SIZE << order, MEMPROF_PAGES);
+    return addr;
+}
+
+void free_page_block(uint64_t addr, unsigned order)
+{
+    addr &= ~((PAGE_SIZE << order) - 1);
+    MEMPROF_FREE(addr, MEMPROF_PAGES);
+    pages_free(addr, 1ULL << order);
+}
+
+/* A 2 MiB page, aligned so it can back a PD-level mapping directly. */
+uint64_t alloc_huge_page(void)
+{
+    uint64_t addr = page_block_alloc(HUGE_PAGE_ORDER);
+    MEMPROF_ALLOC(addr, HUGE_PAGE_SIZE, MEMPROF_PAGES);
+    return addr;
+}
+
+void free_huge_page(uint64_t addr)
+{
+    addr &= ~(HUGE_PAGE_SIZE - 1);
+    MEMPROF_FREE(addr, MEMPROF_PAGES);
+    pages_free(addr, 1ULL << HUGE_PAGE_ORDER);
+}
+
+/*
+ * Pages mapped into more than one address space (after fork) carry a share
+ * count of the extra mappings. A page with no extra mappings has a count of
+ * zero, so freshly allocated pages need no setup.
+ */
+static uint16_t *page_refs(uint64_t addr)
+{
+    pmm_region_t *region = pfn_to_region(addr / PAGE_SIZE);
+    return region ? &region->refs[addr / PAGE_SIZE - region->base_pfn] : NULL;
+}
+
+void page_ref_get(uint64_t addr)
+{
+    uint16_t *refs = page_refs(addr);
+    if (refs)
+        __atomic_fetch_add(refs, 1, __ATOMIC_RELAXED);
+}
+
+uint32_t page_ref_count(uint64_t addr)
+{
+    uint16_t *refs = page_refs(addr);
+    return refs ? __atomic_load_n(refs, __ATOMIC_ACQUIRE) + 1 : 1;
+}
+
+/* Drop one mapping of a page; returns 1 if it was the last and the page can be freed. */
+static int page_ref_drop(uint64_t addr)
+{
+    uint16_t *refs = page_refs(addr);
+    if (!refs)
+        return 1;
+    uint16_t count = __atomic_load_n(refs, __ATOMIC_ACQUIRE);
+    do
+    {
+        if (!count)
+            return 1;
+    } while (!__atomic_compare_exchange_n(refs, &count, count - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return 0;
+}
+
+void put_page(uint64_t addr)
+{
+    if (page_ref_drop(addr))
+        free_page(addr);
+}
+
+void put_huge_page(uint64_t addr)
+{
+    if (page_ref_drop(addr))
+        free_huge_page(addr);
+}
+
+void free_page(uint64_t addr)
+{
+    MEMPROF_FREE(addr, MEMPROF_PAGES);
+    pcp_free(addr, 0);
+}
+
+void free_page_cold(uint64_t addr)
+{
+    MEMPROF_FREE(addr, MEMPROF_PAGES);
+    pcp_free(addr, 1);
+}
+
+void free_pages(uint64_t addr, size_t count)
+{
+    if (!count)
+        return;
+    MEMPROF_FREE(addr, MEMPROF_PAGES);
+    pages_free(addr, count);
+}
+
+static void pages_free(uint64_t addr, size_t count)
+{
+    if (!pmm_ready || count == 0)
+        return;
+    if (count == 1)
+    {
+        pcp_free(addr, 0);
+        return;
+    }
+    uint64_t pfn = addr / PAGE_SIZE;
+    pmm_region_t *region = pfn_to_region(pfn);
+    if (!region)
+        return;
+    if (pfn + count > region->end_pfn)
+        count = region->end_pfn - pfn;
+
+    pmm_zone_t *zone = &pmm_zones[region->zone];
+    uint64_t rflags = spinlock_acquire_irqsave(&zone->lock);
+    if (!(region->meta[pfn - region->base_pfn] & PMM_FREE_HEAD))
+    {
+        buddy_free_range(region, pfn, count);
+        zone->free_pages += count;
+    }
+    spinlock_release_irqrestore(&zone->lock, rflags);
+}
+
+void get_pcp_stats(uint32_t cpu, pcp_stats_t *stats)
+{
+    if (!stats)
+        return;
+    memset(stats, 0, sizeof(pcp_stats_t));
+    if (cpu >= MAX_CPUS)
+        return;
+    stats->hits = pcp_caches[cpu].hits;
+    stats->misses = pcp_caches[cpu].misses;
+    stats->drains = pcp_caches[cpu].drains;
+    stats->count = pcp_caches[cpu].count;
+}
+
+/* Clear a page with non-temporal stores so it doesn't evict the cache. */
+static void zero_page_nt(uint64_t phys)
+{
+    uint64_t *dst = (uint64_t *)(phys + KERNEL_VIRT_OFFSET);
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 8)
+    {
+        __asm__ volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)\n\t"
+            "movnti %1, 32(%0)\n\t"
+            "movnti %1, 40(%0)\n\t"
+            "movnti %1, 48(%0)\n\t"
+            "movnti %1, 56(%0)"
+            : : "r"(dst + i), "r"(0ULL) : "memory");
+    }
+    __asm__ volatile("sfence" : : : "memory");
+}
+
+uint64_t alloc_zeroed_page(void)
+{
+    uint64_t phys = 0;
+    // The idle loop refills with interrupts on; a fault taken with them off must not spin on it
+    uint64_t rflags = spinlock_acquire_irqsave(&zero_pool_lock);
+    if (zero_pool_count)
+    {
+        phys = zero_pool[--zero_pool_count];
+        zero_pool_hits++;
+    }
+    else
+    {
+        zero_pool_misses++;
+    }
+    if (zero_pool_count < ZERO_POOL_LOW)
+        zero_pool_refilling = 1;
+    spinlock_release_irqrestore(&zero_pool_lock, rflags);
+    if (!phys)
+    {
+        phys = pcp_alloc();
+        if (phys)
+            memset((void *)(phys + KERNEL_VIRT_OFFSET), 0, PAGE_SIZE);
+    }
+    MEMPROF_ALLOC(phys, PAGE_SIZE, MEMPROF_PAGES);
+    return phys;
+}
+
+int zero_pool_refill(void)
+{
+    if (!pmm_ready || !zero_pool_refilling)
+        return 0;
+
+    // Pool pages are reported to the profiler when alloc_zeroed_page() hands them out
+    uint64_t phys = pcp_alloc();
+    if (!phys)
+        return 0;
+    zero_page_nt(phys);
+
+    uint64_t rflags = spinlock_acquire_irqsave(&zero_pool_lock);
+    if (zero_pool_count < ZERO_POOL_SIZE)
+    {
+        zero_pool[zero_pool_count++] = phys;
+        phys = 0;
+    }
+    if (zero_pool_count == ZERO_POOL_SIZE)
+        zero_pool_refilling = 0;
+    spinlock_release_irqrestore(&zero_pool_lock, rflags);
+    if (phys)
+        pcp_free(phys, 0);
+    return 1;
+}
+
+uint64_t get_total_memory(void)
+{
+    return total_pages * PAGE_SIZE;
+}
+
+uint64_t get_free_memory(void)
+{
+    uint64_t free = pcp_cached_pages + zero_pool_count;
+    for (int z = 0; z < ZONE_COUNT; z++)
+        free += pmm_zones[z].free_pages;
+    return free * PAGE_SIZE;
+}
+
+static size_t block_size(heap_block_t *block)
+{
+    return block->size & ~(size_t)(HEAP_ALIGN - 1);
+}
+
+static int block_free(heap_block_t *block)
+{
+    return block->size & HEAP_FREE;
+}
+
+static void block_set(heap_block_t *block, size_t size, int free)
+{
+    block->size = size | (free ? HEAP_FREE : 0);
+    block->magic = HEAP_MAGIC;
+    *(size_t *)((uint8_t *)block + size - HEAP_FTR_SIZE) = block->size;
+}
+
+static heap_block_t *block_next(heap_block_t *block)
+{
+    return (heap_block_t *)((uint8_t *)block + block_size(block));
+}
+
+static heap_block_t *block_prev(heap_block_t *block)
+{
+    size_t prev_tag = *(size_t *)((uint8_t *)block - HEAP_FTR_SIZE);
+    return (heap_block_t *)((uint8_t *)block - (prev_tag & ~(size_t)(HEAP_ALIGN - 1)));
+}
+
+static unsigned heap_bin_index(size_t size)
+{
+    unsigned bin = 63 - __builtin_clzll(size);
+    bin = bin > 5 ? bin - 5 : 0;
+    return bin < HEAP_BINS ? bin : HEAP_BINS - 1;
+}
+
+static void heap_bin_insert(heap_block_t *block)
+{
+    unsigned bin = heap_bin_index(block_size(block));
+    block->prev_free = NULL;
+    block->next_free = heap_bins[bin];
+    if (heap_bins[bin])
+        heap_bins[bin]->prev_free = block;
+    heap_bins[bin] = block;
+    heap_bin_map |= 1U << bin;
+}
+
+static void heap_bin_remove(heap_block_t *block)
+{
+    unsigned bin = heap_bin_index(block_size(block));
+    if (block->prev_free)
+        block->prev_free->next_free = block->next_free;
+    else
+        heap_bins[bin] = block->next_free;
+    if (block->next_free)
+        block->next_free->prev_free = block->prev_free;
+    if (!heap_bins[bin])
+        heap_bin_map &= ~(1U << bin);
+}
+
+/* Trim an allocated block down to size, returning the tail to the free lists. */
+static void heap_split(heap_block_t *block, size_t size)
+{
+    size_t total = block_size(block);
+    if (total - size < HEAP_MIN_BLOCK)
+    {
+        block_set(block, total, 0);
+        return;
+    }
+    block_set(block, size, 0);
+    heap_block_t *rest = block_next(block);
+    block_set(rest, total - size, 1);
+
+    heap_block_t *next = block_next(rest);
+    if (block_free(next))
+    {
+        heap_bin_remove(next);
+        block_set(rest, total - size + block_size(next), 1);
+    }
+    heap_bin_insert(rest);
+}
+
+size_t get_heap_free_histogram(uint64_t *counts, uint64_t *bytes, size_t max_bins)
+{
+    size_t bins = max_bins < HEAP_BINS ? max_bins : HEAP_BINS;
+    spinlock_acquire(&heap_lock);
+    for (size_t i = 0; i < bins; i++)
+    {
+        counts[i] = bytes[i] = 0;
+        for (heap_block_t *curr = heap_bins[i]; curr; curr = curr->next_free)
+        {
+            counts[i]++;
+            bytes[i] += block_size(curr);
+        }
+    }
+    spinlock_release(&heap_lock);
+    return bins;
+}
+
+static size_t heap_block_need(size_t size)
+{
+    size_t need = (size + HEAP_HDR_SIZE + HEAP_FTR_SIZE + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+    return need < HEAP_MIN_BLOCK ? HEAP_MIN_BLOCK : need;
+}
+
+static heap_block_t *heap_find(size_t need)
+{
+    // The request's own bin holds sizes on both sides of it; every higher bin fits outright.
+    unsigned bin = heap_bin_index(need);
+    for (heap_block_t *curr = heap_bins[bin]; curr; curr = curr->next_free)
+    {
+        if (block_size(curr) >= need)
+            return curr;
+    }
+    uint32_t higher = bin + 1 < HEAP_BINS ? heap_bin_map & ~((2U << bin) - 1) : 0;
+    return higher ? heap_bins[__builtin_ctz(higher)] : NULL;
+}
+
+/*
+ * Unmapping heap pages sends a TLB shootdown and waits for every CPU. A CPU
+ * spinning on heap_lock with interrupts off would never answer it, so the
+ * range is detached under the lock and unmapped after it is dropped. Until
+ * then heap_unmap_pending is set, and the heap neither grows back over the
+ * range nor detaches another one.
+ */
+static volatile int heap_unmap_pending = 0;
+
+static void heap_unmap(uint8_t *start, size_t bytes)
+{
+    // Pages are only handed back once no CPU can still write to them
+    unmap_range(kernel_pml4, (uint64_t)start, bytes, 1);
+}
+
+/* Called without heap_lock, on a range detached by heap_grow() or heap_trim() */
+static void heap_unmap_detached(uint8_t *start, size_t bytes)
+{
+    heap_unmap(start, bytes);
+    __atomic_store_n(&heap_unmap_pending, 0, __ATOMIC_RELEASE);
+}
+
+/* Called without heap_lock; keeps answering shootdowns while it waits */
+static void heap_wait_unmap(void)
+{
+    while (__atomic_load_n(&heap_unmap_pending, __ATOMIC_ACQUIRE))
+    {
+        tlb_process_pending();
+        __asm__ volatile("pause");
+    }
+}
+
+static int heap_map(uint8_t *start, size_t bytes)
+{
+    return map_anon_range(kernel_pml4, (uint64_t)start, bytes, PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL, 0);
+}
+
+/*
+ * Extend the heap by whole chunks; the old epilogue becomes the new block's
+ * header. If mapping fails, the partial mapping is left in *undo for the
+ * caller to unmap once heap_lock is released.
+ */
+static int heap_grow(size_t need, uint8_t **undo, size_t *undo_bytes)
+{
+    size_t bytes = (need + KHEAP_CHUNK - 1) & ~(size_t)(KHEAP_CHUNK - 1);
+    if (heap_end + bytes > (uint8_t *)KHEAP_END)
+        return -1;
+    if (heap_map(heap_end, bytes))
+    {
+        heap_unmap_pending = 1;
+        *undo = heap_end;
+        *undo_bytes = bytes;
+        return -1;
+    }
+
+    heap_block_t *block = (heap_block_t *)(heap_end - HEAP_HDR_SIZE);
+    size_t size = bytes;
+    heap_end += bytes;
+    heap_block_t *prev = block_prev(block);
+    if (block_free(prev))
+    {
+        heap_bin_remove(prev);
+        size += block_size(prev);
+        block = prev;
+    }
+    block_set(block, size, 1);
+    heap_block_t *epilogue = block_next(block);
+    epilogue->size = 0;
+    epilogue->magic = HEAP_MAGIC;
+    heap_bin_insert(block);
+    return 0;
+}
+
+/*
+ * Give tail chunks back to the PMM when a free block at the end gets large.
+ * The tail is only detached here; the caller unmaps *start once it has
+ * dropped heap_lock.
+ */
+static void heap_trim(heap_block_t *block, uint8_t **start, size_t *bytes)
+{
+    if (block_size(block_next(block)) != 0 || block_size(block) <= KHEAP_TRIM_SIZE || heap_unmap_pending)
+        return;
+
+    size_t release = (block_size(block) - KHEAP_CHUNK) & ~(size_t)(KHEAP_CHUNK - 1);
+    size_t shrinkable = (heap_end - heap_start) - KHEAP_INITIAL_SIZE;
+    if (release > shrinkable)
+        release = shrinkable;
+    if (!release)
+        return;
+
+    heap_bin_remove(block);
+    block_set(block, block_size(block) - release, 1);
+    heap_end -= release;
+    heap_block_t *epilogue = block_next(block);
+    epilogue->size = 0;
+    epilogue->magic = HEAP_MAGIC;
+    heap_bin_insert(block);
+    heap_unmap_pending = 1;
+    *start = heap_end;
+    *bytes = release;
+}
+
+static void *heap_alloc(size_t size)
+{
+    if (!heap_start)
+    {
+        return NULL;
+    }
+    if (size == 0)
+    {
+        return NULL;
+    }
+    size_t need = heap_block_need(size);
+    spinlock_acquire(&heap_lock);
+
+    heap_block_t *found = heap_find(need);
+    while (!found && heap_unmap_pending)
+    {
+        // The tail is on its way out; grow only once it is gone
+        spinlock_release(&heap_lock);
+        heap_wait_unmap();
+        spinlock_acquire(&heap_lock);
+        found = heap_find(need);
+    }
+    uint8_t *undo = NULL;
+    size_t undo_bytes = 0;
+    if (!found && heap_grow(need, &undo, &undo_bytes) == 0)
+        found = heap_find(need);
+    if (!found)
+    {
+        spinlock_release(&heap_lock);
+        if (undo)
+            heap_unmap_detached(undo, undo_bytes);
+        serial_write_string("\x1b[38;2;255;50;50m[0ms][mem.c:???]- No suitable block found.\n");
+        return NULL;
+    }
+
+    heap_bin_remove(found);
+    heap_split(found, need);
+    spinlock_release(&heap_lock);
+    return (uint8_t *)found + HEAP_HDR_SIZE;
+}
+
+static void heap_free(void *ptr)
+{
+    heap_block_t *block = (heap_block_t *)((uint8_t *)ptr - HEAP_HDR_SIZE);
+    spinlock_acquire(&heap_lock);
+    if (block->magic != HEAP_MAGIC || block_free(block))
+    {
+        spinlock_release(&heap_lock);
+        serial_write_string("\x1b[38;2;255;50;50m[0ms][mem.c:???]- kfree on a corrupted or already free block.\n");
+        return;
+    }
+
+    size_t size = block_size(block);
+    heap_block_t *next = block_next(block);
+    if (block_free(next))
+    {
+        heap_bin_remove(next);
+        size += block_size(next);
+    }
+    if (block_free(block_prev(block)))
+    {
+        heap_block_t *prev = block_prev(block);
+        heap_bin_remove(prev);
+        size += block_size(prev);
+        block = prev;
+    }
+    block_set(block, size, 1);
+    heap_bin_insert(block);
+    uint8_t *trimmed = NULL;
+    size_t trimmed_bytes = 0;
+    heap_trim(block, &trimmed, &trimmed_bytes);
+    spinlock_release(&heap_lock);
+    if (trimmed)
+        heap_unmap_detached(trimmed, trimmed_bytes);
+}
+
+/* Grow an allocated block in place by absorbing a free successor. */
+static int heap_grow_in_place(void *ptr, size_t size)
+{
+    heap_block_t *block = (heap_block_t *)((uint8_t *)ptr - HEAP_HDR_SIZE);
+    size_t need = heap_block_need(size);
+    int grown = 0;
+
+    spinlock_acquire(&heap_lock);
+    heap_block_t *next = block_next(block);
+    if (block_free(next) && block_size(block) + block_size(next) >= need)
+    {
+        heap_bin_remove(next);
+        block_set(block, block_size(block) + block_size(next), 0);
+        heap_split(block, need);
+        grown = 1;
+    }
+    spinlock_release(&heap_lock);
+    return grown;
+}
+
+static size_t heap_usable_size(void *ptr)
+{
+    heap_block_t *block = (heap_block_t *)((uint8_t *)ptr - HEAP_HDR_SIZE);
+    return block_size(block) - HEAP_HDR_SIZE - HEAP_FTR_SIZE;
+}
+
+void init_kernel_heap(void)
+{
+    spinlock_init(&heap_lock);
+    heap_start = (uint8_t *)KHEAP_START;
+    if (heap_map(heap_start, KHEAP_INITIAL_SIZE))
+    {
+        heap_unmap(heap_start, KHEAP_INITIAL_SIZE);
+        serial_write_string("[0ms][mem.c:???]- Failed to allocate heap pages!\n");
+        heap_start = NULL;
+        return;
+    }
+    heap_end = heap_start + KHEAP_INITIAL_SIZE;
+
+    // Prologue footer at the front, epilogue header at the back, one free block between
+    *(size_t *)(heap_start + HEAP_ALIGN - HEAP_FTR_SIZE) = 0;
+    heap_block_t *first = (heap_block_t *)(heap_start + HEAP_ALIGN);
+    block_set(first, heap_end - heap_start - HEAP_ALIGN - HEAP_HDR_SIZE, 1);
+    heap_block_t *epilogue = block_next(first);
+    epilogue->size = 0;
+    epilogue->magic = HEAP_MAGIC;
+    heap_bin_insert(first);
+    log("Kernel heap initialized.", 4, 0);
+    kmem_init();
+}
+
+void print_mem_info(int vis)
+{
+    log("\n -> Memory Statistics:\n\n - Total Memory:\n   %lu MBs.\n\n - Free Memory:\n   %lu MBs.\n\n - Used Memory:\n   %lu MBs.\n", 1, vis, get_total_memory() / 1048576, get_free_memory() / 1048576, (get_total_memory() - get_free_memory()) / 1048576);
+
+    for (int z = 0; z < ZONE_COUNT; z++)
+    {
+        pmm_zone_t *zone = &pmm_zones[z];
+        if (!zone->region_count)
+            continue;
+
+        uint64_t blocks[PMM_MAX_ORDER + 1] = {0};
+        uint64_t rflags = spinlock_acquire_irqsave(&zone->lock);
+        for (uint32_t i = 0; i < zone->region_count; i++)
+            for (unsigned o = 0; o <= PMM_MAX_ORDER; o++)
+                blocks[o] += pmm_regions[zone->first_region + i].free_block_count[o];
+        spinlock_release_irqrestore(&zone->lock, rflags);
+
+        char orders[256];
+        size_t len = 0;
+        for (unsigned o = 0; o <= PMM_MAX_ORDER && len < sizeof(orders); o++)
+            len += snprintf(orders + len, sizeof(orders) - len, " %u:%lu", o, blocks[o]);
+        log("Zone %s: %u regions, %lu/%lu MBs free, blocks per order (order:count):%s", 1, vis,
+            zone->name, zone->region_count, zone->free_pages / 256, zone->total_pages / 256, orders);
+    }
+
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++)
+    {
+        pcp_stats_t stats;
+        get_pcp_stats(cpu, &stats);
+        log("CPU%u page cache: %u cached, %lu hits, %lu misses, %lu drains", 1, vis,
+            cpu, stats.count, stats.hits, stats.misses, stats.drains);
+    }
+    kmem_print_info(vis);
+    log("Zeroed page pool: %u pages, %lu hits, %lu misses", 1, vis,
+        zero_pool_count, zero_pool_hits, zero_pool_misses);
+    if (memprof_enabled)
+        memprof_dump(vis);
+}
+
+static int in_heap(void *ptr)
+{
+    return (uint64_t)ptr >= KHEAP_START && (uint64_t)ptr < KHEAP_END;
+}
+
+/*
+ * Small requests are served from the slab size classes; the list heap only
+ * sees large or odd sizes, and anything the slabs can't satisfy.
+ */
+void *kmalloc(size_t size)
+{
+    if (size == 0)
+        return NULL;
+    void *ptr = NULL;
+    if (size <= KMALLOC_SLAB_MAX)
+        ptr = kmem_alloc(size);
+    if (!ptr)
+        ptr = heap_alloc(size);
+    MEMPROF_ALLOC(ptr, size, MEMPROF_KMALLOC);
+    return ptr;
+}
+
+void kfree(void *ptr)
+{
+    if (!ptr)
+        return;
+    MEMPROF_FREE(ptr, MEMPROF_KMALLOC);
+    if (in_heap(ptr))
+        heap_free(ptr);
+    else
+        kmem_free(ptr);
+}
+
+void *krealloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return kmalloc(size);
+    if (size == 0)
+    {
+        kfree(ptr);
+        return NULL;
+    }
+    size_t old_size;
+    if (in_heap(ptr))
+    {
+        old_size = heap_usable_size(ptr);
+        if (old_size < size && heap_grow_in_place(ptr, size))
+            return ptr;
+    }
+    else
+    {
+        old_size = kmem_size(ptr);
+    }
+    if (old_size >= size)
+    {
+        return ptr;
+    }
+    void *new_mem = kmalloc(size);
+    if (new_mem)
+    {
+        memcpy(new_mem, ptr, old_size);
+        kfree(ptr);
+    }
+    return new_mem;
+}
+
+#define PAGE_HUGE_PAT  (1ULL << 12)
+#define HUGE_ADDR_MASK 0x000FFFFFFFFFE000ULL
+
+static uint64_t get_pml4_index(uint64_t vaddr)
+{
+    return (vaddr >> 39) & 0x1FF;
+}
+
+static uint64_t get_pdpt_index(uint64_t vaddr)
+{
+    return (vaddr >> 30) & 0x1FF;
+}
+
+static uint64_t get_pd_index(uint64_t vaddr)
+{
+    return (vaddr >> 21) & 0x1FF;
+}
+
+static uint64_t get_pt_index(uint64_t vaddr)
+{
+    return (vaddr >> 12) & 0x1FF;
+}
+
+page_table_t *create_page_directory(void)
+{
+    uint64_t phys = alloc_zeroed_page();
+    if (!phys)
+        return NULL;
+
+    return (page_table_t *)(phys + KERNEL_VIRT_OFFSET);
+}
+
+/*
+ * Replace a huge leaf (1 GiB in a PDPT or 2 MiB in a PD) with a table of the
+ * next level that maps the same range with the same attributes, so a single
+ * smaller page inside it can be changed.
+ */
+static int split_huge_entry(uint64_t *entry, uint64_t huge_size)
+{
+    uint64_t table_phys = alloc_page();
+    if (!table_phys)
+        return -1;
+    page_table_t *table = (page_table_t *)(table_phys + KERNEL_VIRT_OFFSET);
+
+    uint64_t base = *entry & HUGE_ADDR_MASK & ~(huge_size - 1);
+    uint64_t attrs = *entry & (0x8000000000000FFFULL | PAGE_HUGE_PAT);
+    uint64_t step = huge_size / 512;
+    for (int i = 0; i < 512; i++)
+    {
+        if (step == PAGE_SIZE)
+        {
+            uint64_t pte_attrs = attrs & ~(PAGE_HUGE | PAGE_HUGE_PAT);
+            if (attrs & PAGE_HUGE_PAT)
+                pte_attrs |= PAGE_HUGE; // PAT lives in bit 7 of a 4 KiB PTE
+            table->entries[i] = (base + i * step) | pte_attrs;
+        }
+        else
+        {
+            table->entries[i] = (base + i * step) | attrs;
+        }
+    }
+    *entry = table_phys | (*entry & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER));
+    return 0;
+}
+
+/* Return the table an entry points to, allocating or splitting it as needed. */
+static page_table_t *get_next_table(uint64_t *entry, uint64_t huge_size, uint64_t flags)
+{
+    if (!(*entry & PAGE_PRESENT))
+    {
+        uint64_t table_phys = alloc_zeroed_page();
+        if (!table_phys)
+            return NULL;
+        *entry = table_phys | PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
+    }
+    else if (*entry & PAGE_HUGE)
+    {
+        if (split_huge_entry(entry, huge_size))
+            return NULL;
+    }
+    if (flags & PAGE_USER)
+        *entry |= PAGE_USER;
+    return (page_table_t *)((*entry & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+}
+
+/*
+ * A 2 MiB page shared by fork keeps its share count on the head frame only,
+ * so its 4 KiB pieces can't be put one by one after a split. Before one is
+ * split, give this address space a private copy, as a write fault would.
+ * MAP_SHARED pages can't be copied, so those are not split at all.
+ */
+static int unshare_huge_page(page_table_t *pml4, uint64_t *pde, uint64_t virt)
+{
+    uint64_t old = *pde & HUGE_ADDR_MASK;
+    if (page_ref_count(old) <= 1)
+        return 0;
+    if (*pde & PAGE_SHARED)
+        return -1;
+    uint64_t copy = alloc_huge_page();
+    if (!copy)
+        return -1;
+    memcpy((void *)(copy + KERNEL_VIRT_OFFSET), (void *)(old + KERNEL_VIRT_OFFSET), HUGE_PAGE_SIZE);
+    *pde = copy | (*pde & ~HUGE_ADDR_MASK);
+    tlb_flush_page(pml4, virt & ~(HUGE_PAGE_SIZE - 1));
+    put_huge_page(old);
+    return 0;
+}
+
+/* The PT under a PD entry, splitting (and first unsharing) a 2 MiB page there. */
+static page_table_t *get_pt(page_table_t *pml4, uint64_t *pde, uint64_t virt, uint64_t flags)
+{
+    if ((*pde & PAGE_PRESENT) && (*pde & PAGE_HUGE) && unshare_huge_page(pml4, pde, virt))
+        return NULL;
+    return get_next_table(pde, HUGE_PAGE_SIZE, flags);
+}
+
+/*
+ * Find the leaf entry mapping virt: a PTE, or a PD/PDPT entry with PS set.
+ * The size of the mapping is stored in *size. Returns NULL if nothing is mapped.
+ */
+static uint64_t *walk_page_table(page_table_t *pml4, uint64_t virt, uint64_t *size)
+{
+    if (!(pml4->entries[get_pml4_index(virt)] & PAGE_PRESENT))
+        return NULL;
+    page_table_t *pdpt = (page_table_t *)((pml4->entries[get_pml4_index(virt)] & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+
+    uint64_t *entry = &pdpt->entries[get_pdpt_index(virt)];
+    if (!(*entry & PAGE_PRESENT))
+        return NULL;
+    if (*entry & PAGE_HUGE)
+    {
+        *size = 0x40000000;
+        return entry;
+    }
+    page_table_t *pd = (page_table_t *)((*entry & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+
+    entry = &pd->entries[get_pd_index(virt)];
+    if (!(*entry & PAGE_PRESENT))
+        return NULL;
+    if (*entry & PAGE_HUGE)
+    {
+        *size = HUGE_PAGE_SIZE;
+        return entry;
+    }
+    page_table_t *pt = (page_table_t *)((*entry & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+
+    entry = &pt->entries[get_pt_index(virt)];
+    if (!(*entry & PAGE_PRESENT))
+        return NULL;
+    *size = PAGE_SIZE;
+    return entry;
+}
+
+void map_page(page_table_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags)
+{
+    page_table_t *pdpt = get_next_table(&pml4->entries[get_pml4_index(virt)], 0, flags);
+    if (!pdpt)
+        return;
+    page_table_t *pd = get_next_table(&pdpt->entries[get_pdpt_index(virt)], 0x40000000, flags);
+    if (!pd)
+        return;
+    page_table_t *pt = get_pt(pml4, &pd->entries[get_pd_index(virt)], virt, flags);
+    if (!pt)
+        return;
+
+    uint64_t old = pt->entries[get_pt_index(virt)];
+    pt->entries[get_pt_index(virt)] = (phys & 0x000FFFFFFFFFF000) | (flags & 0x8000000000000FFF);
+    // Non-present entries are never cached, so only a replaced mapping needs a flush
+    if (old & PAGE_PRESENT)
+        tlb_flush_page(pml4, virt);
+}
+
+void map_huge_page(page_table_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags)
+{
+    virt &= ~(HUGE_PAGE_SIZE - 1);
+    page_table_t *pdpt = get_next_table(&pml4->entries[get_pml4_index(virt)], 0, flags);
+    if (!pdpt)
+        return;
+    page_table_t *pd = get_next_table(&pdpt->entries[get_pdpt_index(virt)], 0x40000000, flags);
+    if (!pd)
+        return;
+
+    // A PT already covering this range is replaced; its pages stay owned by the caller.
+    uint64_t *entry = &pd->entries[get_pd_index(virt)];
+    uint64_t old = *entry;
+    *entry = (phys & HUGE_ADDR_MASK) | (flags & 0x8000000000000FFF) | PAGE_HUGE;
+    if (!(old & PAGE_PRESENT))
+        return;
+
+    // One shootdown for the whole span, and the old PT is only reused after it
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pml4);
+    tlb_batch_add_span(&batch, virt, HUGE_PAGE_SIZE);
+    tlb_batch_flush(&batch);
+    if (!(old & PAGE_HUGE))
+        free_page(old & 0x000FFFFFFFFFF000);
+}
+
+/*
+ * Range operations. Instead of walking all four levels for every page, they
+ * descend once per 2 MiB span (creating or splitting intermediate tables on
+ * the way), fill or clear the consecutive entries of that PT, and leave the
+ * invalidations to a single batched flush at the end.
+ */
+#define RANGE_CONTIG    0   // map the physical range starting at phys
+#define RANGE_ALLOC     1   // a fresh page per entry
+#define RANGE_ZEROED    2   // a fresh zeroed page per entry
+
+static page_table_t *get_pd(page_table_t *pml4, uint64_t virt, uint64_t flags)
+{
+    page_table_t *pdpt = get_next_table(&pml4->entries[get_pml4_index(virt)], 0, flags);
+    if (!pdpt)
+        return NULL;
+    return get_next_table(&pdpt->entries[get_pdpt_index(virt)], 0x40000000, flags);
+}
+
+static int map_range_common(page_table_t *pml4, uint64_t virt, uint64_t phys, size_t size, uint64_t flags, int mode)
+{
+    uint64_t end = virt + size;
+    uint64_t pte_flags = flags & 0x8000000000000FFF & ~PAGE_HUGE;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pml4);
+    int ret = 0;
+
+    while (virt < end)
+    {
+        page_table_t *pd = get_pd(pml4, virt, flags);
+        if (!pd)
+        {
+            ret = -1;
+            break;
+        }
+        uint64_t *pde = &pd->entries[get_pd_index(virt)];
+
+        // Physically contiguous 2 MiB chunks can take a single PD entry
+        if (mode == RANGE_CONTIG && (flags & PAGE_HUGE) && end - virt >= HUGE_PAGE_SIZE &&
+            !(virt & (HUGE_PAGE_SIZE - 1)) && !(phys & (HUGE_PAGE_SIZE - 1)))
+        {
+            uint64_t old = *pde;
+            *pde = (phys & HUGE_ADDR_MASK) | (flags & 0x8000000000000FFF) | PAGE_HUGE;
+            if ((old & PAGE_PRESENT) && !(old & PAGE_HUGE))
+            {
+                // Every 4 KiB entry of the old PT may be cached, and the PT
+                // itself too: flush before the page is handed out again
+                tlb_batch_add_span(&batch, virt, HUGE_PAGE_SIZE);
+                tlb_batch_flush(&batch);
+                free_page(old & 0x000FFFFFFFFFF000);
+            }
+            else if (old & PAGE_PRESENT)
+            {
+                tlb_batch_add(&batch, virt);
+            }
+            virt += HUGE_PAGE_SIZE;
+            phys += HUGE_PAGE_SIZE;
+            continue;
+        }
+
+        page_table_t *pt = get_pt(pml4, pde, virt, flags);
+        if (!pt)
+        {
+            ret = -1;
+            break;
+        }
+        uint64_t span_end = (virt | (HUGE_PAGE_SIZE - 1)) + 1;
+        if (span_end > end)
+            span_end = end;
+        for (; virt < span_end; virt += PAGE_SIZE, phys += PAGE_SIZE)
+        {
+            uint64_t *entry = &pt->entries[get_pt_index(virt)];
+            uint64_t page = phys;
+            if (mode != RANGE_CONTIG)
+            {
+                // Anonymous ranges only fill holes; present pages are kept
+                if (*entry & PAGE_PRESENT)
+                    continue;
+                page = (mode == RANGE_ZEROED) ? alloc_zeroed_page() : alloc_page();
+                if (!page)
+                {
+                    ret = -1;
+                    end = virt;
+                    break;
+                }
+            }
+            else if (*entry & PAGE_PRESENT)
+            {
+                tlb_batch_add(&batch, virt);
+            }
+            *entry = (page & 0x000FFFFFFFFFF000) | pte_flags;
+        }
+    }
+    tlb_batch_flush(&batch);
+    return ret;
+}
+
+/*
+ * Map size bytes at virt to the physically contiguous range at phys.
+ * With PAGE_HUGE in flags, suitably aligned 2 MiB chunks use huge pages.
+ */
+int map_range(page_table_t *pml4, uint64_t virt, uint64_t phys, size_t size, uint64_t flags)
+{
+    return map_range_common(pml4, virt, phys, size, flags, RANGE_CONTIG);
+}
+
+/*
+ * Back every unmapped page of [virt, virt + size) with a newly allocated
+ * page, zeroed if asked. Pages already mapped are left as they are. On
+ * failure the pages mapped so far stay mapped.
+ */
+int map_anon_range(page_table_t *pml4, uint64_t virt, size_t size, uint64_t flags, int zero)
+{
+    return map_range_common(pml4, virt, 0, size, flags, zero ? RANGE_ZEROED : RANGE_ALLOC);
+}
+
+static void put_range_pages(uint64_t *pages, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (pages[i] & 1)
+            put_huge_page(pages[i] & ~1ULL);
+        else
+            put_page(pages[i]);
+    }
+}
+
+/*
+ * Unmap everything in [virt, virt + size), skipping absent tables whole.
+ * With free_pages set, each page loses a reference (see put_page()) once
+ * the flush covering it is done. Returns -1 if a huge page could not be
+ * split, in which case the rest of the range is still mapped.
+ */
+int unmap_range(page_table_t *pml4, uint64_t virt, size_t size, int free_pages)
+{
+    uint64_t end = virt + size;
+    int ret = 0;
+    uint64_t freed[TLB_FULL_FLUSH_PAGES];   // huge pages are tagged with bit 0
+    uint32_t nfreed = 0;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pml4);
+
+    while (virt < end)
+    {
+        uint64_t *pml4e = &pml4->entries[get_pml4_index(virt)];
+        if (!(*pml4e & PAGE_PRESENT))
+        {
+            virt = (virt | 0x7FFFFFFFFFULL) + 1;
+            continue;
+        }
+        page_table_t *pdpt = (page_table_t *)((*pml4e & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+        uint64_t *pdpte = &pdpt->entries[get_pdpt_index(virt)];
+        if (!(*pdpte & PAGE_PRESENT))
+        {
+            virt = (virt | 0x3FFFFFFFULL) + 1;
+            continue;
+        }
+        page_table_t *pd = get_next_table(pdpte, 0x40000000, 0);
+        if (!pd)
+        {
+            ret = -1;
+            break;
+        }
+        uint64_t *pde = &pd->entries[get_pd_index(virt)];
+        uint64_t span_end = (virt | (HUGE_PAGE_SIZE - 1)) + 1;
+        if (!(*pde & PAGE_PRESENT))
+        {
+            virt = span_end;
+            continue;
+        }
+
+        if ((*pde & PAGE_HUGE) && !(virt & (HUGE_PAGE_SIZE - 1)) && span_end <= end)
+        {
+            freed[nfreed++] = (*pde & HUGE_ADDR_MASK) | 1;
+            *pde = 0;
+            tlb_batch_add(&batch, virt);
+            virt = span_end;
+        }
+        else
+        {
+            // Splits a huge page that is only partly unmapped
+            page_table_t *pt = get_pt(pml4, pde, virt, 0);
+            if (!pt)
+            {
+                ret = -1;
+                break;
+            }
+            if (span_end > end)
+                span_end = end;
+            for (; virt < span_end && nfreed < TLB_FULL_FLUSH_PAGES; virt += PAGE_SIZE)
+            {
+                uint64_t *entry = &pt->entries[get_pt_index(virt)];
+                if (!(*entry & PAGE_PRESENT))
+                    continue;
+                freed[nfreed++] = *entry & 0x000FFFFFFFFFF000;
+                *entry = 0;
+                tlb_batch_add(&batch, virt);
+            }
+        }
+
+        if (nfreed == TLB_FULL_FLUSH_PAGES)
+        {
+            tlb_batch_flush(&batch);
+            if (free_pages)
+                put_range_pages(freed, nfreed);
+            nfreed = 0;
+        }
+    }
+    tlb_batch_flush(&batch);
+    if (free_pages)
+        put_range_pages(freed, nfreed);
+    return ret;
+}
+
+#define PAGE_PROT_MASK  (PAGE_WRITABLE | PAGE_USER | (1ULL << 63))
+
+static void protect_entry(uint64_t *entry, uint64_t flags)
+{
+    uint64_t bits = flags & PAGE_PROT_MASK;
+    if (*entry & PAGE_COW)
+        bits &= ~PAGE_WRITABLE;
+    *entry = (*entry & ~PAGE_PROT_MASK) | bits;
+}
+
+/*
+ * Change the access bits (writable, user, NX) of every page mapped in
+ * [virt, virt + size) to those in flags. Copy-on-write pages stay
+ * read-only; the write fault makes them writable when it copies them.
+ */
+void protect_range(page_table_t *pml4, uint64_t virt, size_t size, uint64_t flags)
+{
+    uint64_t end = virt + size;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pml4);
+
+    while (virt < end)
+    {
+        uint64_t *pml4e = &pml4->entries[get_pml4_index(virt)];
+        if (!(*pml4e & PAGE_PRESENT))
+        {
+            virt = (virt | 0x7FFFFFFFFFULL) + 1;
+            continue;
+        }
+        page_table_t *pdpt = (page_table_t *)((*pml4e & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+        uint64_t *pdpte = &pdpt->entries[get_pdpt_index(virt)];
+        if (!(*pdpte & PAGE_PRESENT))
+        {
+            virt = (virt | 0x3FFFFFFFULL) + 1;
+            continue;
+        }
+        page_table_t *pd = get_next_table(pdpte, 0x40000000, flags);
+        if (!pd)
+            break;
+        uint64_t *pde = &pd->entries[get_pd_index(virt)];
+        uint64_t span_end = (virt | (HUGE_PAGE_SIZE - 1)) + 1;
+        if (!(*pde & PAGE_PRESENT))
+        {
+            virt = span_end;
+            continue;
+        }
+
+        if ((*pde & PAGE_HUGE) && !(virt & (HUGE_PAGE_SIZE - 1)) && span_end <= end)
+        {
+            protect_entry(pde, flags);
+            tlb_batch_add(&batch, virt);
+            virt = span_end;
+            continue;
+        }
+
+        // Splits a huge page that is only partly covered
+        page_table_t *pt = get_pt(pml4, pde, virt, flags);
+        if (!pt)
+            break;
+        if (span_end > end)
+            span_end = end;
+        for (; virt < span_end; virt += PAGE_SIZE)
+        {
+            uint64_t *entry = &pt->entries[get_pt_index(virt)];
+            if (!(*entry & PAGE_PRESENT))
+                continue;
+            protect_entry(entry, flags);
+            tlb_batch_add(&batch, virt);
+        }
+    }
+    tlb_batch_flush(&batch);
 }
 
-uint64_t alloc_page(void)
+void switch_page_directory(page_table_t *pml4)
 {
-    return alloc_pages(1);
+    uint64_t cr3 = tlb_switch_cr3(pml4);
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
 }
 
-uint64_t alloc_pages(size_t count)
+uint64_t virt_to_phys(page_table_t *pml4, uint64_t virt)
 {
-    if (!pmm_bitmap || count == 0)
-        return 0;
-
-    spinlock_acquire(&pmm_lock);
-    uint64_t page_idx = find_free_pages(count);
-    if (page_idx == UINT64_MAX)
-    {
-        spinlock_release(&pmm_lock);
+    uint64_t size;
+    uint64_t *entry = walk_page_table(pml4, virt, &size);
+    if (!entry)
         return 0;
-    }
-    for (size_t i = 0; i < count; i++)
-    {
-        set_bit(page_idx + i);
-        used_pages++;
-    }
-    spinlock_release(&pmm_lock);
-    return memory_base + (page_idx * PAGE_SIZE);
+    uint64_t mask = (size == PAGE_SIZE) ? 0x000FFFFFFFFFF000 : (HUGE_ADDR_MASK & ~(size - 1));
+    return (*entry & mask) + (virt & (size - 1));
 }
 
-void free_page(uint64_t addr)
+uint64_t get_mapping_size(page_table_t *pml4, uint64_t virt)
 {
-    free_pages(addr, 1);
+    uint64_t size;
+    return walk_page_table(pml4, virt, &size) ? size : 0;
 }
 
-void free_pages(uint64_t addr, size_t count)
+/* Clear the 4 KiB mapping at virt without flushing; returns the old entry. */
+static uint64_t clear_page_entry(page_table_t *pml4, uint64_t virt)
 {
-    if (!pmm_bitmap || addr < memory_base || addr >= memory_top)
-    {
-        return;
-    }
-    spinlock_acquire(&pmm_lock);
-
-    uint64_t page_idx = (addr - memory_base) / PAGE_SIZE;
+    uint64_t size;
+    uint64_t *entry = walk_page_table(pml4, virt, &size);
+    if (!entry)
+        return 0;
 
-    for (size_t i = 0; i < count; i++)
+    if (size != PAGE_SIZE)
     {
-        if (page_idx + i < total_pages && test_bit(page_idx + i))
-        {
-            clear_bit(page_idx + i);
-            used_pages--;
-        }
+        // Unmapping 4 KiB out of a huge page: split it down to a PT first.
+        page_table_t *pdpt = (page_table_t *)((pml4->entries[get_pml4_index(virt)] & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+        page_table_t *pd = get_next_table(&pdpt->entries[get_pdpt_index(virt)], 0x40000000, 0);
+        if (!pd)
+            return 0;
+        page_table_t *pt = get_pt(pml4, &pd->entries[get_pd_index(virt)], virt, 0);
+        if (!pt)
+            return 0;
+        entry = &pt->entries[get_pt_index(virt)];
     }
-    spinlock_release(&pmm_lock);
+
+    uint64_t old = *entry;
+    *entry = 0;
+    return old;
 }
 
-uint64_t get_total_memory(void)
+void unmap_page(page_table_t *pml4, uint64_t virt)
 {
-    return total_pages * PAGE_SIZE;
+    if (clear_page_entry(pml4, virt) & PAGE_PRESENT)
+        tlb_flush_page(pml4, virt);
 }
 
-uint64_t get_free_memory(void)
+void unmap_huge_page(page_table_t *pml4, uint64_t virt)
 {
-    return (total_pages - used_pages) * PAGE_SIZE;
+    uint64_t size;
+    uint64_t *entry = walk_page_table(pml4, virt, &size);
+    if (!entry || size != HUGE_PAGE_SIZE)
+        return;
+
+    // A single invlpg drops a 2 MiB translation wherever it's aimed inside it
+    *entry = 0;
+    tlb_flush_page(pml4, virt & ~(HUGE_PAGE_SIZE - 1));
 }
 
-void init_kernel_heap(void)
+static void free_page_table_struct(page_table_t *table);
+
+/*
+ * PML4 slot 0 holds both the low identity map the kernel uses for LAPIC,
+ * IOAPIC and HPET registers and the user image, heap and mmap area below
+ * 1 GiB. Every user address space gets a PDPT of its own for the slot that
+ * shares the kernel's entries above 1 GiB and leaves the first GiB to the
+ * user, so user mappings never end up in the kernel's tables.
+ */
+static int copy_low_identity(page_table_t *pml4)
 {
-    spinlock_init(&heap_lock);
-    uint64_t heap_pages = 16384;
-    uint64_t heap_phys = alloc_pages(heap_pages);
-    if (!heap_phys)
-    {
-        serial_write_string("[0ms][mem.c:???]- Failed to allocate heap pages!\n");
-        return;
-    }
-    uint64_t heap_virt = heap_phys + KERNEL_VIRT_OFFSET;
-    heap_start = (header_t *)heap_virt;
-    heap_start->size = (heap_pages * PAGE_SIZE) - HEADER_SIZE;
-    heap_start->free = 1;
-    heap_start->next = NULL;
-    log("Kernel heap initialized.", 4, 0);
+    uint64_t kernel_entry = kernel_pml4->entries[0];
+    if (!(kernel_entry & PAGE_PRESENT))
+        return 0;
+    uint64_t pdpt_phys = alloc_zeroed_page();
+    if (!pdpt_phys)
+        return -1;
+    page_table_t *kernel_pdpt = (page_table_t *)((kernel_entry & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+    page_table_t *pdpt = (page_table_t *)(pdpt_phys + KERNEL_VIRT_OFFSET);
+    for (int i = 1; i < 512; i++)
+        pdpt->entries[i] = kernel_pdpt->entries[i];
+    pml4->entries[0] = pdpt_phys | (kernel_entry & 0xFFF);
+    return 0;
 }
 
-void print_mem_info(int vis)
+/* Is this lower-half PDPT entry one of the kernel's, shared through copy_low_identity()? */
+static int is_kernel_entry(int pml4_idx, uint64_t pdpt_idx, uint64_t entry)
 {
-    log("\n -> Memory Statistics:\n\n - Total Memory:\n   %lu MBs.\n\n - Free Memory:\n   %lu MBs.\n\n - Used Memory:\n   %lu MBs.\n", 1, vis, get_total_memory() / 1048576, get_free_memory() / 1048576, (get_total_memory() - get_free_memory()) / 1048576);
+    uint64_t kernel_entry = kernel_pml4->entries[pml4_idx];
+    if (!(kernel_entry & PAGE_PRESENT))
+        return 0;
+    page_table_t *kernel_pdpt = (page_table_t *)((kernel_entry & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+    return (kernel_pdpt->entries[pdpt_idx] & 0x000FFFFFFFFFF000) == (entry & 0x000FFFFFFFFFF000);
 }
 
-void *kmalloc(size_t size)
+page_table_t *clone_page_directory(page_table_t *src)
 {
-    if (!heap_start)
+    page_table_t *new_pml4 = create_page_directory();
+    if (!new_pml4) return NULL;
+
+    for (int i = 256; i < 512; i++)
     {
-        return NULL;
+        new_pml4->entries[i] = src->entries[i];
     }
-    if (size == 0)
+    if (copy_low_identity(new_pml4))
     {
+        free_page_table_struct(new_pml4);
         return NULL;
     }
-    spinlock_acquire(&heap_lock);
-    size = (size + 7) & ~7;
 
-    header_t *curr = heap_start;
-    while (curr)
+    return new_pml4;
+}
+
+/*
+ * Drop a user table and everything below it in one pass over its present
+ * entries: leaf pages (4 KiB or huge) lose one mapping and are freed with
+ * the last one, then the tables themselves are freed. Entries matching the
+ * kernel's table at the same spot are left alone.
+ */
+static void release_table(page_table_t *table, int level, int pml4_idx)
+{
+    for (int i = 0; i < 512; i++)
     {
-        if (curr->free && curr->size >= size)
+        uint64_t entry = table->entries[i];
+        if (!(entry & PAGE_PRESENT))
+            continue;
+        if (level == 3 && is_kernel_entry(pml4_idx, i, entry))
+            continue;
+        if (level == 1)
         {
-            if (curr->size > size + HEADER_SIZE + 8)
-            {
-                header_t *next = (header_t *)((uint8_t *)curr + HEADER_SIZE + size);
-                next->size = curr->size - size - HEADER_SIZE;
-                next->free = 1;
-                next->next = curr->next;
-                curr->size = size;
-                curr->next = next;
-            }
-
-            curr->free = 0;
-            spinlock_release(&heap_lock);
-            return (void *)((uint8_t *)curr + HEADER_SIZE);
+            if (page_ref_drop(entry & 0x000FFFFFFFFFF000))
+                free_page_cold(entry & 0x000FFFFFFFFFF000);
+        }
+        else if (entry & PAGE_HUGE)
+        {
+            put_huge_page(entry & HUGE_ADDR_MASK);
         }
-        curr = curr->next;
+        else
+            release_table((page_table_t *)((entry & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET), level - 1, pml4_idx);
     }
-    serial_write_string("\x1b[38;2;255;50;50m[0ms][mem.c:???]- No suitable block found.\n");
-    spinlock_release(&heap_lock);
-    return NULL;
+    free_page_table_struct(table);
 }
 
-void kfree(void *ptr)
+/*
+ * Tear down a user address space: every user page and page table is freed,
+ * and the PML4 itself. Cost follows what is mapped, not the size of the
+ * address space. Nothing may run on pml4 any more, so a single flush up
+ * front covers every page before it can be reused.
+ */
+void free_task_address_space(page_table_t *pml4)
 {
-    if (!ptr)
+    if (!pml4)
         return;
-    spinlock_acquire(&heap_lock);
-    header_t *block = (header_t *)((uint8_t *)ptr - HEADER_SIZE);
-    block->free = 1;
-    if (block->next && block->next->free)
-    {
-        block->size += HEADER_SIZE + block->next->size;
-        block->next = block->next->next;
-    }
-    header_t *curr = heap_start;
-    while (curr && curr->next != block)
-    {
-        curr = curr->next;
-    }
-    if (curr && curr->free)
+    tlb_flush_range(pml4, 0, 0);
+    for (int i = 0; i < 256; i++)
     {
-        curr->size += HEADER_SIZE + block->size;
-        curr->next = block->next;
+        if (pml4->entries[i] & PAGE_PRESENT)
+            release_table((page_table_t *)((pml4->entries[i] & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET), 3, i);
     }
-    spinlock_release(&heap_lock);
+    tlb_release(pml4);
+    free_page_table_struct(pml4);
 }
 
-void *krealloc(void *ptr, size_t size)
+/*
+ * Duplicate one level of a user page table hierarchy for fork. Leaf pages
+ * are shared rather than copied: writable ones become read-only with
+ * PAGE_COW set in both trees, and each gains a reference.
+ */
+static int fork_table(page_table_t *src, page_table_t *dst, int level, int pml4_idx)
 {
-    if (!ptr)
-        return kmalloc(size);
-    if (size == 0)
-    {
-        kfree(ptr);
-        return NULL;
-    }
-    header_t *block = (header_t *)((uint8_t *)ptr - HEADER_SIZE);
-    if (block->size >= size)
-    {
-        return ptr;
-    }
-    void *new_mem = kmalloc(size);
-    if (new_mem)
+    for (int i = 0; i < 512; i++)
     {
-        size_t copy_size = (block->size < size) ? block->size : size;
-        for (size_t i = 0; i < copy_size; i++)
+        uint64_t entry = src->entries[i];
+        if (!(entry & PAGE_PRESENT))
+            continue;
+        if (level == 3 && is_kernel_entry(pml4_idx, i, entry))
+            continue;
+
+        if (level == 1 || (entry & PAGE_HUGE))
         {
-            ((char *)new_mem)[i] = ((char *)ptr)[i];
+            if ((entry & PAGE_WRITABLE) && !(entry & PAGE_SHARED))
+            {
+                entry = (entry & ~PAGE_WRITABLE) | PAGE_COW;
+                src->entries[i] = entry;
+            }
+            page_ref_get(entry & (level == 1 ? 0x000FFFFFFFFFF000 : HUGE_ADDR_MASK));
+            dst->entries[i] = entry;
+            continue;
         }
-        kfree(ptr);
-    }
-    return new_mem;
-}
-
-static uint64_t get_pml4_index(uint64_t vaddr)
-{
-    return (vaddr >> 39) & 0x1FF;
-}
-
-static uint64_t get_pdpt_index(uint64_t vaddr)
-{
-    return (vaddr >> 30) & 0x1FF;
-}
-
-static uint64_t get_pd_index(uint64_t vaddr)
-{
-    return (vaddr >> 21) & 0x1FF;
-}
 
-static uint64_t get_pt_index(uint64_t vaddr)
-{
-    return (vaddr >> 12) & 0x1FF;
+        uint64_t table_phys = alloc_zeroed_page();
+        if (!table_phys)
+            return -1;
+        dst->entries[i] = table_phys | (entry & 0xFFF);
+        if (fork_table((page_table_t *)((entry & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET),
+                       (page_table_t *)(table_phys + KERNEL_VIRT_OFFSET), level - 1, pml4_idx))
+            return -1;
+    }
+    return 0;
 }
 
-page_table_t *create_page_directory(void)
+/*
+ * Copy-on-write clone of a user address space: only the page tables of the
+ * lower half are copied. The first write to a shared page from either side
+ * faults into handle_cow_fault(), which gives the writer its own copy.
+ */
+page_table_t *fork_page_directory(page_table_t *src)
 {
-    uint64_t phys = alloc_page();
-    if (!phys)
+    page_table_t *dst = clone_page_directory(src);
+    if (!dst)
         return NULL;
 
-    page_table_t *pml4 = (page_table_t *)(phys + KERNEL_VIRT_OFFSET);
-    memset(pml4, 0, PAGE_SIZE);
-    return pml4;
-}
-
-void map_page(page_table_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags)
-{
-    uint64_t pml4_idx = get_pml4_index(virt);
-    uint64_t pdpt_idx = get_pdpt_index(virt);
-    uint64_t pd_idx = get_pd_index(virt);
-    uint64_t pt_idx = get_pt_index(virt);
-
-    if (!(pml4->entries[pml4_idx] & PAGE_PRESENT))
-    {
-        uint64_t pdpt_phys = alloc_page();
-        if (!pdpt_phys)
-            return;
-        page_table_t *pdpt = (page_table_t *)(pdpt_phys + KERNEL_VIRT_OFFSET);
-        memset(pdpt, 0, PAGE_SIZE);
-        pml4->entries[pml4_idx] = pdpt_phys | PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
-    }
-    else if (flags & PAGE_USER)
-    {
-        pml4->entries[pml4_idx] |= PAGE_USER;
-    }
-    page_table_t *pdpt = (page_table_t *)((pml4->entries[pml4_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
-    if (!(pdpt->entries[pdpt_idx] & PAGE_PRESENT))
+    int failed = 0;
+    for (int i = 0; i < 256 && !failed; i++)
     {
-        uint64_t pd_phys = alloc_page();
-        if (!pd_phys)
-            return;
-        page_table_t *pd = (page_table_t *)(pd_phys + KERNEL_VIRT_OFFSET);
-        memset(pd, 0, PAGE_SIZE);
-        pdpt->entries[pdpt_idx] = pd_phys | PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
-    }
-    else if (flags & PAGE_USER)
-    {
-        pdpt->entries[pdpt_idx] |= PAGE_USER;
-    }
-    page_table_t *pd = (page_table_t *)((pdpt->entries[pdpt_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
-    if (!(pd->entries[pd_idx] & PAGE_PRESENT))
-    {
-        uint64_t pt_phys = alloc_page();
-        if (!pt_phys)
-            return;
-        page_table_t *pt = (page_table_t *)(pt_phys + KERNEL_VIRT_OFFSET);
-        memset(pt, 0, PAGE_SIZE);
-        pd->entries[pd_idx] = pt_phys | PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
-    }
-    else if (flags & PAGE_USER)
-    {
-            if (pd->entries[pd_idx] & (1ULL << 7)) {
-                uint64_t pt_phys = alloc_page();
-                if (!pt_phys)
-                    return;
-                page_table_t *pt = (page_table_t *)(pt_phys + KERNEL_VIRT_OFFSET);
-                memset(pt, 0, PAGE_SIZE);
-                pd->entries[pd_idx] = pt_phys | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
-            } else {
-                pd->entries[pd_idx] |= PAGE_USER;
+        uint64_t entry = src->entries[i];
+        if (!(entry & PAGE_PRESENT))
+            continue;
+        if (!(dst->entries[i] & PAGE_PRESENT))
+        {
+            uint64_t pdpt_phys = alloc_zeroed_page();
+            if (!pdpt_phys)
+            {
+                failed = 1;
+                break;
             }
+            dst->entries[i] = pdpt_phys | (entry & 0xFFF);
+        }
+        dst->entries[i] |= entry & PAGE_USER;
+        failed = fork_table((page_table_t *)((entry & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET),
+                            (page_table_t *)((dst->entries[i] & 0x000FFFFFFFFFF000) + KERNEL_VIRT_OFFSET), 3, i);
     }
 
-    page_table_t *pt = (page_table_t *)((pd->entries[pd_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
-    pt->entries[pt_idx] = (phys & 0x000FFFFFFFFFF000) | (flags & 0x8000000000000FFF);
-    __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
-}
-
-void switch_page_directory(page_table_t *pml4)
-{
-    uint64_t phys = (uint64_t)pml4 - KERNEL_VIRT_OFFSET;
-    __asm__ volatile("mov %0, %%cr3" : : "r"(phys) : "memory");
-}
-
-uint64_t virt_to_phys(page_table_t *pml4, uint64_t virt)
-{
-    uint64_t pml4_idx = get_pml4_index(virt);
-    uint64_t pdpt_idx = get_pdpt_index(virt);
-    uint64_t pd_idx = get_pd_index(virt);
-    uint64_t pt_idx = get_pt_index(virt);
-
-    if (!(pml4->entries[pml4_idx] & PAGE_PRESENT))
-        return 0;
-    page_table_t *pdpt = (page_table_t *)((pml4->entries[pml4_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
-
-    if (!(pdpt->entries[pdpt_idx] & PAGE_PRESENT))
-        return 0;
-    page_table_t *pd = (page_table_t *)((pdpt->entries[pdpt_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
-
-    if (!(pd->entries[pd_idx] & PAGE_PRESENT))
-        return 0;
-    page_table_t *pt = (page_table_t *)((pd->entries[pd_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
-
-    if (!(pt->entries[pt_idx] & PAGE_PRESENT))
-        return 0;
-    return (pt->entries[pt_idx] & 0xFFFFFFFFFFFFF000) + (virt & 0xFFF);
-}
-
-void unmap_page(page_table_t *pml4, uint64_t virt)
-{
-    uint64_t pml4_idx = get_pml4_index(virt);
-    uint64_t pdpt_idx = get_pdpt_index(virt);
-    uint64_t pd_idx = get_pd_index(virt);
-    uint64_t pt_idx = get_pt_index(virt);
-
-    if (!(pml4->entries[pml4_idx] & PAGE_PRESENT))
-        return;
-    page_table_t *pdpt = (page_table_t *)((pml4->entries[pml4_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
-
-    if (!(pdpt->entries[pdpt_idx] & PAGE_PRESENT))
-        return;
-    page_table_t *pd = (page_table_t *)((pdpt->entries[pdpt_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
-
-    if (!(pd->entries[pd_idx] & PAGE_PRESENT))
-        return;
-    page_table_t *pt = (page_table_t *)((pd->entries[pd_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
+    // The parent lost write access to everything it shares
+    tlb_flush_range(src, 0, 0);
 
-    pt->entries[pt_idx] = 0;
-    __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    if (failed)
+    {
+        free_task_address_space(dst);
+        return NULL;
+    }
+    return dst;
 }
 
-page_table_t *clone_page_directory(page_table_t *src)
+/*
+ * Resolve a write fault on a PAGE_COW mapping. The last address space still
+ * using the page just gets write access back; any other one gets a private
+ * copy. Returns 0 if the fault was handled.
+ */
+int handle_cow_fault(page_table_t *pml4, uint64_t virt)
 {
-    page_table_t *new_pml4 = create_page_directory();
-    if (!new_pml4) return NULL;
+    uint64_t size;
+    uint64_t *entry = walk_page_table(pml4, virt, &size);
+    if (!entry || !(*entry & PAGE_COW) || size > HUGE_PAGE_SIZE)
+        return -1;
 
-    if (src == get_kernel_pml4())
+    uint64_t mask = (size == PAGE_SIZE) ? 0x000FFFFFFFFFF000 : HUGE_ADDR_MASK;
+    uint64_t old = *entry & mask;
+    uint64_t flags = ((*entry & ~mask) & ~PAGE_COW) | PAGE_WRITABLE;
+    if (page_ref_count(old) > 1)
     {
-        for (int i = 0; i < 512; i++)
-        {
-            new_pml4->entries[i] = src->entries[i];
-        }
+        uint64_t copy = (size == PAGE_SIZE) ? alloc_page() : alloc_huge_page();
+        if (!copy)
+            return -1;
+        memcpy((void *)(copy + KERNEL_VIRT_OFFSET), (void *)(old + KERNEL_VIRT_OFFSET), size);
+        *entry = copy | flags;
+        if (size == PAGE_SIZE)
+            put_page(old);
+        else
+            put_huge_page(old);
     }
     else
     {
-        for (int i = 256; i < 512; i++)
-        {
-            new_pml4->entries[i] = src->entries[i];
-        }
+        *entry = old | flags;
     }
-
-    return new_pml4;
+    tlb_flush_page(pml4, virt & ~(size - 1));
+    return 0;
 }
 
 /**
@@ -555,6 +2112,14 @@ void free_page_directory(page_table_t *pml4)
         {
             if (!(pdpt->entries[pdpt_idx] & PAGE_PRESENT))
                 continue;
+
+            // Identity map tables belong to the kernel
+            if (is_kernel_entry(pml4_idx, pdpt_idx, pdpt->entries[pdpt_idx]))
+                continue;
+
+            // 1GB pages have no PD below them
+            if (pdpt->entries[pdpt_idx] & PAGE_HUGE)
+                continue;
                 
             page_table_t *pd = (page_table_t *)((pdpt->entries[pdpt_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
             
@@ -564,7 +2129,7 @@ void free_page_directory(page_table_t *pml4)
                     continue;
                 
                 // Check if this is a 2MB page (bit 7 set)
-                if (pd->entries[pd_idx] & (1ULL << 7))
+                if (pd->entries[pd_idx] & PAGE_HUGE)
                     continue;  // Don't free PT for huge pages
                     
                 page_table_t *pt = (page_table_t *)((pd->entries[pd_idx] & 0xFFFFFFFFFFFFF000) + KERNEL_VIRT_OFFSET);
@@ -582,30 +2147,175 @@ void free_page_directory(page_table_t *pml4)
     }
     
     // Finally free the PML4 itself
+    tlb_release(pml4);
     free_page_table_struct(pml4);
 }
 
-/**
- * Free all user-space pages and page tables for a task
- * Call this when a task dies to reclaim all its memory
+/*
+ * vmalloc area: virtually contiguous kernel buffers backed by whatever pages
+ * the PMM has, for large allocations that don't need physical contiguity.
+ * The ioremap area next to it holds device memory mappings. Areas of both
+ * are kept in address-sorted lists of descriptors from one static pool,
+ * allocated first-fit, and each is followed by an unmapped guard page.
  */
-void free_task_address_space(page_table_t *pml4, uint64_t user_start, uint64_t user_end)
+#define VMALLOC_MAX_AREAS 256
+
+typedef struct vm_area
 {
-    if (!pml4) return;
-    
-    // Free all user pages in the range
-    for (uint64_t virt = user_start; virt < user_end; virt += PAGE_SIZE)
+    uint64_t start;
+    size_t size;        // mapped bytes, not counting the guard page
+    struct vm_area *next;
+} vm_area_t;
+
+static vm_area_t vm_area_pool[VMALLOC_MAX_AREAS];
+static vm_area_t *vm_area_free_list = NULL;
+static vm_area_t *vm_areas = NULL;
+static vm_area_t *io_areas = NULL;
+static spinlock_t vmalloc_lock;
+
+/* Reserve size bytes (plus a guard page) aligned to align in [base, limit). Returns 0 if full. */
+static uint64_t vm_area_reserve(vm_area_t **list, uint64_t base, uint64_t limit, size_t size, uint64_t align)
+{
+    spinlock_acquire(&vmalloc_lock);
+    vm_area_t **link = list;
+    uint64_t start = base;
+    while (*link && (*link)->start < start + size + PAGE_SIZE)
     {
-        uint64_t phys = virt_to_phys(pml4, virt);
-        if (phys)
-        {
-            free_page(phys);
-            unmap_page(pml4, virt);
-        }
+        start = ((*link)->start + (*link)->size + PAGE_SIZE + align - 1) & ~(align - 1);
+        link = &(*link)->next;
     }
-    
-    // Now free the page table structures
-    free_page_directory(pml4);
+    if (start + size + PAGE_SIZE > limit || !vm_area_free_list)
+    {
+        spinlock_release(&vmalloc_lock);
+        return 0;
+    }
+    vm_area_t *area = vm_area_free_list;
+    vm_area_free_list = area->next;
+    area->start = start;
+    area->size = size;
+    area->next = *link;
+    *link = area;
+    spinlock_release(&vmalloc_lock);
+    return start;
+}
+
+/* Unlink the area starting at start and return its size, or 0 if there is none. */
+static size_t vm_area_release(vm_area_t **list, uint64_t start)
+{
+    spinlock_acquire(&vmalloc_lock);
+    vm_area_t **link = list;
+    while (*link && (*link)->start != start)
+        link = &(*link)->next;
+    vm_area_t *area = *link;
+    if (!area)
+    {
+        spinlock_release(&vmalloc_lock);
+        return 0;
+    }
+    *link = area->next;
+    size_t size = area->size;
+    area->next = vm_area_free_list;
+    vm_area_free_list = area;
+    spinlock_release(&vmalloc_lock);
+    return size;
+}
+
+void *vmalloc(size_t size)
+{
+    if (!size)
+        return NULL;
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+
+    uint64_t start = vm_area_reserve(&vm_areas, VMALLOC_START, VMALLOC_END, size, PAGE_SIZE);
+    if (!start)
+        return NULL;
+    if (map_anon_range(kernel_pml4, start, size, PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL, 0))
+    {
+        vfree((void *)start);
+        return NULL;
+    }
+    return (void *)start;
+}
+
+void vfree(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    // The range stays reserved until its pages are gone
+    spinlock_acquire(&vmalloc_lock);
+    vm_area_t *area = vm_areas;
+    while (area && area->start != (uint64_t)ptr)
+        area = area->next;
+    size_t size = area ? area->size : 0;
+    spinlock_release(&vmalloc_lock);
+    if (!size)
+    {
+        log("vfree: %p is not a vmalloc area", 3, 0, ptr);
+        return;
+    }
+
+    unmap_range(kernel_pml4, (uint64_t)ptr, size, 1);
+    vm_area_release(&vm_areas, (uint64_t)ptr);
+}
+
+/*
+ * Map size bytes of device memory at phys with the given memory type.
+ * Apertures of 2 MiB or more are placed so they can use huge pages.
+ * The pointer returned keeps phys's offset into its page.
+ */
+void *ioremap(uint64_t phys, size_t size, cache_type_t type)
+{
+    if (!size)
+        return NULL;
+    uint64_t offset = phys & (PAGE_SIZE - 1);
+    phys -= offset;
+    size = (size + offset + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+
+    uint64_t flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL;
+    if (type == CACHE_WC || type == CACHE_UC)
+        flags |= PAGE_PWT;
+    if (type == CACHE_WT || type == CACHE_UC)
+        flags |= PAGE_PCD;
+    uint64_t align = PAGE_SIZE;
+    if (size >= HUGE_PAGE_SIZE && !(phys & (HUGE_PAGE_SIZE - 1)))
+    {
+        align = HUGE_PAGE_SIZE;
+        flags |= PAGE_HUGE;
+    }
+
+    uint64_t start = vm_area_reserve(&io_areas, IOREMAP_START, IOREMAP_END, size, align);
+    if (!start)
+        return NULL;
+    if (map_range(kernel_pml4, start, phys, size, flags))
+    {
+        unmap_range(kernel_pml4, start, size, 0);
+        vm_area_release(&io_areas, start);
+        return NULL;
+    }
+    return (void *)(start + offset);
+}
+
+void iounmap(void *addr)
+{
+    if (!addr)
+        return;
+    uint64_t start = (uint64_t)addr & ~(uint64_t)(PAGE_SIZE - 1);
+
+    spinlock_acquire(&vmalloc_lock);
+    vm_area_t *area = io_areas;
+    while (area && area->start != start)
+        area = area->next;
+    size_t size = area ? area->size : 0;
+    spinlock_release(&vmalloc_lock);
+    if (!size)
+    {
+        log("iounmap: %p is not an ioremap area", 3, 0, addr);
+        return;
+    }
+
+    unmap_range(kernel_pml4, start, size, 0);
+    vm_area_release(&io_areas, start);
 }
 
 void init_vmm(void)
@@ -638,6 +2348,22 @@ void init_vmm(void)
         }
     }
     
+    // Preallocate the PDPT behind the heap/vmalloc window so every address
+    // space cloned from the kernel's shares it, however it grows later.
+    uint64_t vmalloc_pdpt = alloc_zeroed_page();
+    if (!vmalloc_pdpt) {
+        serial_write_string("Failed to allocate vmalloc PDPT!\n");
+        for(;;) __asm__("hlt");
+    }
+    new_kernel_pml4->entries[get_pml4_index(KHEAP_START)] = vmalloc_pdpt | PAGE_PRESENT | PAGE_WRITABLE;
+
+    spinlock_init(&vmalloc_lock);
+    for (int i = 0; i < VMALLOC_MAX_AREAS; i++)
+    {
+        vm_area_pool[i].next = vm_area_free_list;
+        vm_area_free_list = &vm_area_pool[i];
+    }
+
     kernel_pml4 = new_kernel_pml4;
     
     uint64_t new_cr3 = (uint64_t)new_kernel_pml4 - KERNEL_VIRT_OFFSET;
@@ -7,26 +7,81 @@
 #define PAGE_SIZE 4096
 #define KERNEL_VIRT_OFFSET 0xffff800000000000
 #define USER_SPACE_BASE 0x400000
-#define USER_STACK_TOP 0x800000000000
 #define USER_SPACE_START 0x400000      
 #define USER_SPACE_END   0x800000000000 
 #define USER_HEAP_START  0x10000000 
+#define USER_HEAP_END    0x40000000     // above 1 GiB, slot 0 is the kernel's identity map
+#define USER_MMAP_START  0x8000000000   // PML4 slot 1 up to the stack
+#define USER_MMAP_END    0x700000000000
+#define USER_STACK_TOP   0x700000800000 // stack window right above the mmap area
+#define USER_STACK_SIZE  0x800000       // reserved per task; its lowest page is the guard
+#define USER_STACK_INITIAL 0x2000       // populated when the task is created
+
+// Kernel heap, vmalloc and ioremap areas share PML4 slot 384
+#define KHEAP_START      0xffffc00000000000
+#define KHEAP_END        0xffffc00040000000
+#define VMALLOC_START    0xffffc00040000000
+#define VMALLOC_END      0xffffc07000000000
+#define IOREMAP_START    0xffffc07000000000
+#define IOREMAP_END      0xffffc08000000000
 
 #define PAGE_PRESENT    (1ULL << 0)
 #define PAGE_WRITABLE   (1ULL << 1) 
 #define PAGE_USER       (1ULL << 2)
+#define PAGE_PWT        (1ULL << 3)
+#define PAGE_PCD        (1ULL << 4)
 #define PAGE_ACCESSED   (1ULL << 5)
 #define PAGE_DIRTY      (1ULL << 6)
+#define PAGE_HUGE       (1ULL << 7)     // PS: 2MB leaf in a PD, 1GB in a PDPT
+#define PAGE_GLOBAL     (1ULL << 8)
+#define PAGE_COW        (1ULL << 9)     // software bit: read-only until the first write copies it
+#define PAGE_SHARED     (1ULL << 10)    // software bit: MAP_SHARED page, fork leaves it writable on both sides
+
+#define HUGE_PAGE_SIZE  0x200000ULL
 
 typedef struct {
     uint64_t entries[512];
 } __attribute__((aligned(4096))) page_table_t;
 
+// Memory types for ioremap(); the PAT puts them at PWT/PCD index 0-3 (cpu/pat.c)
+typedef enum {
+    CACHE_WB,
+    CACHE_WC,
+    CACHE_WT,
+    CACHE_UC
+} cache_type_t;
+
+typedef enum {
+    ZONE_DMA32,     // below 4 GiB, reachable by 32-bit DMA engines
+    ZONE_NORMAL,
+    ZONE_COUNT
+} mem_zone_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t drains;
+    uint32_t count;
+} pcp_stats_t;
+
 void init_pmm(void);
 uint64_t alloc_page(void);
 uint64_t alloc_pages(size_t count);
+uint64_t alloc_pages_zone(size_t count, mem_zone_t zone);
+uint64_t alloc_page_block(unsigned order);
+uint64_t alloc_huge_page(void);
+uint64_t alloc_zeroed_page(void);
+int zero_pool_refill(void);
 void free_page(uint64_t addr);
+void free_page_block(uint64_t addr, unsigned order);
+void free_huge_page(uint64_t addr);
+void free_page_cold(uint64_t addr);
 void free_pages(uint64_t addr, size_t count);
+void page_ref_get(uint64_t addr);
+uint32_t page_ref_count(uint64_t addr);
+void put_page(uint64_t addr);
+void put_huge_page(uint64_t addr);
+void get_pcp_stats(uint32_t cpu, pcp_stats_t *stats);
 uint64_t get_total_memory(void);
 uint64_t get_free_memory(void);
 void print_mem_info(int vis);
@@ -35,18 +90,32 @@ void init_kernel_heap(void);
 void* kmalloc(size_t size);
 void kfree(void* ptr);
 void* krealloc(void* ptr, size_t size);
+size_t get_heap_free_histogram(uint64_t* counts, uint64_t* bytes, size_t max_bins);
+void* vmalloc(size_t size);
+void vfree(void* ptr);
+void* ioremap(uint64_t phys, size_t size, cache_type_t type);
+void iounmap(void* addr);
 
 void init_vmm(void);
 page_table_t* create_page_directory(void);
 void map_page(page_table_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags);
+void map_huge_page(page_table_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags);
 void switch_page_directory(page_table_t* pml4);
 uint64_t virt_to_phys(page_table_t* pml4, uint64_t virt);
+uint64_t get_mapping_size(page_table_t* pml4, uint64_t virt);
 void unmap_page(page_table_t* pml4, uint64_t virt);
+void unmap_huge_page(page_table_t* pml4, uint64_t virt);
+int map_range(page_table_t* pml4, uint64_t virt, uint64_t phys, size_t size, uint64_t flags);
+int map_anon_range(page_table_t* pml4, uint64_t virt, size_t size, uint64_t flags, int zero);
+int unmap_range(page_table_t* pml4, uint64_t virt, size_t size, int free_pages);
+void protect_range(page_table_t* pml4, uint64_t virt, size_t size, uint64_t flags);
 page_table_t* clone_page_directory(page_table_t* src);
+page_table_t* fork_page_directory(page_table_t* src);
+int handle_cow_fault(page_table_t* pml4, uint64_t virt);
 page_table_t* get_kernel_pml4(void);
 
 // New functions for proper cleanup
 void free_page_directory(page_table_t* pml4);
-void free_task_address_space(page_table_t* pml4, uint64_t user_start, uint64_t user_end);
+void free_task_address_space(page_table_t* pml4);
 
 #endif
\ No newline at end of file
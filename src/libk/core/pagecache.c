@@ -0,0 +1,267 @@
+#include "pagecache.h"
+#include "mem.h"
+#include "slab.h"
+#include "../spinlock.h"
+#include "../../drv/disk/zfs.h"
+
+/*
+ * Page cache for ZenFS file data, keyed by (entry index, page index); a
+ * ZenFS block is exactly one page. A cached page holds one reference of
+ * its own; readers and user mappings get another from pcache_get() and
+ * drop it with put_page(). Only pages nobody else holds are evicted, and a
+ * page still mapped when its file is deleted lives on until the last
+ * mapping goes.
+ *
+ * Lookups go through a small hash table and an LRU list picks what to drop
+ * once PCACHE_MAX_PAGES are cached. The lock is never held across disk I/O,
+ * since the ATA driver waits with interrupts enabled.
+ */
+#define PCACHE_BUCKETS 256
+
+typedef struct pcache_page
+{
+    int entry;
+    uint32_t index;
+    uint64_t phys;
+    int dirty;                  // written through a shared mapping, not on disk yet
+    uint32_t sync_gen;
+    struct pcache_page *hash_next;
+    struct pcache_page *lru_prev, *lru_next;   // most recently used first
+} pcache_page_t;
+
+static pcache_page_t *buckets[PCACHE_BUCKETS];
+static pcache_page_t *lru_head = NULL;
+static pcache_page_t *lru_tail = NULL;
+static uint64_t cached_pages = 0;
+static uint32_t sync_gen = 0;
+static spinlock_t pcache_lock = {0};
+static kmem_cache_t *page_cache = NULL;
+
+void pcache_init(void)
+{
+    page_cache = kmem_cache_create("pcache_page_t", sizeof(pcache_page_t));
+}
+
+static pcache_page_t **bucket_of(int entry, uint32_t index)
+{
+    return &buckets[((uint32_t)entry * 2654435761u ^ index) % PCACHE_BUCKETS];
+}
+
+static pcache_page_t *lookup(int entry, uint32_t index)
+{
+    for (pcache_page_t *p = *bucket_of(entry, index); p; p = p->hash_next)
+    {
+        if (p->entry == entry && p->index == index)
+            return p;
+    }
+    return NULL;
+}
+
+static void lru_unlink(pcache_page_t *p)
+{
+    if (p->lru_prev)
+        p->lru_prev->lru_next = p->lru_next;
+    else
+        lru_head = p->lru_next;
+    if (p->lru_next)
+        p->lru_next->lru_prev = p->lru_prev;
+    else
+        lru_tail = p->lru_prev;
+}
+
+static void lru_push(pcache_page_t *p)
+{
+    p->lru_prev = NULL;
+    p->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = p;
+    else
+        lru_tail = p;
+    lru_head = p;
+}
+
+/* Take a page out of the hash and the LRU list. Called with the lock held. */
+static void detach(pcache_page_t *p)
+{
+    pcache_page_t **link = bucket_of(p->entry, p->index);
+    while (*link != p)
+        link = &(*link)->hash_next;
+    *link = p->hash_next;
+    lru_unlink(p);
+    cached_pages--;
+}
+
+/* The least recently used page only the cache holds, detached. Called with the lock held. */
+static pcache_page_t *pick_victim(void)
+{
+    for (pcache_page_t *p = lru_tail; p; p = p->lru_prev)
+    {
+        if (page_ref_count(p->phys) == 1)
+        {
+            detach(p);
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Drop the cache's reference to a detached page, writing it back first if asked. */
+static void release(pcache_page_t *p, int writeback)
+{
+    if (writeback && p->dirty)
+        zfs_write_page(p->entry, p->index, (void *)(p->phys + KERNEL_VIRT_OFFSET));
+    put_page(p->phys);
+    kmem_cache_free(page_cache, p);
+}
+
+static void evict_one(void)
+{
+    uint64_t rflags = spinlock_acquire_irqsave(&pcache_lock);
+    pcache_page_t *victim = pick_victim();
+    spinlock_release_irqrestore(&pcache_lock, rflags);
+    if (victim)
+        release(victim, 1);
+}
+
+/*
+ * Physical address of page `index` of a file, read from disk on a miss.
+ * The caller gets a reference of its own and gives it back with put_page(),
+ * or keeps it for as long as it maps the page. Returns 0 on failure.
+ */
+uint64_t pcache_get(int entry, uint32_t index)
+{
+    uint64_t rflags = spinlock_acquire_irqsave(&pcache_lock);
+    pcache_page_t *p = lookup(entry, index);
+    if (p)
+    {
+        lru_unlink(p);
+        lru_push(p);
+        page_ref_get(p->phys);
+        spinlock_release_irqrestore(&pcache_lock, rflags);
+        return p->phys;
+    }
+    int full = cached_pages >= PCACHE_MAX_PAGES;
+    spinlock_release_irqrestore(&pcache_lock, rflags);
+
+    if (full)
+        evict_one();
+    uint64_t phys = alloc_page();
+    if (!phys)
+    {
+        // Short on memory: give up a cached page before failing the read
+        evict_one();
+        phys = alloc_page();
+        if (!phys)
+            return 0;
+    }
+    p = kmem_cache_alloc(page_cache);
+    if (!p)
+    {
+        free_page(phys);
+        return 0;
+    }
+    if (zfs_read_page(entry, index, (void *)(phys + KERNEL_VIRT_OFFSET)) != ZFS_OK)
+    {
+        kmem_cache_free(page_cache, p);
+        free_page(phys);
+        return 0;
+    }
+    p->entry = entry;
+    p->index = index;
+    p->phys = phys;
+    p->dirty = 0;
+    p->sync_gen = 0;
+
+    rflags = spinlock_acquire_irqsave(&pcache_lock);
+    pcache_page_t *raced = lookup(entry, index);
+    if (raced)
+    {
+        // Someone else read the same block meanwhile; use theirs
+        page_ref_get(raced->phys);
+        uint64_t cached = raced->phys;
+        spinlock_release_irqrestore(&pcache_lock, rflags);
+        kmem_cache_free(page_cache, p);
+        free_page(phys);
+        return cached;
+    }
+    pcache_page_t **bucket = bucket_of(entry, index);
+    p->hash_next = *bucket;
+    *bucket = p;
+    lru_push(p);
+    cached_pages++;
+    page_ref_get(phys);
+    spinlock_release_irqrestore(&pcache_lock, rflags);
+    return phys;
+}
+
+void pcache_mark_dirty(int entry, uint32_t index)
+{
+    uint64_t rflags = spinlock_acquire_irqsave(&pcache_lock);
+    pcache_page_t *p = lookup(entry, index);
+    if (p)
+        p->dirty = 1;
+    spinlock_release_irqrestore(&pcache_lock, rflags);
+}
+
+/*
+ * Write back the dirty pages of a file (every file if entry < 0). A page
+ * that is still mapped stays dirty, since it can be written again without
+ * the cache noticing.
+ */
+void pcache_sync(int entry)
+{
+    uint64_t rflags = spinlock_acquire_irqsave(&pcache_lock);
+    uint32_t gen = ++sync_gen;
+    spinlock_release_irqrestore(&pcache_lock, rflags);
+
+    for (;;)
+    {
+        rflags = spinlock_acquire_irqsave(&pcache_lock);
+        pcache_page_t *p = lru_head;
+        while (p && !(p->dirty && p->sync_gen != gen && (entry < 0 || p->entry == entry)))
+            p = p->lru_next;
+        if (!p)
+        {
+            spinlock_release_irqrestore(&pcache_lock, rflags);
+            return;
+        }
+        p->sync_gen = gen;
+        if (page_ref_count(p->phys) == 1)
+            p->dirty = 0;
+        int file = p->entry;
+        uint32_t index = p->index;
+        uint64_t phys = p->phys;
+        page_ref_get(phys);
+        spinlock_release_irqrestore(&pcache_lock, rflags);
+
+        zfs_write_page(file, index, (void *)(phys + KERNEL_VIRT_OFFSET));
+        put_page(phys);
+    }
+}
+
+/* Forget the cached pages of a file (every file if entry < 0) without writing them back. */
+void pcache_invalidate(int entry)
+{
+    pcache_page_t *dropped = NULL;
+    uint64_t rflags = spinlock_acquire_irqsave(&pcache_lock);
+    pcache_page_t *p = lru_head;
+    while (p)
+    {
+        pcache_page_t *next = p->lru_next;
+        if (entry < 0 || p->entry == entry)
+        {
+            detach(p);
+            p->hash_next = dropped;
+            dropped = p;
+        }
+        p = next;
+    }
+    spinlock_release_irqrestore(&pcache_lock, rflags);
+
+    while (dropped)
+    {
+        pcache_page_t *next = dropped->hash_next;
+        release(dropped, 0);
+        dropped = next;
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stdint.h>
+
+// Cached file pages kept before the least recently used ones are dropped
+#define PCACHE_MAX_PAGES 2048
+
+void pcache_init(void);
+uint64_t pcache_get(int entry, uint32_t index);
+void pcache_mark_dirty(int entry, uint32_t index);
+void pcache_sync(int entry);
+void pcache_invalidate(int entry);
+
+#endif
@@ -0,0 +1,254 @@
+#include "slab.h"
+#include "mem.h"
+#include "../string.h"
+#include "../spinlock.h"
+#include "../debug/log.h"
+
+/*
+ * Slab allocator for small fixed-size objects. Every slab is a 32 KiB,
+ * naturally aligned buddy block with a slab_t header at its start, so the
+ * slab owning an object is found by masking the object's address. Free
+ * objects are chained through their first word. Caches keep slabs with free
+ * objects on a partial list and hold on to one empty slab so a cache that
+ * bounces around zero doesn't go back to the PMM on every call.
+ */
+#define SLAB_ORDER       3
+#define SLAB_SIZE        (PAGE_SIZE << SLAB_ORDER)
+#define SLAB_MAGIC       0x51AB51ABU
+#define SLAB_OBJ_OFFSET  64
+#define KMEM_MAX_CACHES  32
+
+typedef struct slab
+{
+    uint32_t magic;
+    uint32_t inuse;
+    kmem_cache_t *cache;
+    struct slab *next;
+    struct slab *prev;
+    void *free;
+} slab_t;
+
+struct kmem_cache
+{
+    char name[32];
+    size_t obj_size;
+    uint32_t objs_per_slab;
+    slab_t *partial;
+    slab_t *full;
+    slab_t *empty;
+    spinlock_t lock;
+    uint64_t slabs;
+    uint64_t inuse;
+};
+
+static kmem_cache_t caches[KMEM_MAX_CACHES];
+static uint32_t cache_count = 0;
+static spinlock_t cache_create_lock = {0};
+
+static const size_t size_classes[] = {8, 16, 32, 64, 96, 128, 192, 256, 512, 1024, 2048, 4096};
+#define SIZE_CLASS_COUNT (sizeof(size_classes) / sizeof(size_classes[0]))
+static kmem_cache_t *size_caches[SIZE_CLASS_COUNT];
+static int kmem_ready = 0;
+
+static void slab_list_push(slab_t **list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t **list, slab_t *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static slab_t *slab_create(kmem_cache_t *cache)
+{
+    uint64_t phys = alloc_page_block(SLAB_ORDER);
+    if (!phys)
+        return NULL;
+
+    slab_t *slab = (slab_t *)(phys + KERNEL_VIRT_OFFSET);
+    slab->magic = SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->cache = cache;
+    slab->next = slab->prev = NULL;
+    slab->free = NULL;
+
+    // Thread the free list in address order so fresh slabs hand out sequential objects
+    uint8_t *base = (uint8_t *)slab + SLAB_OBJ_OFFSET;
+    for (int i = cache->objs_per_slab - 1; i >= 0; i--)
+    {
+        void *obj = base + i * cache->obj_size;
+        *(void **)obj = slab->free;
+        slab->free = obj;
+    }
+    cache->slabs++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t *cache, slab_t *slab)
+{
+    slab->magic = 0;
+    cache->slabs--;
+    free_page_block((uint64_t)slab - KERNEL_VIRT_OFFSET, SLAB_ORDER);
+}
+
+static slab_t *obj_to_slab(void *obj)
+{
+    uint64_t addr = (uint64_t)obj;
+    if (addr < KERNEL_VIRT_OFFSET)
+        return NULL;
+    slab_t *slab = (slab_t *)(addr & ~(uint64_t)(SLAB_SIZE - 1));
+    if ((uint64_t)obj - (uint64_t)slab < SLAB_OBJ_OFFSET || slab->magic != SLAB_MAGIC)
+        return NULL;
+    return slab;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size)
+{
+    if (size == 0 || size > SLAB_SIZE - SLAB_OBJ_OFFSET)
+        return NULL;
+
+    spinlock_acquire(&cache_create_lock);
+    if (cache_count == KMEM_MAX_CACHES)
+    {
+        spinlock_release(&cache_create_lock);
+        log("Out of slab cache descriptors, can't create %s", 2, 0, name);
+        return NULL;
+    }
+    kmem_cache_t *cache = &caches[cache_count++];
+    spinlock_release(&cache_create_lock);
+
+    memset(cache, 0, sizeof(kmem_cache_t));
+    strncpy(cache->name, name, sizeof(cache->name) - 1);
+    cache->obj_size = (size + 7) & ~7ULL;
+    cache->objs_per_slab = (SLAB_SIZE - SLAB_OBJ_OFFSET) / cache->obj_size;
+    spinlock_init(&cache->lock);
+    return cache;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    if (!cache)
+        return NULL;
+
+    spinlock_acquire(&cache->lock);
+    slab_t *slab = cache->partial;
+    if (!slab)
+    {
+        slab = cache->empty;
+        cache->empty = NULL;
+        if (!slab)
+            slab = slab_create(cache);
+        if (!slab)
+        {
+            spinlock_release(&cache->lock);
+            return NULL;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void *obj = slab->free;
+    slab->free = *(void **)obj;
+    slab->inuse++;
+    cache->inuse++;
+    if (!slab->free)
+    {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+    spinlock_release(&cache->lock);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    slab_t *slab = obj_to_slab(obj);
+    if (!slab || slab->cache != cache)
+    {
+        log("kmem_cache_free: %p does not belong to cache %s", 3, 0, obj, cache ? cache->name : "(null)");
+        return;
+    }
+
+    spinlock_acquire(&cache->lock);
+    if (!slab->free)
+    {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    cache->inuse--;
+
+    slab_t *release = NULL;
+    if (!slab->inuse)
+    {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty)
+            release = slab;
+        else
+            cache->empty = slab;
+    }
+    if (release)
+        slab_destroy(cache, release);
+    spinlock_release(&cache->lock);
+}
+
+void kmem_init(void)
+{
+    for (size_t i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "kmalloc-%lu", size_classes[i]);
+        size_caches[i] = kmem_cache_create(name, size_classes[i]);
+    }
+    kmem_ready = 1;
+    log("Slab allocator initialized (%d size classes).", 4, 0, (int)SIZE_CLASS_COUNT);
+}
+
+void *kmem_alloc(size_t size)
+{
+    if (!kmem_ready || size > KMALLOC_SLAB_MAX)
+        return NULL;
+    for (size_t i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        if (size <= size_classes[i])
+            return kmem_cache_alloc(size_caches[i]);
+    }
+    return NULL;
+}
+
+void kmem_free(void *obj)
+{
+    slab_t *slab = obj_to_slab(obj);
+    if (slab)
+        kmem_cache_free(slab->cache, obj);
+}
+
+size_t kmem_size(void *obj)
+{
+    slab_t *slab = obj_to_slab(obj);
+    return slab ? slab->cache->obj_size : 0;
+}
+
+void kmem_print_info(int vis)
+{
+    for (uint32_t i = 0; i < cache_count; i++)
+    {
+        kmem_cache_t *cache = &caches[i];
+        if (!cache->slabs)
+            continue;
+        log("Slab cache %s: %lu objects of %lu bytes in use, %lu slabs", 1, vis,
+            cache->name, cache->inuse, cache->obj_size, cache->slabs);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KMALLOC_SLAB_MAX 4096
+
+typedef struct kmem_cache kmem_cache_t;
+
+void kmem_init(void);
+kmem_cache_t* kmem_cache_create(const char* name, size_t size);
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// Used by kmalloc/kfree for small sizes; kfree must rule out heap pointers first
+void* kmem_alloc(size_t size);
+void kmem_free(void* obj);
+size_t kmem_size(void* obj);
+void kmem_print_info(int vis);
+
+#endif
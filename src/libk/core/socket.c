@@ -17,6 +17,7 @@ void socket_init(void)
         socket_files[i].write_pos = 0;
         socket_files[i].available = 0;
         socket_files[i].capacity = 0;
+        wait_queue_init(&socket_files[i].readers);
         memset(socket_files[i].name, 0, SOCKET_NAME_MAX);
     }
 
@@ -47,7 +48,7 @@ socket_error_t socket_create(const char *name)
         if (!socket_files[i].in_use)
         {
 
-            socket_files[i].data = (uint8_t *)kmalloc(SOCKET_FILE_SIZE);
+            socket_files[i].data = (uint8_t *)vmalloc(SOCKET_FILE_SIZE);
             if (!socket_files[i].data)
             {
 
@@ -121,6 +122,29 @@ socket_error_t socket_read(socket_file_t *file, void *buffer, uint32_t size, uin
     return SOCKET_OK;
 }
 
+static int socket_readable(void *arg)
+{
+    socket_file_t *file = (socket_file_t *)arg;
+    return file->available > 0 || !file->in_use;
+}
+
+/* Like socket_read(), but sleeps until there is data instead of failing */
+socket_error_t socket_read_wait(socket_file_t *file, void *buffer, uint32_t size, uint32_t *bytes_read)
+{
+    if (!initialized || !file || !buffer || !bytes_read)
+    {
+        return SOCKET_ERROR_INVALID;
+    }
+
+    wait_until(&file->readers, socket_readable, file, 0);
+    if (!file->in_use)
+    {
+        *bytes_read = 0;
+        return SOCKET_ERROR_NOT_FOUND;
+    }
+    return socket_read(file, buffer, size, bytes_read);
+}
+
 socket_error_t socket_write(socket_file_t *file, const void *buffer, uint32_t size)
 {
     if (!initialized || !file || !buffer || size == 0)
@@ -143,6 +167,7 @@ socket_error_t socket_write(socket_file_t *file, const void *buffer, uint32_t si
     }
 
     file->available += size;
+    wake_up_all(&file->readers);
 
     return SOCKET_OK;
 }
@@ -160,10 +185,12 @@ socket_error_t socket_delete(const char *name)
         {
             if (socket_files[i].data)
             {
-                kfree(socket_files[i].data);
+                vfree(socket_files[i].data);
                 socket_files[i].data = NULL;
             }
             socket_files[i].in_use = false;
+            // Readers still asleep on it get SOCKET_ERROR_NOT_FOUND
+            wake_up_all(&socket_files[i].readers);
 
             log("Socket deleted: %s", 1, 0, name);
             return SOCKET_OK;
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include "../../kernel/wait.h"
 
 #define SOCKET_MAX_FILES 64
 #define SOCKET_FILE_SIZE (256 * 1024)
@@ -31,12 +32,14 @@ typedef struct
     uint32_t write_pos;
     uint32_t available;
     bool in_use;
+    wait_queue_t readers;       // blocked in socket_read_wait()
 } socket_file_t;
 
 void socket_init(void);
 socket_error_t socket_create(const char *name);
 socket_error_t socket_open(const char *name, socket_file_t **file);
 socket_error_t socket_read(socket_file_t *file, void *buffer, uint32_t size, uint32_t *bytes_read);
+socket_error_t socket_read_wait(socket_file_t *file, void *buffer, uint32_t size, uint32_t *bytes_read);
 socket_error_t socket_write(socket_file_t *file, const void *buffer, uint32_t size);
 socket_error_t socket_delete(const char *name);
 socket_error_t socket_close(socket_file_t *file);
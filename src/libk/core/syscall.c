@@ -1,6 +1,7 @@
 #include "syscall.h"
 #include "elf.h"
 #include "../debug/log.h"
+#include "../debug/memprof.h"
 #include "../../drv/keyboard.h"
 #include "../../drv/mouse.h"
 #include "../../drv/speaker.h"
@@ -12,9 +13,11 @@
 #include "../../cpu/gdt.h"
 #include "mem.h"
 #include "socket.h"
+#include "../string.h"
+#include "tlb.h"
+#include "vma.h"
 
 extern void syscall_entry(void);
-extern tss_t tss;
 
 void init_syscalls(void)
 {
@@ -36,7 +39,7 @@ void init_syscalls(void)
     efer_lo |= 1;
     __asm__ volatile("wrmsr" : : "c"(0xC0000080), "a"(efer_lo), "d"(efer_hi));
     
-    uint64_t kernel_gs_base = (uint64_t)&tss;
+    uint64_t kernel_gs_base = (uint64_t)&tss[smp_cpu_id()];
     uint32_t gs_lo = kernel_gs_base & 0xFFFFFFFF;
     uint32_t gs_hi = kernel_gs_base >> 32;
     __asm__ volatile("wrmsr" : : "c"(0xC0000102), "a"(gs_lo), "d"(gs_hi));
@@ -44,11 +47,36 @@ void init_syscalls(void)
     log("Syscalls initialized.", 4, 0);
 }
 
-uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+/* Can user mappings go in [start, end)? Slot 0 above 1 GiB is the kernel's identity map. */
+static int user_range_ok(uint64_t start, uint64_t end)
 {
-    (void)arg4;
-    (void)arg5;
+    if (end <= start) return 0;
+    if (start >= USER_SPACE_START && end <= USER_HEAP_END) return 1;
+    return start >= USER_MMAP_START && end <= USER_MMAP_END;
+}
+
+/*
+ * Move the program break. Growing only reserves the new pages (they are
+ * backed on first touch); shrinking gives back whatever was mapped.
+ */
+static int set_brk(task_t *task, uint64_t new_brk)
+{
+    uint64_t old_end = (task->brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint64_t new_end = (new_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (new_end > USER_HEAP_END) return -1;
     
+    if (new_end > old_end) {
+        if (vma_add(&task->vmas, old_end, new_end, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS)) return -1;
+    } else if (new_end < old_end) {
+        if (vma_unmap(task->pml4, &task->vmas, new_end, old_end)) return -1;
+    }
+    
+    task->brk = new_brk;
+    return 0;
+}
+
+uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, syscall_frame_t *frame)
+{
     switch(num) {
         case SYSCALL_EXEC: {
             const char *filename = (const char*)arg1;
@@ -59,15 +87,54 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t ar
         }
         
         case SYSCALL_EXIT: {
-            log("Task exiting.", 1, 0);
             task_t *current = sched_current_task();
             if (current) {
+                log("Task %s exiting (%lu minor faults).", 1, 0, current->name, current->minor_faults);
                 current->state = TASK_DEAD;
             }
             sched_yield();
             return 0;
         }
         
+        case SYSCALL_FORK: {
+            task_t *current = sched_current_task();
+            if (!current || current->is_kernel_task) return -1;
+            
+            page_table_t *pml4 = fork_page_directory(current->pml4);
+            if (!pml4) return -1;
+            
+            // The child resumes after the syscall instruction with rax = 0
+            registers_t regs = {0};
+            regs.r15 = frame->rsp_copy;
+            regs.r14 = frame->r14;
+            regs.r13 = frame->r13;
+            regs.r12 = frame->r12;
+            regs.r11 = frame->r11;
+            regs.r10 = frame->r10;
+            regs.r9 = frame->r9;
+            regs.r8 = frame->r8;
+            regs.rbp = frame->rbp;
+            regs.rdi = frame->rdi;
+            regs.rsi = frame->rsi;
+            regs.rdx = frame->rdx;
+            regs.rcx = frame->rcx;
+            regs.rbx = frame->rbx;
+            regs.rax = 0;
+            regs.rip = frame->rip;
+            regs.rflags = frame->rflags | 0x200;
+            regs.userrsp = frame->rsp;
+            regs.cs = 0x23;
+            regs.ss = 0x1B;
+            regs.ds = 0x1B;
+            
+            task_t *child = task_fork(current, pml4, &regs);
+            if (!child) {
+                free_task_address_space(pml4);
+                return -1;
+            }
+            return child->pid;
+        }
+        
         case SYSCALL_GETPID: {
             task_t *current = sched_current_task();
             return current ? current->pid : 0;
@@ -78,8 +145,40 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t ar
             return 0;
         }
         
+        case SYSCALL_SCHEDSTAT:
+            return sched_get_stat((uint32_t)arg1, (sched_stat_t*)arg2);
+        
+        // PID 0 means the caller
+        case SYSCALL_SETPRIORITY:
+        case SYSCALL_GETPRIORITY: {
+            task_t *current = sched_current_task();
+            uint64_t pid = arg1 ? arg1 : (current ? current->pid : 0);
+            if (num == SYSCALL_SETPRIORITY)
+                return sched_set_priority(pid, (int)arg2);
+            return sched_get_priority(pid);
+        }
+        
+        // -1 queries the active class
+        case SYSCALL_SCHEDPOLICY:
+            if ((int)arg1 == -1)
+                return sched_get_policy();
+            return sched_set_policy((int)arg1);
+        
+        case SYSCALL_MEMPROF: {
+            switch (arg1) {
+                case MEMPROF_CMD_DISABLE: memprof_disable(); break;
+                case MEMPROF_CMD_ENABLE:  memprof_enable(); break;
+                case MEMPROF_CMD_DUMP:    memprof_dump((int)arg2); break;
+                case MEMPROF_CMD_LEAKS:   memprof_leak_report((uint32_t)arg2, (int)arg3); break;
+                case MEMPROF_CMD_RESET:   memprof_reset(); break;
+                default: return -1;
+            }
+            return 0;
+        }
+        
+        // Blocks until a key is pressed
         case SYSCALL_GETKEY:
-            return (uint64_t)get_key();
+            return (uint64_t)wait_for_key();
         
         case SYSCALL_PRINTS: {
             const char *str = (const char*)arg1;
@@ -223,23 +322,8 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t ar
             
             if (new_brk < USER_HEAP_START) return -1;
             
-            static uint64_t current_brk = USER_HEAP_START;
-            uint64_t old_brk = current_brk;
-            
-            if (new_brk > current_brk) {
-                uint64_t start = (current_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-                uint64_t end = (new_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-                
-                for (uint64_t virt = start; virt < end; virt += PAGE_SIZE) {
-                    if (virt_to_phys(current->pml4, virt) == 0) {
-                        uint64_t phys = alloc_page();
-                        if (!phys) return -1;
-                        map_page(current->pml4, virt, phys, PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER);
-                    }
-                }
-            }
-            
-            current_brk = new_brk;
+            uint64_t old_brk = current->brk;
+            if (set_brk(current, new_brk)) return -1;
             return old_brk;
         }
         
@@ -248,26 +332,12 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t ar
             task_t *current = sched_current_task();
             if (!current || !current->pml4) return -1;
             
-            static uint64_t current_brk = USER_HEAP_START;
-            uint64_t old_brk = current_brk;
-            uint64_t new_brk = current_brk + increment;
+            uint64_t old_brk = current->brk;
+            uint64_t new_brk = old_brk + increment;
             
             if (new_brk < USER_HEAP_START) return -1;
             
-            if (increment > 0) {
-                uint64_t start = (current_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-                uint64_t end = (new_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-                
-                for (uint64_t virt = start; virt < end; virt += PAGE_SIZE) {
-                    if (virt_to_phys(current->pml4, virt) == 0) {
-                        uint64_t phys = alloc_page();
-                        if (!phys) return -1;
-                        map_page(current->pml4, virt, phys, PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER);
-                    }
-                }
-            }
-            
-            current_brk = new_brk;
+            if (set_brk(current, new_brk)) return -1;
             return old_brk;
         }
         
@@ -276,24 +346,62 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t ar
             size_t length = (size_t)arg2;
             int prot = (int)arg3;
             int flags = (int)arg4;
-            (void)flags;
+            zfs_file_t *file = NULL;
+            uint64_t offset = frame->r9;    // sixth argument
             
             task_t *current = sched_current_task();
             if (!current || !current->pml4) return -1;
             
-            uint64_t virt_start = addr ? (uint64_t)addr : USER_HEAP_START + 0x10000000;
-            size_t pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+            if (!length) return -1;
+            
+            // Without MAP_ANONYMOUS, arg5 is an open file mapped from a page-aligned offset
+            if (!(flags & MAP_ANONYMOUS)) {
+                file = (zfs_file_t*)arg5;
+                if (!file || !file->is_open || (offset & (PAGE_SIZE - 1)) || (flags & MAP_HUGETLB)) return -1;
+            }
+            
+            uint64_t align = (flags & MAP_HUGETLB) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+            length = (length + align - 1) & ~(align - 1);
+            
+            // addr is only a hint unless MAP_FIXED; otherwise take the lowest hole that fits
+            uint64_t virt_start = (uint64_t)addr;
+            if (!(flags & MAP_FIXED)) {
+                virt_start = (virt_start + align - 1) & ~(align - 1);
+                if (virt_start < USER_MMAP_START || virt_start + length > USER_MMAP_END ||
+                    vma_get_unmapped_area(&current->vmas, length, virt_start, virt_start + length) != virt_start) {
+                    // Over-ask by align so the hole can be aligned up
+                    virt_start = vma_get_unmapped_area(&current->vmas, length + align - PAGE_SIZE, USER_MMAP_START, USER_MMAP_END);
+                    if (!virt_start) return -1;
+                    virt_start = (virt_start + align - 1) & ~(align - 1);
+                }
+            } else {
+                if ((virt_start & (align - 1)) || !user_range_ok(virt_start, virt_start + length)) return -1;
+                if (vma_unmap(current->pml4, &current->vmas, virt_start, virt_start + length)) return -1;
+            }
+            
+            if (file) {
+                // Pages come from the page cache as they are touched
+                if (vma_add_file(&current->vmas, virt_start, virt_start + length, prot, flags & ~MAP_FIXED,
+                                 file->entry_index, file->generation, offset / PAGE_SIZE)) return -1;
+                return virt_start;
+            }
             
-            uint64_t page_flags = PAGE_PRESENT | PAGE_USER;
-            if (prot & 0x2) page_flags |= PAGE_WRITABLE;
+            if (vma_add(&current->vmas, virt_start, virt_start + length, prot, flags & ~MAP_FIXED)) return -1;
             
-            for (size_t i = 0; i < pages; i++) {
-                uint64_t virt = virt_start + (i * PAGE_SIZE);
-                uint64_t phys = alloc_page();
-                if (!phys) return -1;
-                map_page(current->pml4, virt, phys, page_flags);
+            // Areas with no access (prot 0) stay unmapped; the fault path refuses them too
+            if ((flags & MAP_HUGETLB) && prot) {
+                uint64_t page_flags = vma_page_flags(vma_find(&current->vmas, virt_start));
+                for (uint64_t off = 0; off < length; off += HUGE_PAGE_SIZE) {
+                    // Without a free 2MB block the chunk is left to demand faults in 4KB pages
+                    uint64_t phys = alloc_huge_page();
+                    if (phys) {
+                        memset((void*)(phys + KERNEL_VIRT_OFFSET), 0, HUGE_PAGE_SIZE);
+                        map_huge_page(current->pml4, virt_start + off, phys, page_flags);
+                    }
+                }
             }
             
+            // Everything not mapped above is allocated as it is first touched
             return virt_start;
         }
         
@@ -306,16 +414,10 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t ar
             
             uint64_t virt_start = (uint64_t)addr;
             size_t pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+            // An unaligned start would leave areas with unaligned bounds
+            if (virt_start & (PAGE_SIZE - 1)) return -1;
             
-            for (size_t i = 0; i < pages; i++) {
-                uint64_t virt = virt_start + (i * PAGE_SIZE);
-                uint64_t phys = virt_to_phys(current->pml4, virt);
-                if (phys) {
-                    free_page(phys);
-                    unmap_page(current->pml4, virt);
-                }
-            }
-            return 0;
+            return vma_unmap(current->pml4, &current->vmas, virt_start, virt_start + pages * PAGE_SIZE);
         }
         
         case SYSCALL_GETTIMEOFDAY: {
@@ -377,6 +479,15 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t ar
             return socket_read(file, buffer, size, bytes_read);
         }
         
+        case SYSCALL_SOCKET_READ_WAIT: {
+            socket_file_t *file = (socket_file_t*)arg1;
+            void *buffer = (void*)arg2;
+            uint32_t size = (uint32_t)arg3;
+            uint32_t *bytes_read = (uint32_t*)arg4;
+            if (!file || !buffer) return -1;
+            return socket_read_wait(file, buffer, size, bytes_read);
+        }
+        
         case SYSCALL_SOCKET_WRITE: {
             socket_file_t *file = (socket_file_t*)arg1;
             const void *buffer = (const void*)arg2;
@@ -44,6 +44,17 @@
 #define SYSCALL_MMAP        25
 #define SYSCALL_MUNMAP      26
 
+// mmap prot/flags (match userland/userlib.h)
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_GROWSDOWN 0x100
+#define MAP_HUGETLB   0x40000
+
 // Time
 #define SYSCALL_GETTIMEOFDAY 27
 #define SYSCALL_CLOCK_GETTIME 28
@@ -71,6 +82,17 @@
 // Yield
 #define SYSCALL_YIELD       43
 
+// Debugging
+#define SYSCALL_MEMPROF     44
+
+// Processes
+#define SYSCALL_FORK        45
+#define SYSCALL_SCHEDSTAT   46
+#define SYSCALL_SETPRIORITY 47
+#define SYSCALL_GETPRIORITY 48
+#define SYSCALL_SCHEDPOLICY 49
+#define SYSCALL_SOCKET_READ_WAIT 50
+
 // stat structure for file info
 typedef struct {
     uint32_t st_dev;        // device ID
@@ -109,7 +131,24 @@ typedef struct {
     char machine[65];
 } utsname_t;
 
+// scheduler counters for one CPU
+typedef struct {
+    uint64_t nr_tasks;      // tasks on the CPU's run queue
+    uint64_t steals;        // balance passes that pulled tasks onto the CPU
+    uint64_t migrations;    // tasks pulled onto the CPU from other queues
+} sched_stat_t;
+
+// User registers as saved by syscall_entry, lowest address first
+typedef struct {
+    uint64_t rsp_copy;      // r15 slot, holds the user RSP (r15 is used as scratch)
+    uint64_t r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t rflags;
+    uint64_t rip;
+    uint64_t rsp;
+} syscall_frame_t;
+
 void init_syscalls(void);
-uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5);
+uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, syscall_frame_t *frame);
 
 #endif
\ No newline at end of file
@@ -4,10 +4,15 @@ global syscall_entry
 extern syscall_handler
 extern tss
 
+TSS_SIZE equ 104                ; sizeof(tss_t)
+
 syscall_entry:
     ; Swap to kernel stack
     swapgs                      ; Get kernel GS (if you're using it)
-    mov r15, qword [rel tss + 4]  ; Load full 64-bit RSP0
+    str r15                     ; TR = 0x28 + 16 * cpu, picks this CPU's TSS
+    shr r15, 4
+    imul r15, r15, TSS_SIZE
+    mov r15, qword [tss + r15 - 2 * TSS_SIZE + 4]  ; Load full 64-bit RSP0
     xchg rsp, r15               ; Swap to kernel stack
     
     ; Save user context
@@ -32,6 +37,11 @@ syscall_entry:
     push r14
     push r15
     
+    ; The saved registers (syscall_frame_t) go in as the 7th argument
+    mov r11, rsp
+    sub rsp, 8
+    push r11
+    
     ; Syscall args: rax=num, rdi=arg1, rsi=arg2, rdx=arg3, r10=arg4, r8=arg5
     ; C calling convention: rdi, rsi, rdx, rcx, r8, r9
     mov r9, r8      ; arg5
@@ -42,6 +52,7 @@ syscall_entry:
     mov rdi, rax    ; syscall number
     
     call syscall_handler
+    add rsp, 16
     
     ; Restore registers
     pop r15
@@ -0,0 +1,452 @@
+#include "tlb.h"
+#include "../spinlock.h"
+#include "../debug/log.h"
+#include "../../cpu/smp.h"
+#include "../../cpu/isr.h"
+#include "../../drv/local_apic.h"
+
+/*
+ * Process-context identifiers. Each user address space is tagged with a
+ * PCID so CR3 switches can keep its TLB entries around (bit 63 of CR3 set).
+ * The kernel's own PML4 always uses PCID 0.
+ *
+ * PCIDs are handed out from a single counter and never reused within a
+ * generation. When the 4095 IDs run out the generation is bumped, every
+ * address space picks up a fresh PCID the next time it is switched to, and
+ * each CPU does one full flush the first time it switches in the new
+ * generation. Invalidations aimed at an address space a CPU isn't running
+ * right now are recorded in a per-CPU stale mask, and that CPU switches to
+ * it with a flush next time.
+ *
+ * Kernel-half mappings are shared by every PCID, so anything in the upper
+ * half that can later be unmapped must be mapped PAGE_GLOBAL: invlpg drops
+ * global translations regardless of the current PCID.
+ *
+ * Other CPUs are kept coherent with shootdown IPIs. The sender puts a
+ * request on each target's queue, kicks it with IPI_TLB_SHOOTDOWN and waits
+ * for every target to acknowledge. Only CPUs that currently have the address
+ * space loaded are interrupted; the rest get a stale bit and flush when they
+ * next switch to it. Kernel-half ranges go to every online CPU. While
+ * waiting, a sender keeps draining its own queue so two CPUs shooting at
+ * each other with interrupts off can't deadlock.
+ */
+#define PCID_COUNT       4096
+#define PCID_TABLE_SIZE  1024
+#define PCID_TOMBSTONE   ((page_table_t *)1)
+#define CR3_NOFLUSH      (1ULL << 63)
+#define CR4_PGE          (1ULL << 7)
+#define CR4_PCIDE        (1ULL << 17)
+#define TLB_QUEUE_SIZE   16
+
+typedef struct
+{
+    page_table_t *pml4;
+    uint64_t start;
+    uint32_t pages;             // 0 flushes the whole address space
+    volatile uint32_t pending;  // targets that haven't acknowledged yet
+} tlb_request_t;
+
+typedef struct
+{
+    spinlock_t lock;
+    tlb_request_t *requests[TLB_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t count;
+} tlb_queue_t;
+
+typedef struct
+{
+    page_table_t *pml4;
+    uint64_t generation;
+    uint32_t stale_mask;
+    uint16_t pcid;
+} pcid_entry_t;
+
+static pcid_entry_t pcid_table[PCID_TABLE_SIZE];
+static spinlock_t pcid_lock = {0};
+static uint16_t next_pcid = 1;
+static uint64_t pcid_generation = 1;
+static uint32_t kernel_stale_mask = 0;
+static uint64_t cpu_generation[MAX_CPUS];
+static int cpu_pcid_on[MAX_CPUS];
+static int has_invpcid = 0;
+static page_table_t *cpu_active_pml4[MAX_CPUS];
+static volatile uint32_t cpu_online_mask = 0;
+static tlb_queue_t tlb_queues[MAX_CPUS];
+
+static void tlb_shootdown_handler(registers_t *regs);
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+static inline void invpcid(uint64_t type, uint16_t pcid, uint64_t addr)
+{
+    struct { uint64_t pcid; uint64_t addr; } desc = {pcid, addr};
+    __asm__ volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+static inline uint64_t read_cr3(void)
+{
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+/* Drop every translation for every PCID, including global ones. */
+static void flush_all_contexts(void)
+{
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE) : "memory");
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+void tlb_init_cpu(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t cpu = smp_cpu_id();
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    int has_pcid = (ecx >> 17) & 1;
+    int has_pge = (edx >> 13) & 1;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7)
+    {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        has_invpcid = (ebx >> 10) & 1;
+    }
+
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (has_pge)
+        cr4 |= CR4_PGE;
+    // PCIDE can only be set while CR3 holds PCID 0, which the kernel PML4 always does.
+    if (has_pcid && has_pge && !(read_cr3() & 0xFFF))
+    {
+        cr4 |= CR4_PCIDE;
+        cpu_pcid_on[cpu] = 1;
+    }
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    cpu_generation[cpu] = pcid_generation;
+    cpu_active_pml4[cpu] = get_kernel_pml4();
+
+    if (cpu == 0)
+        register_interrupt_handler(IPI_TLB_SHOOTDOWN, tlb_shootdown_handler, "TLB Shootdown");
+    __atomic_or_fetch(&cpu_online_mask, 1U << cpu, __ATOMIC_SEQ_CST);
+
+    if (cpu == 0)
+        log("PCID %s, INVPCID %s.", 1, 0, cpu_pcid_on[cpu] ? "enabled" : "unavailable",
+            has_invpcid ? "available" : "unavailable");
+}
+
+int tlb_pcid_enabled(void)
+{
+    return cpu_pcid_on[smp_cpu_id()];
+}
+
+static pcid_entry_t *pcid_lookup(page_table_t *pml4, int create)
+{
+    uint32_t idx = ((uint64_t)pml4 >> 12) & (PCID_TABLE_SIZE - 1);
+    pcid_entry_t *free_slot = NULL;
+    for (uint32_t probe = 0; probe < PCID_TABLE_SIZE; probe++)
+    {
+        pcid_entry_t *entry = &pcid_table[(idx + probe) & (PCID_TABLE_SIZE - 1)];
+        if (entry->pml4 == pml4)
+            return entry;
+        if (entry->pml4 == PCID_TOMBSTONE && !free_slot)
+            free_slot = entry;
+        if (!entry->pml4)
+        {
+            if (!free_slot)
+                free_slot = entry;
+            break;
+        }
+    }
+    if (!create || !free_slot)
+        return NULL;
+    free_slot->pml4 = pml4;
+    free_slot->generation = 0;
+    free_slot->stale_mask = 0;
+    return free_slot;
+}
+
+uint64_t tlb_switch_cr3(page_table_t *pml4)
+{
+    uint64_t phys = (uint64_t)pml4 - KERNEL_VIRT_OFFSET;
+    uint32_t cpu = smp_cpu_id();
+    __atomic_store_n(&cpu_active_pml4[cpu], pml4, __ATOMIC_SEQ_CST);
+    if (!cpu_pcid_on[cpu])
+        return phys;
+
+    int flush = 0;
+    uint16_t pcid = 0;
+    spinlock_acquire(&pcid_lock);
+    if (pml4 == get_kernel_pml4())
+    {
+        flush = (kernel_stale_mask >> cpu) & 1;
+        kernel_stale_mask &= ~(1U << cpu);
+    }
+    else
+    {
+        pcid_entry_t *entry = pcid_lookup(pml4, 1);
+        if (!entry)
+        {
+            // Table full: run this address space untagged, flushing every time.
+            spinlock_release(&pcid_lock);
+            return phys;
+        }
+        if (entry->generation != pcid_generation)
+        {
+            if (next_pcid == PCID_COUNT)
+            {
+                pcid_generation++;
+                next_pcid = 1;
+            }
+            entry->pcid = next_pcid++;
+            entry->generation = pcid_generation;
+            entry->stale_mask = 0;
+        }
+        flush = (entry->stale_mask >> cpu) & 1;
+        entry->stale_mask &= ~(1U << cpu);
+        pcid = entry->pcid;
+    }
+    if (cpu_generation[cpu] != pcid_generation)
+    {
+        // PCIDs from the last generation are being reused; forget all of them once.
+        cpu_generation[cpu] = pcid_generation;
+        flush_all_contexts();
+        flush = 0;
+    }
+    spinlock_release(&pcid_lock);
+
+    return phys | pcid | (flush ? 0 : CR3_NOFLUSH);
+}
+
+static int is_current(page_table_t *pml4)
+{
+    return (read_cr3() & 0x000FFFFFFFFFF000) == (uint64_t)pml4 - KERNEL_VIRT_OFFSET;
+}
+
+/* Invalidate a range of a user address space this CPU doesn't have loaded. */
+static void invalidate_inactive(page_table_t *pml4, uint64_t start, uint32_t pages, uint32_t cpu)
+{
+    spinlock_acquire(&pcid_lock);
+    if (pml4 == get_kernel_pml4())
+    {
+        kernel_stale_mask |= 1U << cpu;
+    }
+    else
+    {
+        pcid_entry_t *entry = pcid_lookup(pml4, 0);
+        if (entry && entry->generation == pcid_generation)
+        {
+            if (!has_invpcid)
+                entry->stale_mask |= 1U << cpu;
+            else if (!pages)
+                invpcid(1, entry->pcid, 0);
+            else
+                for (uint32_t i = 0; i < pages; i++)
+                    invpcid(0, entry->pcid, start + i * PAGE_SIZE);
+        }
+    }
+    spinlock_release(&pcid_lock);
+}
+
+static void invalidate_local(page_table_t *pml4, uint64_t start, uint32_t pages)
+{
+    uint32_t cpu = smp_cpu_id();
+    int global = start >= KERNEL_VIRT_OFFSET;
+    if (pages > TLB_FULL_FLUSH_PAGES)
+        pages = 0;
+
+    if (!global && !is_current(pml4))
+    {
+        // Without PCIDs the next switch to it flushes anyway.
+        if (cpu_pcid_on[cpu])
+            invalidate_inactive(pml4, start, pages, cpu);
+        return;
+    }
+    if (pages)
+    {
+        for (uint32_t i = 0; i < pages; i++)
+            __asm__ volatile("invlpg (%0)" : : "r"(start + i * PAGE_SIZE) : "memory");
+    }
+    else if (global)
+    {
+        flush_all_contexts();
+    }
+    else
+    {
+        // Reloading CR3 without the no-flush bit drops this PCID's entries.
+        __asm__ volatile("mov %0, %%cr3" : : "r"(read_cr3()) : "memory");
+    }
+}
+
+static void tlb_process_queue(void)
+{
+    tlb_queue_t *queue = &tlb_queues[smp_cpu_id()];
+    for (;;)
+    {
+        spinlock_acquire(&queue->lock);
+        if (!queue->count)
+        {
+            spinlock_release(&queue->lock);
+            return;
+        }
+        tlb_request_t *req = queue->requests[queue->head];
+        queue->head = (queue->head + 1) % TLB_QUEUE_SIZE;
+        queue->count--;
+        spinlock_release(&queue->lock);
+
+        invalidate_local(req->pml4, req->start, req->pages);
+        __atomic_sub_fetch(&req->pending, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void tlb_shootdown_handler(registers_t *regs)
+{
+    (void)regs;
+    tlb_process_queue();
+}
+
+void tlb_process_pending(void)
+{
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    tlb_process_queue();
+    if (rflags & 0x200)
+        __asm__ volatile("sti" : : : "memory");
+}
+
+static void tlb_enqueue(uint32_t cpu, tlb_request_t *req)
+{
+    tlb_queue_t *queue = &tlb_queues[cpu];
+    for (;;)
+    {
+        spinlock_acquire(&queue->lock);
+        if (queue->count < TLB_QUEUE_SIZE)
+        {
+            queue->requests[(queue->head + queue->count) % TLB_QUEUE_SIZE] = req;
+            queue->count++;
+            spinlock_release(&queue->lock);
+            break;
+        }
+        spinlock_release(&queue->lock);
+        tlb_process_queue();
+        __asm__ volatile("pause");
+    }
+    LocalApicSendIpi(smp_cpu_lapic_id(cpu), IPI_TLB_SHOOTDOWN);
+}
+
+void tlb_flush_range(page_table_t *pml4, uint64_t start, uint32_t pages)
+{
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    uint32_t self = smp_cpu_id();
+    int global = start >= KERNEL_VIRT_OFFSET;
+    invalidate_local(pml4, start, pages);
+
+    // Pick the CPUs that need an IPI, and leave the rest a stale mark.
+    uint32_t online = cpu_online_mask & ~(1U << self);
+    uint32_t targets = 0, target_count = 0;
+    spinlock_acquire(&pcid_lock);
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        if (!(online & (1U << cpu)))
+            continue;
+        if (global || __atomic_load_n(&cpu_active_pml4[cpu], __ATOMIC_SEQ_CST) == pml4)
+        {
+            targets |= 1U << cpu;
+            target_count++;
+        }
+    }
+    if (!global && cpu_pcid_on[self])
+    {
+        uint32_t lazy = online & ~targets;
+        if (pml4 == get_kernel_pml4())
+        {
+            kernel_stale_mask |= lazy;
+        }
+        else
+        {
+            pcid_entry_t *entry = pcid_lookup(pml4, 0);
+            if (entry)
+                entry->stale_mask |= lazy;
+        }
+    }
+    spinlock_release(&pcid_lock);
+
+    if (targets)
+    {
+        tlb_request_t req = {pml4, start, pages, target_count};
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+        {
+            if (targets & (1U << cpu))
+                tlb_enqueue(cpu, &req);
+        }
+        while (__atomic_load_n(&req.pending, __ATOMIC_SEQ_CST))
+        {
+            tlb_process_queue();
+            __asm__ volatile("pause");
+        }
+    }
+
+    if (rflags & 0x200)
+        __asm__ volatile("sti" : : : "memory");
+}
+
+void tlb_flush_page(page_table_t *pml4, uint64_t virt)
+{
+    tlb_flush_range(pml4, virt & ~(uint64_t)(PAGE_SIZE - 1), 1);
+}
+
+void tlb_batch_init(tlb_batch_t *batch, page_table_t *pml4)
+{
+    batch->pml4 = pml4;
+    batch->start = 0;
+    batch->end = 0;
+    batch->pages = 0;
+}
+
+void tlb_batch_add(tlb_batch_t *batch, uint64_t virt)
+{
+    virt &= ~(uint64_t)(PAGE_SIZE - 1);
+    if (!batch->pages || virt < batch->start)
+        batch->start = virt;
+    if (!batch->pages || virt + PAGE_SIZE > batch->end)
+        batch->end = virt + PAGE_SIZE;
+    batch->pages++;
+}
+
+/* Queue every page of [virt, virt + size); a span this large usually means a full flush */
+void tlb_batch_add_span(tlb_batch_t *batch, uint64_t virt, uint64_t size)
+{
+    virt &= ~(uint64_t)(PAGE_SIZE - 1);
+    if (!batch->pages || virt < batch->start)
+        batch->start = virt;
+    if (!batch->pages || virt + size > batch->end)
+        batch->end = virt + size;
+    batch->pages += (uint32_t)(size / PAGE_SIZE);
+}
+
+void tlb_batch_flush(tlb_batch_t *batch)
+{
+    if (!batch->pages)
+        return;
+    // Flush the covering range page by page while it's small, otherwise everything.
+    uint64_t span = (batch->end - batch->start) / PAGE_SIZE;
+    tlb_flush_range(batch->pml4, batch->start, span <= TLB_FULL_FLUSH_PAGES ? (uint32_t)span : 0);
+    batch->pages = 0;
+}
+
+void tlb_release(page_table_t *pml4)
+{
+    spinlock_acquire(&pcid_lock);
+    pcid_entry_t *entry = pcid_lookup(pml4, 0);
+    if (entry)
+        entry->pml4 = PCID_TOMBSTONE;
+    spinlock_release(&pcid_lock);
+}
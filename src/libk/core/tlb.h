@@ -0,0 +1,31 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <stdint.h>
+#include "mem.h"
+
+// Above this many pages a range flush becomes a full flush of the address space
+#define TLB_FULL_FLUSH_PAGES 32
+
+// Accumulates invalidations so a run of unmaps costs one shootdown
+typedef struct tlb_batch {
+    page_table_t* pml4;
+    uint64_t start;
+    uint64_t end;
+    uint32_t pages;
+} tlb_batch_t;
+
+void tlb_init_cpu(void);
+int tlb_pcid_enabled(void);
+uint64_t tlb_switch_cr3(page_table_t* pml4);
+void tlb_flush_page(page_table_t* pml4, uint64_t virt);
+void tlb_flush_range(page_table_t* pml4, uint64_t start, uint32_t pages);
+void tlb_batch_init(tlb_batch_t* batch, page_table_t* pml4);
+void tlb_batch_add(tlb_batch_t* batch, uint64_t virt);
+void tlb_batch_add_span(tlb_batch_t* batch, uint64_t virt, uint64_t size);
+void tlb_batch_flush(tlb_batch_t* batch);
+void tlb_release(page_table_t* pml4);
+// Answer shootdowns aimed at this CPU; for loops that wait with interrupts off
+void tlb_process_pending(void);
+
+#endif
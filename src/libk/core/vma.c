@@ -0,0 +1,650 @@
+#include "vma.h"
+#include "slab.h"
+#include "tlb.h"
+#include "../../drv/disk/zfs.h"
+
+/*
+ * Virtual memory areas: the ranges a user task reserved through brk, mmap,
+ * its stack or its ELF image. Nothing is allocated when a range is reserved;
+ * the first touch of each page takes a not-present fault that vma_fault()
+ * resolves with a zeroed page, or with the page-cache page of a mapped file.
+ *
+ * Areas live in a red-black tree keyed by start address, and are also linked
+ * in address order. Every node caches the largest hole in front of any area
+ * of its subtree (the hole before an area runs from the end of the previous
+ * one), so finding room for an mmap skips whole subtrees that can't fit it.
+ */
+
+static kmem_cache_t *vma_cache = NULL;
+
+void vma_init(void)
+{
+    vma_cache = kmem_cache_create("vma_t", sizeof(vma_t));
+}
+
+static vma_t *vma_new(uint64_t start, uint64_t end, int prot, int flags)
+{
+    vma_t *vma = kmem_cache_alloc(vma_cache);
+    if (!vma)
+        return NULL;
+    vma->start = start;
+    vma->end = end;
+    vma->prot = prot;
+    vma->flags = flags;
+    vma->file = -1;
+    vma->pgoff = 0;
+    vma->parent = vma->left = vma->right = NULL;
+    vma->red = 0;
+    vma->subtree_gap = 0;
+    vma->prev = vma->next = NULL;
+    return vma;
+}
+
+/* PTE flags for a page of the area (before copy-on-write adjustments) */
+uint64_t vma_page_flags(vma_t *vma)
+{
+    uint64_t flags = PAGE_PRESENT | PAGE_USER;
+    if (vma->prot & PROT_WRITE)
+        flags |= PAGE_WRITABLE;
+    if (vma->flags & MAP_SHARED)
+        flags |= PAGE_SHARED;
+    return flags;
+}
+
+/* File page mapped at addr, which must lie in the area. */
+static uint64_t vma_pgoff_at(vma_t *vma, uint64_t addr)
+{
+    return vma->pgoff + (addr - vma->start) / PAGE_SIZE;
+}
+
+static uint64_t gap_before(vma_t *vma)
+{
+    return vma->start - (vma->prev ? vma->prev->end : 0);
+}
+
+static void update_gap(vma_t *vma)
+{
+    uint64_t gap = gap_before(vma);
+    if (vma->left && vma->left->subtree_gap > gap)
+        gap = vma->left->subtree_gap;
+    if (vma->right && vma->right->subtree_gap > gap)
+        gap = vma->right->subtree_gap;
+    vma->subtree_gap = gap;
+}
+
+/* Refresh the cached gaps from vma up to the root after its hole changed. */
+static void propagate_gap(vma_t *vma)
+{
+    for (; vma; vma = vma->parent)
+        update_gap(vma);
+}
+
+static void replace_child(vma_tree_t *tree, vma_t *parent, vma_t *old, vma_t *new)
+{
+    if (!parent)
+        tree->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+    if (new)
+        new->parent = parent;
+}
+
+static void rotate_left(vma_tree_t *tree, vma_t *x)
+{
+    vma_t *y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    replace_child(tree, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+    update_gap(x);
+    update_gap(y);
+}
+
+static void rotate_right(vma_tree_t *tree, vma_t *x)
+{
+    vma_t *y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    replace_child(tree, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+    update_gap(x);
+    update_gap(y);
+}
+
+static void insert_fixup(vma_tree_t *tree, vma_t *node)
+{
+    vma_t *parent;
+    while ((parent = node->parent) && parent->red)
+    {
+        vma_t *grand = parent->parent;     // a red node is never the root
+        if (parent == grand->left)
+        {
+            vma_t *uncle = grand->right;
+            if (uncle && uncle->red)
+            {
+                parent->red = uncle->red = 0;
+                grand->red = 1;
+                node = grand;
+                continue;
+            }
+            if (node == parent->right)
+            {
+                rotate_left(tree, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = 0;
+            grand->red = 1;
+            rotate_right(tree, grand);
+        }
+        else
+        {
+            vma_t *uncle = grand->left;
+            if (uncle && uncle->red)
+            {
+                parent->red = uncle->red = 0;
+                grand->red = 1;
+                node = grand;
+                continue;
+            }
+            if (node == parent->left)
+            {
+                rotate_right(tree, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = 0;
+            grand->red = 1;
+            rotate_left(tree, grand);
+        }
+    }
+    tree->root->red = 0;
+}
+
+static void tree_insert(vma_tree_t *tree, vma_t *vma)
+{
+    vma_t *parent = NULL, *prev = NULL, *next = NULL;
+    vma_t **link = &tree->root;
+    while (*link)
+    {
+        parent = *link;
+        if (vma->start < parent->start)
+        {
+            next = parent;
+            link = &parent->left;
+        }
+        else
+        {
+            prev = parent;
+            link = &parent->right;
+        }
+    }
+    vma->parent = parent;
+    vma->left = vma->right = NULL;
+    vma->red = 1;
+    *link = vma;
+
+    vma->prev = prev;
+    vma->next = next;
+    if (prev)
+        prev->next = vma;
+    if (next)
+        next->prev = vma;
+    propagate_gap(vma);
+    if (next)
+        propagate_gap(next);
+
+    insert_fixup(tree, vma);
+    tree->count++;
+}
+
+static void erase_fixup(vma_tree_t *tree, vma_t *x, vma_t *parent)
+{
+    while (x != tree->root && (!x || !x->red))
+    {
+        if (x == parent->left)
+        {
+            vma_t *w = parent->right;
+            if (w->red)
+            {
+                w->red = 0;
+                parent->red = 1;
+                rotate_left(tree, parent);
+                w = parent->right;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red))
+            {
+                w->red = 1;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!w->right || !w->right->red)
+            {
+                w->left->red = 0;
+                w->red = 1;
+                rotate_right(tree, w);
+                w = parent->right;
+            }
+            w->red = parent->red;
+            parent->red = 0;
+            w->right->red = 0;
+            rotate_left(tree, parent);
+            x = tree->root;
+        }
+        else
+        {
+            vma_t *w = parent->left;
+            if (w->red)
+            {
+                w->red = 0;
+                parent->red = 1;
+                rotate_right(tree, parent);
+                w = parent->left;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red))
+            {
+                w->red = 1;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!w->left || !w->left->red)
+            {
+                w->right->red = 0;
+                w->red = 1;
+                rotate_left(tree, w);
+                w = parent->left;
+            }
+            w->red = parent->red;
+            parent->red = 0;
+            w->left->red = 0;
+            rotate_right(tree, parent);
+            x = tree->root;
+        }
+    }
+    if (x)
+        x->red = 0;
+}
+
+static void tree_erase(vma_tree_t *tree, vma_t *z)
+{
+    vma_t *x, *x_parent;
+    int removed_red;
+    if (!z->left || !z->right)
+    {
+        x = z->left ? z->left : z->right;
+        x_parent = z->parent;
+        removed_red = z->red;
+        replace_child(tree, z->parent, z, x);
+    }
+    else
+    {
+        // Two children: the successor takes z's place in the tree
+        vma_t *y = z->next;
+        removed_red = y->red;
+        x = y->right;
+        if (y->parent == z)
+        {
+            x_parent = y;
+        }
+        else
+        {
+            x_parent = y->parent;
+            replace_child(tree, y->parent, y, x);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        replace_child(tree, z->parent, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+
+    if (z->prev)
+        z->prev->next = z->next;
+    if (z->next)
+        z->next->prev = z->prev;
+    if (x_parent)
+        propagate_gap(x_parent);
+    if (z->next)
+        propagate_gap(z->next);
+
+    if (!removed_red)
+        erase_fixup(tree, x, x_parent);
+    tree->count--;
+}
+
+vma_t *vma_find(vma_tree_t *tree, uint64_t addr)
+{
+    vma_t *node = tree->root;
+    while (node)
+    {
+        if (addr < node->start)
+            node = node->left;
+        else if (addr >= node->end)
+            node = node->right;
+        else
+            return node;
+    }
+    return NULL;
+}
+
+/* The lowest area ending above addr, i.e. the first one that can overlap [addr, ...). */
+static vma_t *first_ending_after(vma_tree_t *tree, uint64_t addr)
+{
+    vma_t *node = tree->root, *found = NULL;
+    while (node)
+    {
+        if (node->end > addr)
+        {
+            found = node;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+static int find_gap(vma_t *node, uint64_t length, uint64_t low, uint64_t high, uint64_t *addr)
+{
+    if (!node || node->subtree_gap < length)
+        return 0;
+    if (node->start > low)
+    {
+        if (find_gap(node->left, length, low, high, addr))
+            return 1;
+        uint64_t start = node->prev ? node->prev->end : 0;
+        if (start < low)
+            start = low;
+        if (start + length <= node->start && start + length <= high)
+        {
+            *addr = start;
+            return 1;
+        }
+    }
+    // Holes in the right subtree all start at or after this area's end
+    if (node->end + length > high)
+        return 0;
+    return find_gap(node->right, length, low, high, addr);
+}
+
+/* Lowest address of a free range of length bytes inside [low, high), or 0. */
+uint64_t vma_get_unmapped_area(vma_tree_t *tree, uint64_t length, uint64_t low, uint64_t high)
+{
+    uint64_t addr;
+    if (find_gap(tree->root, length, low, high, &addr))
+        return addr;
+
+    // No hole between areas is big enough; try above the last one
+    vma_t *last = tree->root;
+    while (last && last->right)
+        last = last->right;
+    addr = (last && last->end > low) ? last->end : low;
+    return addr + length <= high ? addr : 0;
+}
+
+/* Reserve [start, end). Anything already reserved there is replaced. */
+int vma_add(vma_tree_t *tree, uint64_t start, uint64_t end, int prot, int flags)
+{
+    return vma_add_file(tree, start, end, prot, flags, -1, 0, 0);
+}
+
+/*
+ * Same, backed by ZenFS entry file from page pgoff on (anonymous if file < 0).
+ * file_gen is the entry's generation when the file was opened.
+ */
+int vma_add_file(vma_tree_t *tree, uint64_t start, uint64_t end, int prot, int flags, int file, uint32_t file_gen, uint64_t pgoff)
+{
+    if (start >= end || vma_remove(tree, start, end))
+        return -1;
+
+    vma_t *next = first_ending_after(tree, start);
+    vma_t *prev = next ? next->prev : tree->root;
+    if (!next)
+    {
+        while (prev && prev->right)
+            prev = prev->right;
+    }
+
+    // Growing brk or a stack just extends the neighbouring area; file areas stay apart
+    int anon = file < 0;
+    int merge_prev = anon && prev && prev->end == start && prev->prot == prot && prev->flags == flags && prev->file < 0;
+    int merge_next = anon && next && next->start == end && next->prot == prot && next->flags == flags && next->file < 0;
+    if (merge_prev && merge_next)
+    {
+        prev->end = next->end;
+        tree_erase(tree, next);
+        kmem_cache_free(vma_cache, next);
+        return 0;
+    }
+    if (merge_prev)
+    {
+        prev->end = end;
+        if (next)
+            propagate_gap(next);
+        return 0;
+    }
+    if (merge_next)
+    {
+        next->start = start;
+        propagate_gap(next);
+        return 0;
+    }
+
+    vma_t *vma = vma_new(start, end, prot, flags);
+    if (!vma)
+        return -1;
+    vma->file = file;
+    vma->file_gen = file_gen;
+    vma->pgoff = pgoff;
+    tree_insert(tree, vma);
+    return 0;
+}
+
+/* Drop [start, end) from the reserved ranges, splitting an area if needed. */
+int vma_remove(vma_tree_t *tree, uint64_t start, uint64_t end)
+{
+    vma_t *vma = first_ending_after(tree, start);
+    while (vma && vma->start < end)
+    {
+        vma_t *next = vma->next;
+        if (vma->start < start && vma->end > end)
+        {
+            vma_t *tail = vma_new(end, vma->end, vma->prot, vma->flags);
+            if (!tail)
+                return -1;
+            tail->file = vma->file;
+            tail->file_gen = vma->file_gen;
+            tail->pgoff = vma_pgoff_at(vma, end);
+            vma->end = start;
+            tree_insert(tree, tail);
+            return 0;
+        }
+        if (vma->start < start)
+        {
+            vma->end = start;
+            if (next)
+                propagate_gap(next);
+        }
+        else if (vma->end > end)
+        {
+            vma->pgoff = vma_pgoff_at(vma, end);
+            vma->start = end;
+            propagate_gap(vma);
+            return 0;
+        }
+        else
+        {
+            tree_erase(tree, vma);
+            kmem_cache_free(vma_cache, vma);
+        }
+        vma = next;
+    }
+    return 0;
+}
+
+/*
+ * Release [start, end): every page mapped in the areas overlapping it is
+ * unmapped and the range stops being reserved. Holes between areas are
+ * skipped without touching the page tables. If some pages can't be
+ * unmapped the areas are all kept, so nothing is placed over them later.
+ */
+int vma_unmap(page_table_t *pml4, vma_tree_t *tree, uint64_t start, uint64_t end)
+{
+    int ret = 0;
+    for (vma_t *vma = first_ending_after(tree, start); vma && vma->start < end; vma = vma->next)
+    {
+        uint64_t from = vma->start > start ? vma->start : start;
+        uint64_t to = vma->end < end ? vma->end : end;
+        if (unmap_range(pml4, from, to - from, 1))
+            ret = -1;
+    }
+    if (ret)
+        return ret;
+    return vma_remove(tree, start, end);
+}
+
+static vma_t *first_vma(vma_tree_t *tree)
+{
+    vma_t *vma = tree->root;
+    while (vma && vma->left)
+        vma = vma->left;
+    return vma;
+}
+
+int vma_copy(vma_tree_t *dst, vma_tree_t *src)
+{
+    for (vma_t *vma = first_vma(src); vma; vma = vma->next)
+    {
+        vma_t *copy = vma_new(vma->start, vma->end, vma->prot, vma->flags);
+        if (!copy)
+        {
+            vma_free_all(dst);
+            return -1;
+        }
+        copy->file = vma->file;
+        copy->file_gen = vma->file_gen;
+        copy->pgoff = vma->pgoff;
+        tree_insert(dst, copy);
+    }
+    return 0;
+}
+
+void vma_free_all(vma_tree_t *tree)
+{
+    vma_t *vma = first_vma(tree);
+    while (vma)
+    {
+        vma_t *next = vma->next;
+        kmem_cache_free(vma_cache, vma);
+        vma = next;
+    }
+    tree->root = NULL;
+    tree->count = 0;
+}
+
+/*
+ * Map the page-cache page behind a file area. Shared writable mappings write
+ * straight into the cache (the page goes back to disk when the file is closed
+ * or the page is evicted); private ones get it copy-on-write. Once the file
+ * is deleted its entry may name another file, so the fault fails instead.
+ */
+static int file_fault(page_table_t *pml4, vma_t *vma, uint64_t page)
+{
+    if (zfs_entry_generation(vma->file) != vma->file_gen)
+        return -1;
+    uint64_t index = vma_pgoff_at(vma, page);
+    uint64_t phys = pcache_get(vma->file, index);
+    if (!phys)
+        return -1;
+    if (zfs_entry_generation(vma->file) != vma->file_gen)
+    {
+        put_page(phys);     // deleted while we read it
+        return -1;
+    }
+    if (get_mapping_size(pml4, page))
+    {
+        put_page(phys);     // another fault on this page got here first
+        return 0;
+    }
+
+    // The reference pcache_get() took belongs to the mapping from here on
+    uint64_t flags = vma_page_flags(vma) & ~PAGE_WRITABLE;
+    if (vma->prot & PROT_WRITE)
+    {
+        if (vma->flags & MAP_SHARED)
+        {
+            flags |= PAGE_WRITABLE;
+            pcache_mark_dirty(vma->file, index);
+        }
+        else
+        {
+            flags |= PAGE_COW;
+        }
+    }
+    map_page(pml4, page, phys, flags);
+    return 0;
+}
+
+/*
+ * A fault below a MAP_GROWSDOWN area extends it down to the faulting page,
+ * up to USER_STACK_SIZE below its top. The lowest page of that window is a
+ * guard and is never handed out, so running off the stack still faults.
+ */
+static vma_t *grow_down(vma_tree_t *tree, uint64_t addr)
+{
+    vma_t *vma = first_ending_after(tree, addr);
+    if (!vma || !(vma->flags & MAP_GROWSDOWN) || addr >= vma->start)
+        return NULL;
+    uint64_t limit = vma->end > USER_STACK_SIZE - PAGE_SIZE ? vma->end - USER_STACK_SIZE + PAGE_SIZE : 0;
+    if (addr < limit || (vma->prev && vma->prev->end > addr))
+        return NULL;
+    vma->start = addr & ~(uint64_t)(PAGE_SIZE - 1);
+    propagate_gap(vma);
+    return vma;
+}
+
+/*
+ * Back the page at addr if it lies in a reserved area. The rest of the
+ * aligned VMA_FAULT_AROUND window is filled in as well while zeroed pages
+ * are cheap, since anonymous memory tends to be touched sequentially.
+ * Returns 0 if the fault was resolved.
+ */
+int vma_fault(page_table_t *pml4, vma_tree_t *tree, uint64_t addr)
+{
+    vma_t *vma = vma_find(tree, addr);
+    if (!vma)
+        vma = grow_down(tree, addr);
+    if (!vma || !vma->prot)
+        return -1;
+
+    uint64_t page = addr & ~(uint64_t)(PAGE_SIZE - 1);
+    if (vma->file >= 0)
+        return file_fault(pml4, vma, page);
+
+    // Pages already present are skipped, so a second fault on the same
+    // page just finds it mapped.
+    uint64_t flags = vma_page_flags(vma);
+    if (map_anon_range(pml4, page, PAGE_SIZE, flags, 1))
+        return -1;
+
+    uint64_t window = VMA_FAULT_AROUND * PAGE_SIZE;
+    uint64_t start = page & ~(window - 1);
+    uint64_t end = start + window;
+    if (start < vma->start)
+        start = vma->start;
+    if (end > vma->end)
+        end = vma->end;
+    map_anon_range(pml4, start, end - start, flags, 1);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+#include "mem.h"
+#include "syscall.h"
+#include "pagecache.h"
+
+// Pages mapped around a demand fault, as an aligned window (power of two, 1 = off)
+#define VMA_FAULT_AROUND 4
+
+// A reserved range of a user address space, backed on first touch
+typedef struct vma
+{
+    uint64_t start;
+    uint64_t end;
+    int prot;                   // PROT_*
+    int flags;                  // MAP_*
+    int file;                   // ZenFS entry backing the area, -1 if anonymous
+    uint64_t pgoff;             // file page mapped at start
+    uint32_t file_gen;          // generation of the entry when it was mapped
+    struct vma *parent, *left, *right;
+    int red;
+    uint64_t subtree_gap;       // largest hole before any area in this subtree
+    struct vma *prev, *next;    // neighbours in address order
+} vma_t;
+
+// Red-black tree of a task's areas, keyed by start address
+typedef struct
+{
+    vma_t *root;
+    uint64_t count;
+} vma_tree_t;
+
+void vma_init(void);
+vma_t* vma_find(vma_tree_t* tree, uint64_t addr);
+uint64_t vma_page_flags(vma_t* vma);
+uint64_t vma_get_unmapped_area(vma_tree_t* tree, uint64_t length, uint64_t low, uint64_t high);
+int vma_add(vma_tree_t* tree, uint64_t start, uint64_t end, int prot, int flags);
+int vma_add_file(vma_tree_t* tree, uint64_t start, uint64_t end, int prot, int flags, int file, uint32_t file_gen, uint64_t pgoff);
+int vma_remove(vma_tree_t* tree, uint64_t start, uint64_t end);
+int vma_unmap(page_table_t* pml4, vma_tree_t* tree, uint64_t start, uint64_t end);
+int vma_copy(vma_tree_t* dst, vma_tree_t* src);
+void vma_free_all(vma_tree_t* tree);
+int vma_fault(page_table_t* pml4, vma_tree_t* tree, uint64_t addr);
+
+#endif
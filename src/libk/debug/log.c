@@ -8,6 +8,7 @@
 #include "../../cpu/idt.h"
 #include "../string.h"
 #include "../core/mem.h"
+#include "../core/slab.h"
 #include "../../drv/local_apic.h"
 #include "../../drv/speaker.h"
 #include "../../drv/rtc.h"
@@ -15,6 +16,21 @@
 spinlock_t loglock __attribute__((section(".data"))) = {0};
 char *os_version = debug ? "0.90.0 DEBUG_ENABLED" : "0.90.0 Unstable";
 
+// Every log line needs these two buffers, give them their own slabs
+static kmem_cache_t *logline_cache = NULL;
+static kmem_cache_t *message_cache = NULL;
+
+void log_init(void)
+{
+    logline_cache = kmem_cache_create("log-line", 1280);
+    message_cache = kmem_cache_create("log-message", 1024);
+}
+
+static void *log_buf_alloc(kmem_cache_t *cache, size_t size)
+{
+    return cache ? kmem_cache_alloc(cache) : kmalloc(size);
+}
+
 void sound_err()
 {
     speaker_note(0, 0);
@@ -48,17 +64,14 @@ static void format_time(uint64_t ms, char *out, size_t size)
 
 void log_internal(const char *file, int line, const char *fmt, int level, int visibility, ...)
 {
-    char *logline = kmalloc(1280);
+    char *logline = log_buf_alloc(logline_cache, 1280);
     if (!logline)
     {
         serial_write_string("\x1b[38;2;255;50;50m[log.c]- CRITICAL: kmalloc failed in log_internal!\n");
         return;
     }
 
-    uint64_t rflags;
-    asm volatile("pushfq; pop %0; cli" : "=r"(rflags));
-
-    spinlock_acquire(&loglock);
+    uint64_t rflags = spinlock_acquire_irqsave(&loglock);
 
     const char *color_seq;
     int cpuid = LocalApicGetId();
@@ -91,9 +104,7 @@ void log_internal(const char *file, int line, const char *fmt, int level, int vi
     if (!header)
     {
         kfree(logline);
-        spinlock_release(&loglock);
-        if (rflags & 0x200)
-            asm volatile("sti");
+        spinlock_release_irqrestore(&loglock, rflags);
         return;
     }
 
@@ -118,14 +129,12 @@ void log_internal(const char *file, int line, const char *fmt, int level, int vi
         snprintf(header, 256, "[%s][%s:%d]- ", timebuf, filename, line);
     }
 
-    char *message = kmalloc(1024);
+    char *message = log_buf_alloc(message_cache, 1024);
     if (!message)
     {
         kfree(header);
         kfree(logline);
-        spinlock_release(&loglock);
-        if (rflags & 0x200)
-            asm volatile("sti");
+        spinlock_release_irqrestore(&loglock, rflags);
         return;
     }
 
@@ -138,9 +147,7 @@ void log_internal(const char *file, int line, const char *fmt, int level, int vi
         kfree(message);
         kfree(header);
         kfree(logline);
-        spinlock_release(&loglock);
-        if (rflags & 0x200)
-            asm volatile("sti");
+        spinlock_release_irqrestore(&loglock, rflags);
         return;
     }
 
@@ -170,10 +177,7 @@ void log_internal(const char *file, int line, const char *fmt, int level, int vi
     kfree(header);
     kfree(logline);
 
-    spinlock_release(&loglock);
-
-    if (rflags & 0x200)
-        asm volatile("sti");
+    spinlock_release_irqrestore(&loglock, rflags);
 
     if (level < 1 || level > 4)
     {
@@ -8,6 +8,7 @@
 extern spinlock_t loglock;
 extern char* os_version;
 
+void log_init(void);
 void log_internal(const char* file, int line, const char* fmt, int level, int visibility, ...);
 void shutdown(void);
 
@@ -0,0 +1,257 @@
+#include "memprof.h"
+#include "log.h"
+#include "../string.h"
+#include "../spinlock.h"
+#include "../core/mem.h"
+#include "../../drv/rtc.h"
+#include "../../cpu/smp.h"
+
+/*
+ * Opt-in allocation profiler. While enabled, every kmalloc/kfree and every
+ * page allocator entry point goes through here and is recorded in two
+ * fixed-size open-addressing tables: live allocations keyed by address
+ * (for leak reports) and call sites keyed by return address (for the
+ * summary table). Nothing here allocates, so the profiler can't recurse
+ * into itself. When a table fills up, further records are dropped and
+ * counted.
+ */
+#define MEMPROF_MAX_LIVE   8192
+#define MEMPROF_MAX_SITES  512
+#define MEMPROF_TOP_SITES  16
+#define MEMPROF_MAX_LEAKS  32
+#define MEMPROF_TOMBSTONE  ((void *)1)
+
+typedef struct
+{
+    void *ptr;
+    void *site;
+    uint64_t size;
+    uint64_t timestamp;
+    uint8_t cpu;
+    uint8_t kind;
+} memprof_live_t;
+
+typedef struct
+{
+    void *site;
+    uint8_t kind;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+    uint64_t total_bytes;
+} memprof_site_t;
+
+volatile int memprof_enabled = 0;
+
+static memprof_live_t live_table[MEMPROF_MAX_LIVE];
+static memprof_site_t site_table[MEMPROF_MAX_SITES];
+static memprof_site_t site_snapshot[MEMPROF_MAX_SITES];
+static uint64_t enabled_at = 0;
+static uint64_t dropped = 0;
+static spinlock_t memprof_lock = {0};
+static spinlock_t snapshot_lock = {0};
+
+static uint32_t hash_ptr(void *ptr, uint32_t size)
+{
+    uint64_t x = (uint64_t)ptr;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (uint32_t)x & (size - 1);
+}
+
+static memprof_site_t *site_lookup(void *site, uint8_t kind)
+{
+    uint32_t idx = hash_ptr(site, MEMPROF_MAX_SITES);
+    for (uint32_t probe = 0; probe < MEMPROF_MAX_SITES; probe++)
+    {
+        memprof_site_t *entry = &site_table[(idx + probe) & (MEMPROF_MAX_SITES - 1)];
+        if (entry->site == site && entry->kind == kind)
+            return entry;
+        if (!entry->site)
+        {
+            entry->site = site;
+            entry->kind = kind;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void memprof_record_alloc(void *ptr, size_t size, memprof_kind_t kind, void *site)
+{
+    if (!ptr)
+        return;
+
+    uint64_t now = rtc_get_ticks();
+    uint8_t cpu = smp_cpu_id();
+    uint64_t rflags = spinlock_acquire_irqsave(&memprof_lock);
+
+    memprof_site_t *s = site_lookup(site, kind);
+    if (s)
+    {
+        s->allocs++;
+        s->live_bytes += size;
+        s->total_bytes += size;
+        if (s->live_bytes > s->peak_bytes)
+            s->peak_bytes = s->live_bytes;
+    }
+
+    uint32_t idx = hash_ptr(ptr, MEMPROF_MAX_LIVE);
+    memprof_live_t *slot = NULL;
+    for (uint32_t probe = 0; probe < MEMPROF_MAX_LIVE; probe++)
+    {
+        memprof_live_t *entry = &live_table[(idx + probe) & (MEMPROF_MAX_LIVE - 1)];
+        if (!entry->ptr || entry->ptr == MEMPROF_TOMBSTONE)
+        {
+            slot = entry;
+            break;
+        }
+    }
+    if (slot)
+    {
+        slot->ptr = ptr;
+        slot->site = site;
+        slot->size = size;
+        slot->timestamp = now;
+        slot->cpu = cpu;
+        slot->kind = kind;
+    }
+    else
+    {
+        dropped++;
+    }
+    spinlock_release_irqrestore(&memprof_lock, rflags);
+}
+
+void memprof_record_free(void *ptr, memprof_kind_t kind)
+{
+    if (!ptr)
+        return;
+
+    uint64_t rflags = spinlock_acquire_irqsave(&memprof_lock);
+    uint32_t idx = hash_ptr(ptr, MEMPROF_MAX_LIVE);
+    for (uint32_t probe = 0; probe < MEMPROF_MAX_LIVE; probe++)
+    {
+        memprof_live_t *entry = &live_table[(idx + probe) & (MEMPROF_MAX_LIVE - 1)];
+        if (!entry->ptr)
+            break;
+        if (entry->ptr == ptr && entry->kind == kind)
+        {
+            memprof_site_t *s = site_lookup(entry->site, kind);
+            if (s)
+            {
+                s->frees++;
+                s->live_bytes -= entry->size;
+            }
+            entry->ptr = MEMPROF_TOMBSTONE;
+            break;
+        }
+    }
+    spinlock_release_irqrestore(&memprof_lock, rflags);
+}
+
+void memprof_reset(void)
+{
+    uint64_t rflags = spinlock_acquire_irqsave(&memprof_lock);
+    memset(live_table, 0, sizeof(live_table));
+    memset(site_table, 0, sizeof(site_table));
+    dropped = 0;
+    enabled_at = rtc_get_ticks();
+    spinlock_release_irqrestore(&memprof_lock, rflags);
+}
+
+void memprof_enable(void)
+{
+    if (memprof_enabled)
+        return;
+    memprof_reset();
+    memprof_enabled = 1;
+    log("Allocation profiler enabled.", 1, 0);
+}
+
+void memprof_disable(void)
+{
+    memprof_enabled = 0;
+}
+
+static const char *kind_name(uint8_t kind)
+{
+    return kind == MEMPROF_PAGES ? "pages" : "kmalloc";
+}
+
+void memprof_dump(int vis)
+{
+    // Snapshot first: logging allocates, which would re-enter the profiler.
+    spinlock_acquire(&snapshot_lock);
+    uint64_t rflags = spinlock_acquire_irqsave(&memprof_lock);
+    memcpy(site_snapshot, site_table, sizeof(site_table));
+    uint64_t since = enabled_at;
+    uint64_t lost = dropped;
+    spinlock_release_irqrestore(&memprof_lock, rflags);
+
+    uint64_t elapsed_ms = (rtc_get_ticks() - since) * 1000 / RTC_HZ;
+    if (!elapsed_ms)
+        elapsed_ms = 1;
+
+    log("Allocation profile (%lu ms, %lu records dropped), top call sites by live bytes:", 1, vis, elapsed_ms, lost);
+    for (int n = 0; n < MEMPROF_TOP_SITES; n++)
+    {
+        memprof_site_t *best = NULL;
+        for (int i = 0; i < MEMPROF_MAX_SITES; i++)
+        {
+            memprof_site_t *s = &site_snapshot[i];
+            if (s->site && (!best || s->live_bytes > best->live_bytes))
+                best = s;
+        }
+        if (!best)
+            break;
+        log("  %p [%s] live %lu B (peak %lu B), %lu allocs / %lu frees, %lu allocs/s", 1, vis,
+            best->site, kind_name(best->kind), best->live_bytes, best->peak_bytes,
+            best->allocs, best->frees, best->allocs * 1000 / elapsed_ms);
+        best->site = NULL;
+    }
+    spinlock_release(&snapshot_lock);
+
+    uint64_t counts[32], bytes[32];
+    size_t bins = get_heap_free_histogram(counts, bytes, 32);
+    log("Heap free list by block size:", 1, vis);
+    for (size_t i = 0; i < bins; i++)
+    {
+        if (!counts[i])
+            continue;
+        log("  %lu-%lu B: %lu blocks, %lu B", 1, vis,
+            32ULL << i, (64ULL << i) - 1, counts[i], bytes[i]);
+    }
+}
+
+void memprof_leak_report(uint32_t older_than_s, int vis)
+{
+    memprof_live_t leaks[MEMPROF_MAX_LEAKS];
+    uint32_t found = 0;
+    uint64_t leaked_bytes = 0, leaked_count = 0;
+    uint64_t now = rtc_get_ticks();
+    uint64_t cutoff = (uint64_t)older_than_s * RTC_HZ;
+
+    uint64_t rflags = spinlock_acquire_irqsave(&memprof_lock);
+    for (uint32_t i = 0; i < MEMPROF_MAX_LIVE; i++)
+    {
+        memprof_live_t *entry = &live_table[i];
+        if (!entry->ptr || entry->ptr == MEMPROF_TOMBSTONE || now - entry->timestamp < cutoff)
+            continue;
+        leaked_bytes += entry->size;
+        leaked_count++;
+        if (found < MEMPROF_MAX_LEAKS)
+            leaks[found++] = *entry;
+    }
+    spinlock_release_irqrestore(&memprof_lock, rflags);
+
+    log("Leak report: %lu allocations (%lu B) older than %us", 1, vis, leaked_count, leaked_bytes, older_than_s);
+    for (uint32_t i = 0; i < found; i++)
+    {
+        log("  %p [%s] %lu B from %p on CPU%u, %lu ms old", 1, vis,
+            leaks[i].ptr, kind_name(leaks[i].kind), leaks[i].size, leaks[i].site,
+            leaks[i].cpu, (now - leaks[i].timestamp) * 1000 / RTC_HZ);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef MEMPROF_H
+#define MEMPROF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    MEMPROF_KMALLOC,
+    MEMPROF_PAGES
+} memprof_kind_t;
+
+// Commands for SYSCALL_MEMPROF
+#define MEMPROF_CMD_DISABLE 0
+#define MEMPROF_CMD_ENABLE  1
+#define MEMPROF_CMD_DUMP    2
+#define MEMPROF_CMD_LEAKS   3
+#define MEMPROF_CMD_RESET   4
+
+extern volatile int memprof_enabled;
+
+void memprof_record_alloc(void* ptr, size_t size, memprof_kind_t kind, void* site);
+void memprof_record_free(void* ptr, memprof_kind_t kind);
+
+void memprof_enable(void);
+void memprof_disable(void);
+void memprof_reset(void);
+void memprof_dump(int vis);
+void memprof_leak_report(uint32_t older_than_s, int vis);
+
+// Hooks for the allocators; cost a single not-taken branch while profiling is off.
+#define MEMPROF_ALLOC(ptr, size, kind) \
+    do { \
+        if (__builtin_expect(memprof_enabled, 0)) \
+            memprof_record_alloc((void*)(ptr), (size), (kind), __builtin_return_address(0)); \
+    } while (0)
+
+#define MEMPROF_FREE(ptr, kind) \
+    do { \
+        if (__builtin_expect(memprof_enabled, 0)) \
+            memprof_record_free((void*)(ptr), (kind)); \
+    } while (0)
+
+#endif
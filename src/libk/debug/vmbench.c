@@ -0,0 +1,65 @@
+#include "vmbench.h"
+#include "log.h"
+#include "../core/mem.h"
+#include "../../drv/hpet.h"
+
+/*
+ * Maps and unmaps one physically contiguous block in a scratch address space,
+ * first a page at a time and then as one range, and logs the rate of each.
+ * The block is never touched, so only page-table and TLB work is timed.
+ */
+#define VMBENCH_PAGES 2048
+#define VMBENCH_BASE  USER_MMAP_START
+
+static uint64_t pages_per_sec(uint64_t ns)
+{
+    return ns ? VMBENCH_PAGES * 1000000000ULL / ns : 0;
+}
+
+void vmm_benchmark(int vis)
+{
+    page_table_t *pml4 = clone_page_directory(get_kernel_pml4());
+    if (!pml4)
+        return;
+    uint64_t phys = alloc_pages(VMBENCH_PAGES);
+    if (!phys)
+    {
+        free_task_address_space(pml4);
+        return;
+    }
+    uint64_t flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+    uint64_t size = VMBENCH_PAGES * PAGE_SIZE;
+
+    // One untimed pass so both runs find the page tables already allocated
+    map_range(pml4, VMBENCH_BASE, phys, size, flags);
+    int stuck = unmap_range(pml4, VMBENCH_BASE, size, 0);
+
+    uint64_t t0 = hpet_read_ns();
+    for (uint64_t i = 0; i < VMBENCH_PAGES; i++)
+        map_page(pml4, VMBENCH_BASE + i * PAGE_SIZE, phys + i * PAGE_SIZE, flags);
+    uint64_t t1 = hpet_read_ns();
+    for (uint64_t i = 0; i < VMBENCH_PAGES; i++)
+        unmap_page(pml4, VMBENCH_BASE + i * PAGE_SIZE);
+    uint64_t t2 = hpet_read_ns();
+    // A failed map leaves a partial range; the unmap below clears it either way
+    int failed = map_range(pml4, VMBENCH_BASE, phys, size, flags);
+    uint64_t t3 = hpet_read_ns();
+    stuck |= unmap_range(pml4, VMBENCH_BASE, size, 0);
+    uint64_t t4 = hpet_read_ns();
+
+    if (failed)
+        log("VMM benchmark: map_range failed.", 2, vis);
+    else
+        log("VMM benchmark (%d pages): map %lu -> %lu pages/s, unmap %lu -> %lu pages/s.", 1, vis,
+            VMBENCH_PAGES, pages_per_sec(t1 - t0), pages_per_sec(t3 - t2),
+            pages_per_sec(t2 - t1), pages_per_sec(t4 - t3));
+
+    // Tearing down a space that still maps the block would put pages alloc_pages() owns
+    if (stuck)
+    {
+        log("VMM benchmark: scratch range still mapped, leaking it.", 2, vis);
+        return;
+    }
+    free_task_address_space(pml4);
+    free_pages(phys, VMBENCH_PAGES);
+}
@@ -0,0 +1,7 @@
+#ifndef VMBENCH_H
+#define VMBENCH_H
+
+// Pages per second through map_page/unmap_page against map_range/unmap_range
+void vmm_benchmark(int vis);
+
+#endif
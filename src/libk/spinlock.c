@@ -22,4 +22,19 @@ void spinlock_acquire(spinlock_t *lock)
 void spinlock_release(spinlock_t *lock)
 {
     __sync_lock_release(&lock->locked);
-}
\ No newline at end of file
+}
+
+uint64_t spinlock_acquire_irqsave(spinlock_t *lock)
+{
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    spinlock_acquire(lock);
+    return rflags;
+}
+
+void spinlock_release_irqrestore(spinlock_t *lock, uint64_t rflags)
+{
+    spinlock_release(lock);
+    if (rflags & 0x200)
+        __asm__ volatile("sti" : : : "memory");
+}
@@ -1,6 +1,8 @@
 #ifndef SPINLOCK_H
 #define SPINLOCK_H
 
+#include <stdint.h>
+
 typedef struct {
     volatile int locked;
 } spinlock_t;
@@ -8,5 +10,9 @@ typedef struct {
 void spinlock_init(spinlock_t* lock);
 void spinlock_acquire(spinlock_t* lock);
 void spinlock_release(spinlock_t* lock);
+// Take the lock with interrupts off and hand back the caller's RFLAGS, for
+// locks an interrupt handler on the same CPU may also take.
+uint64_t spinlock_acquire_irqsave(spinlock_t* lock);
+void spinlock_release_irqrestore(spinlock_t* lock, uint64_t rflags);
 
 #endif
\ No newline at end of file
@@ -438,13 +438,14 @@ static void cmd_socket_read(int argc, char* argv[]) {
     char buffer[256];
     uint32_t bytes_read = 0;
     
-    if (socket_read(sock, buffer, sizeof(buffer) - 1, &bytes_read) >= 0 && bytes_read > 0) {
+    prints("Waiting for data...\n");
+    if (socket_read_wait(sock, buffer, sizeof(buffer) - 1, &bytes_read) >= 0 && bytes_read > 0) {
         buffer[bytes_read] = '\0';
         prints(COLOR_CYAN "Read: " COLOR_RESET);
         prints(buffer);
         prints("\n");
     } else {
-        prints(COLOR_YELLOW "No data available\n" COLOR_RESET);
+        prints(COLOR_YELLOW "Read failed\n" COLOR_RESET);
     }
     
     socket_close(sock);
@@ -700,6 +701,35 @@ static void cmd_beep(int argc, char* argv[]) {
     speaker_stop();
 }
 
+static void cmd_nice(int argc, char* argv[]) {
+    if (argc < 3) {
+        prints(COLOR_RED "Usage: nice <pid> <priority 0-63>\n" COLOR_RESET);
+        return;
+    }
+    if (setpriority(atoi(argv[1]), atoi(argv[2])) < 0)
+        prints(COLOR_RED "Failed to set priority\n" COLOR_RESET);
+    else
+        prints(COLOR_GREEN "Priority set\n" COLOR_RESET);
+}
+
+static void cmd_sched(int argc, char* argv[]) {
+    int policy = -1;
+    if (argc >= 2) {
+        if (strcmp(argv[1], "prio") == 0) policy = SCHED_PRIO;
+        else if (strcmp(argv[1], "fair") == 0) policy = SCHED_FAIR;
+        else {
+            prints(COLOR_RED "Usage: sched [prio|fair]\n" COLOR_RESET);
+            return;
+        }
+        if (sched_policy(policy) < 0) {
+            prints(COLOR_RED "Failed to switch scheduler\n" COLOR_RESET);
+            return;
+        }
+    }
+    prints("Scheduler: ");
+    prints(sched_policy(-1) == SCHED_FAIR ? "fair\n" : "prio\n");
+}
+
 static void cmd_yield_cmd(void) {
     prints(COLOR_YELLOW "Yielding CPU...\n" COLOR_RESET);
     yield();
@@ -720,10 +750,12 @@ static void cmd_help(void) {
     prints("  mmap <size>          - Test mmap allocation\n");
     prints("  sockcreate <name>    - Create IPC socket\n");
     prints("  sockwrite <name> <msg> - Write to socket\n");
-    prints("  sockread <name>      - Read from socket\n");
+    prints("  sockread <name>      - Wait for and read from socket\n");
     prints("  sockdel <name>       - Delete socket\n");
     prints("  exec <file>          - Execute program\n");
     prints("  ps                   - Show process info\n");
+    prints("  nice <pid> <prio>    - Set priority (0 runs first)\n");
+    prints("  sched [prio|fair]    - Show or switch scheduler\n");
     prints("  yield                - Yield CPU\n");
     prints("  uname                - System information\n");
     prints("  time                 - Show current time\n");
@@ -891,6 +923,8 @@ static int execute_command(void) {
     // Process
     else if (strcmp(argv[0], "exec") == 0) cmd_exec(argc, argv);
     else if (strcmp(argv[0], "ps") == 0) cmd_ps();
+    else if (strcmp(argv[0], "nice") == 0) cmd_nice(argc, argv);
+    else if (strcmp(argv[0], "sched") == 0) cmd_sched(argc, argv);
     else if (strcmp(argv[0], "yield") == 0) cmd_yield_cmd();
     // System
     else if (strcmp(argv[0], "uname") == 0) cmd_uname();
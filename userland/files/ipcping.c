@@ -72,21 +72,19 @@ int main(void) {
             prints("\033[31m[IPCPing ");
             prints(pidbuf);
             prints("] Write failed\033[0m\n");
-        } else {
-            prints("\033[33m[IPCPing ");
-            prints(pidbuf);
-            prints("] Sent: ");
-            prints(msg);
-            prints("\033[0m\n");
+            sleep(50);
+            continue;
         }
+        prints("\033[33m[IPCPing ");
+        prints(pidbuf);
+        prints("] Sent: ");
+        prints(msg);
+        prints("\033[0m\n");
         
-        sleep(100);
-        yield();
-        
-        // Try to read response
+        // Sleeps in the kernel until the response is there
         char readbuf[128];
         uint32_t bytes_read = 0;
-        if (socket_read(sock, readbuf, sizeof(readbuf) - 1, &bytes_read) >= 0 && bytes_read > 0) {
+        if (socket_read_wait(sock, readbuf, sizeof(readbuf) - 1, &bytes_read) >= 0 && bytes_read > 0) {
             readbuf[bytes_read] = '\0';
             prints("\033[36m[IPCPing ");
             prints(pidbuf);
@@ -96,7 +94,6 @@ int main(void) {
         }
         
         sleep(50);
-        yield();
     }
     
     socket_close(sock);
@@ -58,6 +58,15 @@ static inline uint64_t syscall5(uint64_t num, uint64_t arg1, uint64_t arg2, uint
     return ret;
 }
 
+static inline uint64_t syscall6(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6) {
+    uint64_t ret;
+    register uint64_t r10 __asm__("r10") = arg4;
+    register uint64_t r8 __asm__("r8") = arg5;
+    register uint64_t r9 __asm__("r9") = arg6;
+    __asm__ volatile("syscall" : "=a"(ret) : "a"(num), "D"(arg1), "S"(arg2), "d"(arg3), "r"(r10), "r"(r8), "r"(r9) : "rcx", "r11", "memory");
+    return ret;
+}
+
 // ==================== STRUCTURES ====================
 
 // File stat structure
@@ -106,6 +115,7 @@ typedef struct {
     uint32_t position;
     uint8_t entry_index;
     uint8_t is_open;
+    uint32_t generation;
 } zfs_file_t;
 
 // Socket file structure (matches kernel)
@@ -118,8 +128,16 @@ typedef struct {
     uint32_t write_pos;
     uint32_t available;
     uint8_t in_use;
+    struct { volatile int lock; void *head, *tail; } readers;   // kernel wait queue
 } socket_file_t;
 
+// Scheduler counters for one CPU (matches kernel)
+typedef struct {
+    uint64_t nr_tasks;
+    uint64_t steals;
+    uint64_t migrations;
+} sched_stat_t;
+
 // ==================== PROCESS MANAGEMENT ====================
 
 static inline int exec(const char *filename) {
@@ -140,12 +158,54 @@ static inline pid_t getpid(void) {
     return (pid_t)syscall0(2);
 }
 
+// Returns the child's PID in the parent, 0 in the child, -1 on failure
+static inline pid_t fork(void) {
+    return (pid_t)syscall0(45);
+}
+
+// Run queue counters for one CPU; -1 past the last CPU
+static inline int sched_stat(uint32_t cpu, sched_stat_t *stat) {
+    return (int)syscall2(46, cpu, (uint64_t)stat);
+}
+
+#define PRIO_MIN     0      // runs first
+#define PRIO_MAX     63
+#define PRIO_DEFAULT 32
+
+// Scheduling priority of a task, pid 0 for the caller; -1 if there is no such task
+static inline int setpriority(pid_t pid, int priority) {
+    return (int)syscall2(47, (uint64_t)pid, (uint64_t)priority);
+}
+
+static inline int getpriority(pid_t pid) {
+    return (int)syscall1(48, (uint64_t)pid);
+}
+
+// Lower the caller's priority by inc levels (raise it if negative); returns the new one
+static inline int nice(int inc) {
+    int prio = getpriority(0);
+    if (prio < 0) return -1;
+    prio += inc;
+    if (prio < PRIO_MIN) prio = PRIO_MIN;
+    if (prio > PRIO_MAX) prio = PRIO_MAX;
+    return setpriority(0, prio) < 0 ? -1 : prio;
+}
+
+#define SCHED_PRIO 0        // fixed-slice priority arrays
+#define SCHED_FAIR 1        // virtual runtime
+
+// Switch the system-wide scheduling class, -1 to query it; returns the class or -1
+static inline int sched_policy(int policy) {
+    return (int)syscall1(49, (uint64_t)policy);
+}
+
 static inline void yield(void) {
     syscall0(43);
 }
 
 // ==================== INPUT/OUTPUT ====================
 
+// Blocks until a key is pressed
 static inline char getkey(void) {
     return (char)syscall0(3);
 }
@@ -259,7 +319,12 @@ static inline void* sbrk(int64_t increment) {
 static inline void* mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
     (void)fd;
     (void)offset;
-    return (void*)syscall4(25, (uint64_t)addr, length, prot, flags);
+    return (void*)syscall6(25, (uint64_t)addr, length, prot, flags, 0, 0);
+}
+
+// Map an open file; offset must be page aligned. Pages are shared with the page cache.
+static inline void* mmap_file(void *addr, size_t length, int prot, int flags, zfs_file_t *file, off_t offset) {
+    return (void*)syscall6(25, (uint64_t)addr, length, prot, flags, (uint64_t)file, (uint64_t)offset);
 }
 
 static inline int munmap(void *addr, size_t length) {
@@ -272,7 +337,10 @@ static inline int munmap(void *addr, size_t length) {
 #define PROT_EXEC  0x4
 #define MAP_SHARED    0x01
 #define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10      // map exactly at addr, replacing what is there
 #define MAP_ANONYMOUS 0x20
+#define MAP_GROWSDOWN 0x100     // grows down on faults below it, up to 8MB
+#define MAP_HUGETLB   0x40000   // back the mapping with 2MB pages
 
 // ==================== TIME ====================
 
@@ -308,6 +376,11 @@ static inline ssize_t socket_read(socket_file_t *file, void *buffer, uint32_t si
     return (ssize_t)syscall4(33, (uint64_t)file, (uint64_t)buffer, size, (uint64_t)bytes_read);
 }
 
+// Blocks until the socket has data (or is deleted)
+static inline ssize_t socket_read_wait(socket_file_t *file, void *buffer, uint32_t size, uint32_t *bytes_read) {
+    return (ssize_t)syscall4(50, (uint64_t)file, (uint64_t)buffer, size, (uint64_t)bytes_read);
+}
+
 static inline ssize_t socket_write(socket_file_t *file, const void *buffer, uint32_t size) {
     return (ssize_t)syscall3(34, (uint64_t)file, (uint64_t)buffer, size);
 }
@@ -348,6 +421,17 @@ static inline void reboot(void) {
     syscall0(42);
 }
 
+// Kernel allocation profiler
+#define MEMPROF_DISABLE 0
+#define MEMPROF_ENABLE  1
+#define MEMPROF_DUMP    2   // arg: visibility
+#define MEMPROF_LEAKS   3   // args: minimum age in seconds, visibility
+#define MEMPROF_RESET   4
+
+static inline int memprof(uint64_t cmd, uint64_t arg1, uint64_t arg2) {
+    return (int)syscall3(44, cmd, arg1, arg2);
+}
+
 // ==================== HELPER FUNCTIONS ====================
 
 // Simple strlen